@@ -0,0 +1,203 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "cache.h"
+#include "log.h"
+#include "globals.h"
+#include "settings.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Page cache management for regular files (option --nocache). The
+ * input reads ahead in a sliding window and drops what it has passed.
+ * The outputs start writeback of every window they have written,
+ * wait for the window before and then drop it. So only a few windows
+ * of the files occupy the page cache at any time, and the data is
+ * mostly on disk already when the output is synced at the end.
+ *
+ * Regular output files are also preallocated to the expected size
+ * (option --prealloc, or the size of the input file), so the file
+ * system can place them in few large extents. The space is reserved
+ * beyond the end of the file, so the file keeps its true size. Outputs
+ * of unknown size are extended in chunks ahead of the data. Space that
+ * is left over is released when the output is finished.
+ */
+
+#define CACHE_WINDOW (8 << 20)
+#define PREALLOC_CHUNK (64 << 20)
+
+static int InFd = -1;
+static off_t InPos, InEnd, Advised, Dropped;
+
+
+static void advise(int fd, off_t off, off_t len, int advice)
+{
+	(void) posix_fadvise(fd,off,len,advice);
+}
+
+
+static void writeback(int fd, off_t off, off_t len, int wait)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	(void) sync_file_range(fd,off,len,wait ? SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE);
+#else
+	/* dropping dirty pages has no effect */
+	if (wait)
+		(void) fdatasync(fd);
+#endif
+}
+
+
+void cacheInitInput(int fd)
+{
+	struct stat st;
+	off_t pos;
+
+	InFd = -1;
+	if (!NoCache || (-1 == fstat(fd,&st)) || !S_ISREG(st.st_mode))
+		return;
+	pos = lseek(fd,0,SEEK_CUR);
+	if (pos == -1)
+		return;
+	InFd = fd;
+	InPos = pos;
+	InEnd = st.st_size;
+	Advised = pos;
+	Dropped = pos;
+	advise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+	debugmsg("managing page cache of input\n");
+	cacheInput(0);
+}
+
+
+/* called by the input with the number of bytes consumed */
+void cacheInput(size_t n)
+{
+	if (InFd == -1)
+		return;
+	InPos += n;
+	while (Advised < InPos + 2 * CACHE_WINDOW) {
+		advise(InFd,Advised,CACHE_WINDOW,POSIX_FADV_WILLNEED);
+		Advised += CACHE_WINDOW;
+	}
+	if (InPos >= InEnd) {
+		/* drop the tail and what has been read ahead */
+		advise(InFd,Dropped,0,POSIX_FADV_DONTNEED);
+		InFd = -1;
+	} else if (InPos - Dropped >= CACHE_WINDOW) {
+		advise(InFd,Dropped,InPos - Dropped,POSIX_FADV_DONTNEED);
+		Dropped = InPos;
+	}
+}
+
+
+/* reserve space up to end, gives up on file systems without support */
+static void preallocate(dest_t *d, int fd, off_t end)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (0 == fallocate(fd,FALLOC_FL_KEEP_SIZE,d->allocated,end - d->allocated)) {
+		debugmsg("preallocated %s up to %lld bytes\n",d->arg,(long long)end);
+		d->allocated = end;
+		return;
+	}
+	if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+		warningmsg("unable to preallocate %s: %s\n",d->arg,strerror(errno));
+	else
+		debugmsg("preallocation is unsupported on %s\n",d->arg);
+#endif
+	d->allocated = 0;
+}
+
+
+/* expected number of bytes to write, 0 if unknown */
+static off_t expected(void)
+{
+	return (Prealloc > 0) ? Prealloc : InSize;
+}
+
+
+void cacheInitOutput(dest_t *d, int fd)
+{
+	struct stat st;
+	off_t pos;
+
+	d->cached = 0;
+	d->allocated = 0;
+	if ((!NoCache && !Prealloc) || (-1 == fstat(fd,&st)) || !S_ISREG(st.st_mode))
+		return;
+	pos = lseek(fd,0,(fcntl(fd,F_GETFL) & O_APPEND) ? SEEK_END : SEEK_CUR);
+	if (pos == -1)
+		return;
+	d->written = pos;
+	/* earlier volumes of option -D would keep their reserved space */
+	if (Prealloc && (OutVolsize == 0)) {
+		d->allocated = pos;
+		preallocate(d,fd,pos + (expected() ? expected() : PREALLOC_CHUNK));
+	}
+	if (NoCache) {
+		d->synced = pos;
+		d->dropped = pos;
+		d->cached = 1;
+		debugmsg("managing page cache of %s\n",d->arg);
+	}
+}
+
+
+/* called by the outputs with the number of bytes written */
+void cacheOutput(dest_t *d, int fd, size_t n)
+{
+	d->written += n;
+	/* keep half a chunk ahead if the size is unknown or was exceeded */
+	if (d->allocated && ((d->written > d->allocated) || (!expected() && (d->written + PREALLOC_CHUNK / 2 > d->allocated))))
+		preallocate(d,fd,d->written + PREALLOC_CHUNK);
+	if (!d->cached)
+		return;
+	if (d->written - d->synced < CACHE_WINDOW)
+		return;
+	writeback(fd,d->synced,d->written - d->synced,0);
+	if (d->synced > d->dropped) {
+		writeback(fd,d->dropped,d->synced - d->dropped,1);
+		advise(fd,d->dropped,d->synced - d->dropped,POSIX_FADV_DONTNEED);
+		d->dropped = d->synced;
+	}
+	d->synced = d->written;
+}
+
+
+/* called after the final sync of the output */
+void cacheFinishOutput(dest_t *d, int fd)
+{
+	struct stat st;
+
+	/* release the space reserved beyond the end of the file */
+	if (d->allocated && (0 == fstat(fd,&st)) && (d->allocated > st.st_size)) {
+		debugmsg("releasing preallocated space of %s beyond %lld bytes\n",d->arg,(long long)st.st_size);
+		if (-1 == ftruncate(fd,st.st_size))
+			warningmsg("unable to release preallocated space of %s: %s\n",d->arg,strerror(errno));
+	}
+	d->allocated = 0;
+	if (!d->cached)
+		return;
+	advise(fd,d->dropped,0,POSIX_FADV_DONTNEED);
+	d->cached = 0;
+}
@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "dest.h"
+
+#include <stddef.h>
+
+void cacheInitInput(int fd);
+void cacheInput(size_t n);
+void cacheInitOutput(dest_t *d, int fd);
+void cacheOutput(dest_t *d, int fd, size_t n);
+void cacheFinishOutput(dest_t *d, int fd);
+
+#endif
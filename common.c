@@ -26,24 +26,14 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-#ifdef __sun
-#if defined(__SunOS_5_8) || defined(__SunOS_5_9)
-int SemWait(sema_t *s)
-{
-	int err;
-	do {
-		err = sema_wait(s);
-	} while (err == EINTR);
-	return err;
-}
-#endif
-#endif
-
-
 static inline long long timediff(struct timespec *restrict t1, struct timespec *restrict t2)
 {
 	long long tdiff;
@@ -163,3 +153,129 @@ int disable_directio(int fd, const char *fn)
 	return 0;
 #endif
 }
+
+
+/*
+ * O_DIRECT needs buffers, sizes and file offsets that are aligned to
+ * the block size of the device. Unaligned transfers, like the tail of
+ * a file, fail with EINVAL. Such a transfer is repeated with O_DIRECT
+ * turned off just for it, so all aligned transfers keep bypassing the
+ * page cache. Only if an aligned transfer fails, O_DIRECT is disabled
+ * for good. Pass -1 as off to transfer at the file position. Returns
+ * the result of the repeated transfer, or -1 with errno set to EINVAL
+ * if O_DIRECT is not the cause.
+ */
+ssize_t directio_retryv(int fd, const char *fn, const struct iovec *iov, int cnt, off_t off, int wr)
+{
+#ifdef O_DIRECT
+	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+	off_t pos = (off == -1) ? lseek(fd,0,SEEK_CUR) : off;
+	int fl, i, aligned = (pos != -1) && (pos % PgSz == 0), err, e;
+	ssize_t ret;
+
+	for (i = 0; i < cnt; ++i) {
+		if (((uintptr_t)iov[i].iov_base % PgSz) || (iov[i].iov_len % PgSz))
+			aligned = 0;
+	}
+	/* parallel readers and senders may toggle the flag at the same time */
+	err = pthread_mutex_lock(&mtx);
+	assert(err == 0);
+	fl = fcntl(fd,F_GETFL);
+	if ((fl == -1) || ((fl & O_DIRECT) == 0)) {
+		err = pthread_mutex_unlock(&mtx);
+		assert(err == 0);
+		errno = EINVAL;
+		return -1;
+	}
+	if (aligned) {
+		err = pthread_mutex_unlock(&mtx);
+		assert(err == 0);
+		if (!disable_directio(fd,fn)) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else if (-1 == fcntl(fd,F_SETFL,fl & ~O_DIRECT)) {
+		warningmsg("disabling O_DIRECT on %s failed with %s\n",fn,strerror(errno));
+		err = pthread_mutex_unlock(&mtx);
+		assert(err == 0);
+		errno = EINVAL;
+		return -1;
+	} else {
+		debugiomsg("%s: unaligned transfer without O_DIRECT\n",fn);
+	}
+	if (off == -1)
+		ret = wr ? writev(fd,iov,cnt) : readv(fd,iov,cnt);
+	else
+		ret = wr ? pwritev(fd,iov,cnt,off) : preadv(fd,iov,cnt,off);
+	if (!aligned) {
+		e = errno;
+		if (-1 == fcntl(fd,F_SETFL,fl))
+			warningmsg("enabling O_DIRECT on %s failed with %s\n",fn,strerror(errno));
+		err = pthread_mutex_unlock(&mtx);
+		assert(err == 0);
+		errno = e;
+	}
+	return ret;
+#else
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+
+ssize_t directio_retry(int fd, const char *fn, void *buf, size_t n, off_t off, int wr)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	return directio_retryv(fd,fn,&iov,1,off,wr);
+}
+
+
+/* enlarge the pipe fd, so that it can take a whole block at once */
+void setPipeSize(int fd, const char *fn)
+{
+#ifdef F_SETPIPE_SZ
+	unsigned long long s;
+	int cur = fcntl(fd,F_GETPIPE_SZ);
+
+	if (cur == -1)
+		return;	/* not a pipe */
+	for (s = Blocksize > INT_MAX ? INT_MAX : Blocksize; s > (unsigned long long) cur; s >>= 1) {
+		if (-1 != fcntl(fd,F_SETPIPE_SZ,(int)s)) {
+			infomsg("set pipe size of %s to %d bytes\n",fn,fcntl(fd,F_GETPIPE_SZ));
+			return;
+		}
+	}
+	debugmsg("unable to enlarge pipe of %s beyond %d bytes\n",fn,cur);
+#endif
+}
+
+
+#define BATCH_SIZE (1 << 20)	/* bytes transferred at most by a vectored read or write */
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/*
+ * Number of consecutive blocks to transfer with a single readv or
+ * writev on fd. Only files, pipes and sockets are batched, because
+ * devices like tapes depend on the size of each request.
+ */
+unsigned batchBlocks(int fd)
+{
+	unsigned long long n = BATCH_SIZE / Blocksize;
+	struct stat st;
+
+	if ((n < 2) || (-1 == fstat(fd,&st)))
+		return 1;
+	if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+		return 1;
+	if (n > Numblocks / 2)
+		n = Numblocks / 2;
+	if (n > IOV_MAX)
+		n = IOV_MAX;
+	return n < 2 ? 1 : (unsigned) n;
+}
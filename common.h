@@ -21,24 +21,18 @@
 #define COMMON_H
 
 #include <sys/time.h>
+#include <sys/types.h>
 
-#ifdef __sun
-#include <synch.h>
-#define sem_t sema_t
-#define sem_init(a,b,c) sema_init(a,c,USYNC_THREAD,0)
-#define sem_post sema_post
-#define sem_getvalue(a,b) ((*(b) = (a)->count), 0)
-#if defined(__SunOS_5_8) || defined(__SunOS_5_9)
-#define sem_wait SemWait
-#else
-#define sem_wait sema_wait
-#endif
-#endif
+struct iovec;
 
 int mt_usleep(unsigned long long sleep_usecs);
 long long enforceSpeedLimit(unsigned long long limit, long long num, struct timespec *last);
 void releaseLock(void *l);
 void enable_directio(int fd, const char *fn);
 int disable_directio(int fd, const char *fn);
+ssize_t directio_retry(int fd, const char *fn, void *buf, size_t n, off_t off, int wr);
+ssize_t directio_retryv(int fd, const char *fn, const struct iovec *iov, int cnt, off_t off, int wr);
+void setPipeSize(int fd, const char *fn);
+unsigned batchBlocks(int fd);
 
 #endif
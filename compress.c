@@ -0,0 +1,232 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "compress.h"
+#include "log.h"
+#include "settings.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Compression of the blocks of framed transfers with lz4 and zstd. Like
+ * the hash libraries, the codec libraries are loaded at runtime, so
+ * mbuffer neither needs them to build nor to run.
+ */
+
+int Compression = CODEC_NONE, CompressLevel = 0;
+
+static void *LibLz4 = 0, *LibZstd = 0;
+
+static int (*LZ4_compress_fast)(const char *, char *, int, int, int);
+static int (*LZ4_decompress_safe)(const char *, char *, int, int);
+
+static void *(*ZSTD_createCCtx)(void);
+static size_t (*ZSTD_freeCCtx)(void *);
+static void *(*ZSTD_createDCtx)(void);
+static size_t (*ZSTD_freeDCtx)(void *);
+static size_t (*ZSTD_compressCCtx)(void *, void *, size_t, const void *, size_t, int);
+static size_t (*ZSTD_decompressDCtx)(void *, void *, size_t, const void *, size_t);
+static unsigned (*ZSTD_isError)(size_t);
+static int (*ZSTD_maxCLevel)(void);
+
+struct codec {
+	void *cctx, *dctx;	/* zstd contexts, created on first use */
+};
+
+
+static void initCodecLibs(void)
+{
+	LibLz4 = dlopen("liblz4.so.1",RTLD_NOW);
+	if (LibLz4) {
+		debugmsg("found liblz4\n");
+		LZ4_compress_fast = (int (*)(const char *, char *, int, int, int)) dlsym(LibLz4,"LZ4_compress_fast");
+		LZ4_decompress_safe = (int (*)(const char *, char *, int, int)) dlsym(LibLz4,"LZ4_decompress_safe");
+		if ((LZ4_compress_fast == 0) || (LZ4_decompress_safe == 0)) {
+			warningmsg("liblz4.so.1 does not contain all required symbols\n");
+			dlclose(LibLz4);
+			LibLz4 = 0;
+		}
+	}
+	LibZstd = dlopen("libzstd.so.1",RTLD_NOW);
+	if (LibZstd) {
+		debugmsg("found libzstd\n");
+		ZSTD_createCCtx = (void *(*)(void)) dlsym(LibZstd,"ZSTD_createCCtx");
+		ZSTD_freeCCtx = (size_t (*)(void *)) dlsym(LibZstd,"ZSTD_freeCCtx");
+		ZSTD_createDCtx = (void *(*)(void)) dlsym(LibZstd,"ZSTD_createDCtx");
+		ZSTD_freeDCtx = (size_t (*)(void *)) dlsym(LibZstd,"ZSTD_freeDCtx");
+		ZSTD_compressCCtx = (size_t (*)(void *, void *, size_t, const void *, size_t, int)) dlsym(LibZstd,"ZSTD_compressCCtx");
+		ZSTD_decompressDCtx = (size_t (*)(void *, void *, size_t, const void *, size_t)) dlsym(LibZstd,"ZSTD_decompressDCtx");
+		ZSTD_isError = (unsigned (*)(size_t)) dlsym(LibZstd,"ZSTD_isError");
+		ZSTD_maxCLevel = (int (*)(void)) dlsym(LibZstd,"ZSTD_maxCLevel");
+		if ((ZSTD_createCCtx == 0) || (ZSTD_freeCCtx == 0) || (ZSTD_createDCtx == 0) || (ZSTD_freeDCtx == 0)
+			|| (ZSTD_compressCCtx == 0) || (ZSTD_decompressDCtx == 0) || (ZSTD_isError == 0) || (ZSTD_maxCLevel == 0)) {
+			warningmsg("libzstd.so.1 does not contain all required symbols\n");
+			dlclose(LibZstd);
+			LibZstd = 0;
+		}
+	}
+}
+
+
+/* codecs of want that can be used */
+unsigned codecsAvailable(unsigned want)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	unsigned have = 0;
+
+	(void) pthread_once(&once,initCodecLibs);
+	if (LibLz4)
+		have |= CODEC_LZ4;
+	if (LibZstd)
+		have |= CODEC_ZSTD;
+	return want & have;
+}
+
+
+const char *codecName(int codec)
+{
+	switch (codec) {
+	case CODEC_LZ4:
+		return "lz4";
+	case CODEC_ZSTD:
+		return "zstd";
+	case CODEC_LZ4 | CODEC_ZSTD:
+		return "lz4 and zstd";
+	default:
+		return "none";
+	}
+}
+
+
+/*
+ * Parses the argument of option --compress: lz4, zstd, zstd:<level>,
+ * auto for a codec and level that adapt to the throughput of the
+ * network, or none.
+ */
+int compressSet(const char *spec)
+{
+	if (0 == strcmp(spec,"none")) {
+		Compression = CODEC_NONE;
+	} else if (0 == strcmp(spec,"auto")) {
+		Compression = CODEC_LZ4 | CODEC_ZSTD;
+		CompressLevel = -1;
+	} else if (0 == strcmp(spec,"lz4")) {
+		Compression = CODEC_LZ4;
+		CompressLevel = 1;
+	} else if (0 == strncmp(spec,"zstd",4)) {
+		Compression = CODEC_ZSTD;
+		CompressLevel = 3;
+		if (spec[4] == ':') {
+			char *e;
+			long l = strtol(spec + 5,&e,10);
+			if ((e == spec + 5) || (*e != 0) || (l < 1) || (l > 22))
+				return -1;
+			CompressLevel = l;
+		} else if (spec[4] != 0) {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* number of threads to compress or decompress with */
+unsigned codecThreads(void)
+{
+	long n;
+
+	if (CompressThreads)
+		return CompressThreads;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+}
+
+
+codec_t *codecOpen(void)
+{
+	codec_t *c = calloc(1,sizeof(codec_t));
+
+	if (c == 0)
+		fatal("out of memory\n");
+	return c;
+}
+
+
+void codecClose(codec_t *c)
+{
+	if (c->cctx)
+		(void) ZSTD_freeCCtx(c->cctx);
+	if (c->dctx)
+		(void) ZSTD_freeDCtx(c->dctx);
+	free(c);
+}
+
+
+/*
+ * Compresses n bytes of src into dst, which has room for n bytes.
+ * Returns the compressed size, or 0 if the data does not get smaller.
+ */
+size_t codecCompress(codec_t *c, int codec, int level, const char *src, size_t n, char *dst)
+{
+	if (codec == CODEC_LZ4) {
+		int r = LZ4_compress_fast(src,dst,n,n - 1,1);
+		return (r > 0) ? (size_t) r : 0;
+	}
+	if (codec == CODEC_ZSTD) {
+		size_t r;
+		if (c->cctx == 0) {
+			c->cctx = ZSTD_createCCtx();
+			if (c->cctx == 0)
+				return 0;
+		}
+		if (level > ZSTD_maxCLevel())
+			level = ZSTD_maxCLevel();
+		r = ZSTD_compressCCtx(c->cctx,dst,n - 1,src,n,level);
+		return ZSTD_isError(r) ? 0 : r;
+	}
+	return 0;
+}
+
+
+/* returns the decompressed size, or -1 if src is corrupt */
+ssize_t codecDecompress(codec_t *c, int codec, const char *src, size_t n, char *dst, size_t cap)
+{
+	if (codec == CODEC_LZ4) {
+		int r = LZ4_decompress_safe(src,dst,n,cap);
+		return (r >= 0) ? r : -1;
+	}
+	if (codec == CODEC_ZSTD) {
+		size_t r;
+		if (c->dctx == 0) {
+			c->dctx = ZSTD_createDCtx();
+			if (c->dctx == 0)
+				return -1;
+		}
+		r = ZSTD_decompressDCtx(c->dctx,dst,cap,src,n);
+		return ZSTD_isError(r) ? -1 : (ssize_t) r;
+	}
+	return -1;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* codecs, also used as feature bits of framed transfers */
+#define CODEC_NONE 0
+#define CODEC_LZ4 2
+#define CODEC_ZSTD 4
+
+extern int Compression;		/* codec selected with option --compress */
+extern int CompressLevel;	/* level of the codec, -1 for adaptive */
+
+typedef struct codec codec_t;
+
+int compressSet(const char *spec);
+unsigned codecsAvailable(unsigned want);
+const char *codecName(int codec);
+unsigned codecThreads(void);
+codec_t *codecOpen(void);
+void codecClose(codec_t *c);
+size_t codecCompress(codec_t *c, int codec, int level, const char *src, size_t n, char *dst);
+ssize_t codecDecompress(codec_t *c, int codec, const char *src, size_t n, char *dst, size_t cap);
+
+#endif
@@ -21,15 +21,24 @@
 #define DEST_H
 
 #include <pthread.h>
+#include <sys/types.h>
 
 typedef struct destination {
 	struct destination *next;
 	const char *arg, *name, *port, *result;
 	int fd;
 	int mode;
+	volatile unsigned inflight;	/* io_uring writes in flight */
+	volatile int active;		/* takes part in releasing blocks */
+	volatile unsigned long long cursor;	/* number of blocks done */
+	off_t written, synced, dropped;	/* offsets for option --nocache */
+	int cached;			/* page cache is managed */
+	off_t allocated;		/* end of the preallocated space, 0 for none */
 	pthread_t thread;
 } dest_t;
 
-int syncSenders(char *b, int s);
+int nextBlock(unsigned long long n, int wait);
+void finishBlocks(dest_t *d, unsigned long long n);
+void leaveSenders(dest_t *d);
 
 #endif
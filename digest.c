@@ -0,0 +1,1241 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "digest.h"
+#include "log.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined __x86_64__ && defined __GNUC__
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+/*
+ * Built-in hash algorithms that are fast enough to keep up with the
+ * transfer: CRC32C, XXH3 and XXH128 of xxHash, and BLAKE3. They need no
+ * library, and on x86-64 the kernels that use SSE4.2, AVX2, or AVX-512
+ * are chosen at runtime according to the CPU.
+ */
+
+static pthread_once_t KernelOnce = PTHREAD_ONCE_INIT;
+
+static void initKernels(void);
+
+
+static inline uint32_t rd32(const unsigned char *p)
+{
+	uint32_t v;
+
+	(void) memcpy(&v,p,4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+
+static inline uint64_t rd64(const unsigned char *p)
+{
+	uint64_t v;
+
+	(void) memcpy(&v,p,8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+
+static inline void wr32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+
+/* big endian, as digests are printed */
+static void wrbe(unsigned char *p, uint64_t v, unsigned n)
+{
+	while (n--) {
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+
+/* CRC32C (Castagnoli), reflected */
+#define CRC_POLY 0x82f63b78
+#define CRC_SPLIT 4096		/* bytes per lane of the interleaved kernel */
+
+static uint32_t CrcTab[8][256];
+static uint32_t CrcShift;	/* x^(8*CRC_SPLIT) mod P, to join the lanes */
+static uint32_t (*CrcKernel)(uint32_t, const unsigned char *, size_t);
+
+
+/* raw CRC register update with eight lookup tables, 8 bytes per step */
+static uint32_t crcTable(uint32_t crc, const unsigned char *b, size_t len)
+{
+	while (len && ((uintptr_t)b & 7)) {
+		crc = (crc >> 8) ^ CrcTab[0][(crc ^ *b++) & 0xff];
+		--len;
+	}
+	while (len >= 8) {
+		uint32_t lo = crc ^ rd32(b);
+		crc = CrcTab[7][lo & 0xff] ^ CrcTab[6][(lo >> 8) & 0xff]
+			^ CrcTab[5][(lo >> 16) & 0xff] ^ CrcTab[4][lo >> 24]
+			^ CrcTab[3][b[4]] ^ CrcTab[2][b[5]] ^ CrcTab[1][b[6]] ^ CrcTab[0][b[7]];
+		b += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ CrcTab[0][(crc ^ *b++) & 0xff];
+	return crc;
+}
+
+
+/* a * b mod P of two reflected polynomials */
+static uint32_t crcMultiply(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	while (m) {
+		if (a & m)
+			p ^= b;
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+	}
+	return p;
+}
+
+
+#ifdef X86_KERNELS
+/*
+ * The crc32 instruction has a latency of three cycles, but a throughput
+ * of one per cycle. So three lanes of CRC_SPLIT bytes are processed
+ * interleaved and joined afterwards: appending n bytes to a message
+ * multiplies the CRC register of it with x^(8n).
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const unsigned char *b, size_t len)
+{
+	uint64_t c = crc;
+
+	while (len && ((uintptr_t)b & 7)) {
+		c = _mm_crc32_u8(c,*b++);
+		--len;
+	}
+	while (len >= 3 * CRC_SPLIT) {
+		uint64_t c1 = 0, c2 = 0;
+		size_t i;
+		for (i = 0; i < CRC_SPLIT; i += 8) {
+			c = _mm_crc32_u64(c,rd64(b + i));
+			c1 = _mm_crc32_u64(c1,rd64(b + CRC_SPLIT + i));
+			c2 = _mm_crc32_u64(c2,rd64(b + 2 * CRC_SPLIT + i));
+		}
+		c = crcMultiply(crcMultiply(c,CrcShift) ^ c1,CrcShift) ^ c2;
+		b += 3 * CRC_SPLIT;
+		len -= 3 * CRC_SPLIT;
+	}
+	while (len >= 8) {
+		c = _mm_crc32_u64(c,rd64(b));
+		b += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c,*b++);
+	return c;
+}
+#endif
+
+
+static void initCrc(void)
+{
+	static const unsigned char zero[CRC_SPLIT];
+	unsigned i, j;
+
+	for (i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (j = 0; j < 8; ++j)
+			c = (c >> 1) ^ ((c & 1) ? CRC_POLY : 0);
+		CrcTab[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i) {
+		for (j = 1; j < 8; ++j)
+			CrcTab[j][i] = (CrcTab[j-1][i] >> 8) ^ CrcTab[0][CrcTab[j-1][i] & 0xff];
+	}
+	/* feeding zeros to the register holding 1 yields the power of x */
+	CrcShift = crcTable(1U << 31,zero,sizeof(zero));
+	CrcKernel = crcTable;
+#ifdef X86_KERNELS
+	if (__builtin_cpu_supports("sse4.2"))
+		CrcKernel = crcSse42;
+#endif
+}
+
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	(void) pthread_once(&KernelOnce,initKernels);
+	return ~CrcKernel(~crc,buf,len);
+}
+
+
+/* XXH3 and XXH128 of xxHash 0.8 with the default secret and seed 0 */
+#define P32_1 0x9E3779B1U
+#define P32_2 0x85EBCA77U
+#define P32_3 0xC2B2AE3DU
+#define P64_1 0x9E3779B185EBCA87ULL
+#define P64_2 0xC2B2AE3D27D4EB4FULL
+#define P64_3 0x165667B19E3779F9ULL
+#define P64_4 0x85EBCA77C2B2AE63ULL
+#define P64_5 0x27D4EB2F165667C5ULL
+#define PMX_1 0x165667919E3779F9ULL
+#define PMX_2 0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE 64
+#define XXH_BLOCK 16		/* stripes per block */
+#define XXH_BUFFER 256
+#define XXH_SECRET 192
+
+static const unsigned char XxhSecret[XXH_SECRET] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+typedef struct {
+	uint64_t lo, hi;
+} u128_t;
+
+typedef struct {
+	uint64_t acc[8];
+	unsigned char buf[XXH_BUFFER];	/* input not consumed yet */
+	size_t buffered;
+	unsigned stripes;		/* stripes consumed of the current block */
+	unsigned long long total;
+} xxh3_t;
+
+static void (*XxhKernel)(uint64_t *, const unsigned char *, const unsigned char *, size_t);
+
+
+static inline u128_t mul128(uint64_t a, uint64_t b)
+{
+	u128_t r;
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128) a * b;
+	r.lo = (uint64_t) p;
+	r.hi = (uint64_t) (p >> 64);
+#else
+	uint64_t ll = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t hl = (a >> 32) * (b & 0xffffffff);
+	uint64_t lh = (a & 0xffffffff) * (b >> 32);
+	uint64_t cross = (ll >> 32) + (hl & 0xffffffff) + lh;
+	r.hi = (hl >> 32) + (cross >> 32) + (a >> 32) * (b >> 32);
+	r.lo = (cross << 32) | (ll & 0xffffffff);
+#endif
+	return r;
+}
+
+
+static inline uint64_t mulFold(uint64_t a, uint64_t b)
+{
+	u128_t r = mul128(a,b);
+	return r.lo ^ r.hi;
+}
+
+
+static inline uint64_t rotl64(uint64_t v, unsigned r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+
+static inline uint64_t xxh64Avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	return h ^ (h >> 32);
+}
+
+
+static inline uint64_t xxh3Avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PMX_1;
+	return h ^ (h >> 32);
+}
+
+
+static inline uint64_t mix16(const unsigned char *in, const unsigned char *sec)
+{
+	return mulFold(rd64(in) ^ rd64(sec),rd64(in + 8) ^ rd64(sec + 8));
+}
+
+
+static inline u128_t mix32(u128_t acc, const unsigned char *a, const unsigned char *b, const unsigned char *sec)
+{
+	acc.lo += mix16(a,sec);
+	acc.lo ^= rd64(b) + rd64(b + 8);
+	acc.hi += mix16(b,sec + 16);
+	acc.hi ^= rd64(a) + rd64(a + 8);
+	return acc;
+}
+
+
+/* XXH3 of inputs up to 240 bytes */
+static uint64_t xxh3Short(const unsigned char *in, size_t len)
+{
+	const unsigned char *s = XxhSecret;
+	uint64_t acc;
+	size_t i;
+
+	if (len == 0)
+		return xxh64Avalanche(rd64(s + 56) ^ rd64(s + 64));
+	if (len <= 3) {
+		uint32_t c = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) | in[len - 1] | ((uint32_t)len << 8);
+		return xxh64Avalanche(c ^ (uint64_t)(rd32(s) ^ rd32(s + 4)));
+	}
+	if (len <= 8) {
+		uint64_t h = (rd32(in + len - 4) + ((uint64_t)rd32(in) << 32)) ^ (rd64(s + 8) ^ rd64(s + 16));
+		h ^= rotl64(h,49) ^ rotl64(h,24);
+		h *= PMX_2;
+		h ^= (h >> 35) + len;
+		h *= PMX_2;
+		return h ^ (h >> 28);
+	}
+	if (len <= 16) {
+		uint64_t lo = rd64(in) ^ (rd64(s + 24) ^ rd64(s + 32));
+		uint64_t hi = rd64(in + len - 8) ^ (rd64(s + 40) ^ rd64(s + 48));
+		return xxh3Avalanche(len + __builtin_bswap64(lo) + hi + mulFold(lo,hi));
+	}
+	acc = len * P64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += mix16(in + 48,s + 96);
+					acc += mix16(in + len - 64,s + 112);
+				}
+				acc += mix16(in + 32,s + 64);
+				acc += mix16(in + len - 48,s + 80);
+			}
+			acc += mix16(in + 16,s + 32);
+			acc += mix16(in + len - 32,s + 48);
+		}
+		acc += mix16(in,s);
+		acc += mix16(in + len - 16,s + 16);
+		return xxh3Avalanche(acc);
+	}
+	for (i = 0; i < 8; ++i)
+		acc += mix16(in + 16 * i,s + 16 * i);
+	acc = xxh3Avalanche(acc);
+	for (i = 8; i < len / 16; ++i)
+		acc += mix16(in + 16 * i,s + 16 * (i - 8) + 3);
+	acc += mix16(in + len - 16,s + 136 - 17);
+	return xxh3Avalanche(acc);
+}
+
+
+/* XXH128 of inputs up to 240 bytes */
+static u128_t xxh128Short(const unsigned char *in, size_t len)
+{
+	const unsigned char *s = XxhSecret;
+	u128_t h, acc;
+	size_t i;
+
+	if (len == 0) {
+		h.lo = xxh64Avalanche(rd64(s + 64) ^ rd64(s + 72));
+		h.hi = xxh64Avalanche(rd64(s + 80) ^ rd64(s + 88));
+		return h;
+	}
+	if (len <= 3) {
+		uint32_t cl = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) | in[len - 1] | ((uint32_t)len << 8);
+		uint32_t ch = __builtin_bswap32(cl);
+		ch = (ch << 13) | (ch >> 19);
+		h.lo = xxh64Avalanche(cl ^ (uint64_t)(rd32(s) ^ rd32(s + 4)));
+		h.hi = xxh64Avalanche(ch ^ (uint64_t)(rd32(s + 8) ^ rd32(s + 12)));
+		return h;
+	}
+	if (len <= 8) {
+		uint64_t k = (rd32(in) + ((uint64_t)rd32(in + len - 4) << 32)) ^ (rd64(s + 16) ^ rd64(s + 24));
+		h = mul128(k,P64_1 + (len << 2));
+		h.hi += h.lo << 1;
+		h.lo ^= h.hi >> 3;
+		h.lo ^= h.lo >> 35;
+		h.lo *= PMX_2;
+		h.lo ^= h.lo >> 28;
+		h.hi = xxh3Avalanche(h.hi);
+		return h;
+	}
+	if (len <= 16) {
+		uint64_t lo = rd64(in), hi = rd64(in + len - 8);
+		u128_t m = mul128(lo ^ hi ^ (rd64(s + 32) ^ rd64(s + 40)),P64_1);
+		m.lo += (uint64_t)(len - 1) << 54;
+		hi ^= rd64(s + 48) ^ rd64(s + 56);
+		m.hi += hi + (hi & 0xffffffff) * (P32_2 - 1);
+		m.lo ^= __builtin_bswap64(m.hi);
+		h = mul128(m.lo,P64_2);
+		h.hi += m.hi * P64_2;
+		h.lo = xxh3Avalanche(h.lo);
+		h.hi = xxh3Avalanche(h.hi);
+		return h;
+	}
+	acc.lo = len * P64_1;
+	acc.hi = 0;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96)
+					acc = mix32(acc,in + 48,in + len - 64,s + 96);
+				acc = mix32(acc,in + 32,in + len - 48,s + 64);
+			}
+			acc = mix32(acc,in + 16,in + len - 32,s + 32);
+		}
+		acc = mix32(acc,in,in + len - 16,s);
+	} else {
+		for (i = 0; i < 4; ++i)
+			acc = mix32(acc,in + 32 * i,in + 32 * i + 16,s + 32 * i);
+		acc.lo = xxh3Avalanche(acc.lo);
+		acc.hi = xxh3Avalanche(acc.hi);
+		for (i = 4; i < len / 32; ++i)
+			acc = mix32(acc,in + 32 * i,in + 32 * i + 16,s + 3 + 32 * (i - 4));
+		acc = mix32(acc,in + len - 16,in + len - 32,s + 136 - 17 - 16);
+	}
+	h.lo = xxh3Avalanche(acc.lo + acc.hi);
+	h.hi = 0 - xxh3Avalanche(acc.lo * P64_1 + acc.hi * P64_4 + len * P64_2);
+	return h;
+}
+
+
+/* accumulates n stripes of 64 bytes, advancing the secret by 8 bytes per stripe */
+static void xxhScalar(uint64_t *acc, const unsigned char *in, const unsigned char *sec, size_t n)
+{
+	for (; n; --n, in += XXH_STRIPE, sec += 8) {
+		unsigned i;
+		for (i = 0; i < 8; ++i) {
+			uint64_t v = rd64(in + 8 * i), k = v ^ rd64(sec + 8 * i);
+			acc[i ^ 1] += v;
+			acc[i] += (k & 0xffffffff) * (k >> 32);
+		}
+	}
+}
+
+
+#ifdef X86_KERNELS
+__attribute__((target("avx2")))
+static void xxhAvx2(uint64_t *acc, const unsigned char *in, const unsigned char *sec, size_t n)
+{
+	__m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+	__m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+
+	for (; n; --n, in += XXH_STRIPE, sec += 8) {
+		__m256i d0 = _mm256_loadu_si256((const __m256i *)in);
+		__m256i d1 = _mm256_loadu_si256((const __m256i *)(in + 32));
+		__m256i k0 = _mm256_xor_si256(d0,_mm256_loadu_si256((const __m256i *)sec));
+		__m256i k1 = _mm256_xor_si256(d1,_mm256_loadu_si256((const __m256i *)(sec + 32)));
+		a0 = _mm256_add_epi64(a0,_mm256_shuffle_epi32(d0,_MM_SHUFFLE(1,0,3,2)));
+		a1 = _mm256_add_epi64(a1,_mm256_shuffle_epi32(d1,_MM_SHUFFLE(1,0,3,2)));
+		a0 = _mm256_add_epi64(a0,_mm256_mul_epu32(k0,_mm256_shuffle_epi32(k0,_MM_SHUFFLE(0,3,0,1))));
+		a1 = _mm256_add_epi64(a1,_mm256_mul_epu32(k1,_mm256_shuffle_epi32(k1,_MM_SHUFFLE(0,3,0,1))));
+	}
+	_mm256_storeu_si256((__m256i *)acc,a0);
+	_mm256_storeu_si256((__m256i *)(acc + 4),a1);
+}
+
+
+__attribute__((target("avx512f")))
+static void xxhAvx512(uint64_t *acc, const unsigned char *in, const unsigned char *sec, size_t n)
+{
+	__m512i a = _mm512_loadu_si512(acc);
+
+	for (; n; --n, in += XXH_STRIPE, sec += 8) {
+		__m512i d = _mm512_loadu_si512(in);
+		__m512i k = _mm512_xor_si512(d,_mm512_loadu_si512(sec));
+		a = _mm512_add_epi64(a,_mm512_shuffle_epi32(d,(_MM_PERM_ENUM)_MM_SHUFFLE(1,0,3,2)));
+		a = _mm512_add_epi64(a,_mm512_mul_epu32(k,_mm512_shuffle_epi32(k,(_MM_PERM_ENUM)_MM_SHUFFLE(0,3,0,1))));
+	}
+	_mm512_storeu_si512(acc,a);
+}
+#endif
+
+
+static void xxhScramble(uint64_t *acc)
+{
+	const unsigned char *sec = XxhSecret + XXH_SECRET - XXH_STRIPE;
+	unsigned i;
+
+	for (i = 0; i < 8; ++i) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= rd64(sec + 8 * i);
+		acc[i] = a * P32_1;
+	}
+}
+
+
+/* consumes n stripes, scrambling the accumulators after every block */
+static void xxhConsume(xxh3_t *x, const unsigned char *in, size_t n)
+{
+	while (n) {
+		size_t k = XXH_BLOCK - x->stripes;
+		if (k > n)
+			k = n;
+		XxhKernel(x->acc,in,XxhSecret + 8 * x->stripes,k);
+		x->stripes += k;
+		in += k * XXH_STRIPE;
+		n -= k;
+		if (x->stripes == XXH_BLOCK) {
+			xxhScramble(x->acc);
+			x->stripes = 0;
+		}
+	}
+}
+
+
+static void *xxh3Init(void)
+{
+	xxh3_t *x = calloc(1,sizeof(xxh3_t));
+
+	if (x == 0)
+		fatal("out of memory\n");
+	x->acc[0] = P32_3;
+	x->acc[1] = P64_1;
+	x->acc[2] = P64_2;
+	x->acc[3] = P64_3;
+	x->acc[4] = P64_4;
+	x->acc[5] = P32_2;
+	x->acc[6] = P64_5;
+	x->acc[7] = P32_1;
+	return x;
+}
+
+
+/*
+ * Input is consumed in whole stripes, but at least one byte is kept
+ * back, because the last stripe is treated differently. The previous
+ * stripe stays at the end of the buffer, as the last stripe may have
+ * to be completed with it.
+ */
+static void xxh3Update(void *ctx, const void *buf, size_t len)
+{
+	xxh3_t *x = ctx;
+	const unsigned char *in = buf;
+
+	x->total += len;
+	if (x->buffered + len <= XXH_BUFFER) {
+		(void) memcpy(x->buf + x->buffered,in,len);
+		x->buffered += len;
+		return;
+	}
+	if (x->buffered) {
+		size_t k = XXH_BUFFER - x->buffered;
+		(void) memcpy(x->buf + x->buffered,in,k);
+		in += k;
+		len -= k;
+		xxhConsume(x,x->buf,XXH_BUFFER / XXH_STRIPE);
+		x->buffered = 0;
+	}
+	if (len > XXH_BUFFER) {
+		size_t n = (len - 1) / XXH_STRIPE;
+		xxhConsume(x,in,n);
+		in += n * XXH_STRIPE;
+		len -= n * XXH_STRIPE;
+		(void) memcpy(x->buf + XXH_BUFFER - XXH_STRIPE,in - XXH_STRIPE,XXH_STRIPE);
+	}
+	(void) memcpy(x->buf,in,len);
+	x->buffered = len;
+}
+
+
+/* consumes the rest of a long input, including the last stripe */
+static void xxh3Finish(xxh3_t *x)
+{
+	unsigned char tmp[XXH_STRIPE];
+	const unsigned char *last;
+
+	if (x->buffered >= XXH_STRIPE) {
+		xxhConsume(x,x->buf,(x->buffered - 1) / XXH_STRIPE);
+		last = x->buf + x->buffered - XXH_STRIPE;
+	} else {
+		size_t c = XXH_STRIPE - x->buffered;
+		(void) memcpy(tmp,x->buf + XXH_BUFFER - c,c);
+		(void) memcpy(tmp + c,x->buf,x->buffered);
+		last = tmp;
+	}
+	XxhKernel(x->acc,last,XxhSecret + XXH_SECRET - XXH_STRIPE - 7,1);
+}
+
+
+static uint64_t xxhMerge(const uint64_t *acc, const unsigned char *sec, uint64_t start)
+{
+	unsigned i;
+
+	for (i = 0; i < 4; ++i)
+		start += mulFold(acc[2 * i] ^ rd64(sec + 16 * i),acc[2 * i + 1] ^ rd64(sec + 16 * i + 8));
+	return xxh3Avalanche(start);
+}
+
+
+static void xxh3Final(void *ctx, unsigned char *md)
+{
+	xxh3_t *x = ctx;
+	uint64_t h;
+
+	if (x->total <= 240) {
+		h = xxh3Short(x->buf,x->total);
+	} else {
+		xxh3Finish(x);
+		h = xxhMerge(x->acc,XxhSecret + 11,x->total * P64_1);
+	}
+	wrbe(md,h,8);
+}
+
+
+static void xxh128Final(void *ctx, unsigned char *md)
+{
+	xxh3_t *x = ctx;
+	u128_t h;
+
+	if (x->total <= 240) {
+		h = xxh128Short(x->buf,x->total);
+	} else {
+		xxh3Finish(x);
+		h.lo = xxhMerge(x->acc,XxhSecret + 11,x->total * P64_1);
+		h.hi = xxhMerge(x->acc,XxhSecret + XXH_SECRET - XXH_STRIPE - 11,~(x->total * P64_2));
+	}
+	wrbe(md,h.hi,8);
+	wrbe(md + 8,h.lo,8);
+}
+
+
+/* BLAKE3 */
+#define B3_BLOCK 64
+#define B3_CHUNK 1024
+#define B3_BATCH 16		/* most chunks passed to the kernel at once */
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t B3IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* message word permutation of every round */
+static const unsigned char B3Sched[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+typedef struct {
+	uint32_t cv[8];			/* chaining value of the current chunk */
+	unsigned char block[B3_BLOCK];
+	unsigned blen, blocks;		/* bytes in block, blocks compressed */
+	uint64_t chunk;			/* number of the current chunk */
+	uint32_t stack[54][8];		/* roots of complete subtrees */
+	unsigned depth;
+} blake3_t;
+
+static void (*B3Kernel)(const unsigned char *, uint64_t, size_t, uint32_t (*)[8]);
+
+
+static inline uint32_t rotr32(uint32_t v, unsigned r)
+{
+	return (v >> r) | (v << (32 - r));
+}
+
+
+#define G(a,b,c,d,x,y) \
+	do { \
+		a += b + (x); d = rotr32(d ^ a,16); c += d; b = rotr32(b ^ c,12); \
+		a += b + (y); d = rotr32(d ^ a,8); c += d; b = rotr32(b ^ c,7); \
+	} while (0)
+
+
+static void b3Compress(const uint32_t cv[8], const unsigned char *block, unsigned blen, uint64_t counter, unsigned flags, uint32_t out[16])
+{
+	uint32_t m[16], v[16];
+	unsigned i, r;
+
+	for (i = 0; i < 16; ++i)
+		m[i] = rd32(block + 4 * i);
+	for (i = 0; i < 8; ++i)
+		v[i] = cv[i];
+	v[8] = B3IV[0];
+	v[9] = B3IV[1];
+	v[10] = B3IV[2];
+	v[11] = B3IV[3];
+	v[12] = (uint32_t) counter;
+	v[13] = (uint32_t) (counter >> 32);
+	v[14] = blen;
+	v[15] = flags;
+	for (r = 0; r < 7; ++r) {
+		const unsigned char *s = B3Sched[r];
+		G(v[0],v[4],v[8],v[12],m[s[0]],m[s[1]]);
+		G(v[1],v[5],v[9],v[13],m[s[2]],m[s[3]]);
+		G(v[2],v[6],v[10],v[14],m[s[4]],m[s[5]]);
+		G(v[3],v[7],v[11],v[15],m[s[6]],m[s[7]]);
+		G(v[0],v[5],v[10],v[15],m[s[8]],m[s[9]]);
+		G(v[1],v[6],v[11],v[12],m[s[10]],m[s[11]]);
+		G(v[2],v[7],v[8],v[13],m[s[12]],m[s[13]]);
+		G(v[3],v[4],v[9],v[14],m[s[14]],m[s[15]]);
+	}
+	for (i = 0; i < 8; ++i) {
+		out[i] = v[i] ^ v[i + 8];
+		out[i + 8] = v[i + 8] ^ cv[i];
+	}
+}
+
+
+/* chaining values of n whole chunks, numbered from counter */
+static void b3Chunks(const unsigned char *in, uint64_t counter, size_t n, uint32_t (*cvs)[8])
+{
+	for (; n; --n, in += B3_CHUNK, ++counter, ++cvs) {
+		uint32_t out[16];
+		unsigned b;
+		(void) memcpy(out,B3IV,sizeof(B3IV));
+		for (b = 0; b < B3_CHUNK / B3_BLOCK; ++b)
+			b3Compress(out,in + b * B3_BLOCK,B3_BLOCK,counter,(b == 0 ? CHUNK_START : 0) | (b == B3_CHUNK / B3_BLOCK - 1 ? CHUNK_END : 0),out);
+		(void) memcpy(*cvs,out,32);
+	}
+}
+
+
+#ifdef X86_KERNELS
+#define ROTR(v,r) _mm256_or_si256(_mm256_srli_epi32(v,r),_mm256_slli_epi32(v,32 - r))
+#define G8(a,b,c,d,x,y) \
+	do { \
+		a = _mm256_add_epi32(_mm256_add_epi32(a,b),x); \
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d,a),rot16); \
+		c = _mm256_add_epi32(c,d); \
+		b = ROTR(_mm256_xor_si256(b,c),12); \
+		a = _mm256_add_epi32(_mm256_add_epi32(a,b),y); \
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d,a),rot8); \
+		c = _mm256_add_epi32(c,d); \
+		b = ROTR(_mm256_xor_si256(b,c),7); \
+	} while (0)
+#define ROUND(G,r) \
+	do { \
+		G(v[0],v[4],v[8],v[12],m[B3Sched[r][0]],m[B3Sched[r][1]]); \
+		G(v[1],v[5],v[9],v[13],m[B3Sched[r][2]],m[B3Sched[r][3]]); \
+		G(v[2],v[6],v[10],v[14],m[B3Sched[r][4]],m[B3Sched[r][5]]); \
+		G(v[3],v[7],v[11],v[15],m[B3Sched[r][6]],m[B3Sched[r][7]]); \
+		G(v[0],v[5],v[10],v[15],m[B3Sched[r][8]],m[B3Sched[r][9]]); \
+		G(v[1],v[6],v[11],v[12],m[B3Sched[r][10]],m[B3Sched[r][11]]); \
+		G(v[2],v[7],v[8],v[13],m[B3Sched[r][12]],m[B3Sched[r][13]]); \
+		G(v[3],v[4],v[9],v[14],m[B3Sched[r][14]],m[B3Sched[r][15]]); \
+	} while (0)
+#define ROUNDS(G) \
+	do { \
+		ROUND(G,0); ROUND(G,1); ROUND(G,2); ROUND(G,3); \
+		ROUND(G,4); ROUND(G,5); ROUND(G,6); \
+	} while (0)
+
+/* turns eight rows of eight words into eight columns */
+__attribute__((target("avx2")))
+static inline void transpose8(__m256i *v)
+{
+	__m256i t[8], u[8];
+	unsigned i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(v[i],v[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(v[i],v[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i],t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i],t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1],t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1],t[i + 3]);
+	}
+	for (i = 0; i < 4; ++i) {
+		v[i] = _mm256_permute2x128_si256(u[i],u[i + 4],0x20);
+		v[i + 4] = _mm256_permute2x128_si256(u[i],u[i + 4],0x31);
+	}
+}
+
+
+/*
+ * Hashes eight chunks at once with every vector lane holding the state
+ * of one chunk. Fewer chunks are left to the portable kernel.
+ */
+__attribute__((target("avx2")))
+static void b3Avx2(const unsigned char *in, uint64_t counter, size_t n, uint32_t (*cvs)[8])
+{
+	const __m256i rot16 = _mm256_setr_epi8(2,3,0,1,6,7,4,5,10,11,8,9,14,15,12,13,2,3,0,1,6,7,4,5,10,11,8,9,14,15,12,13);
+	const __m256i rot8 = _mm256_setr_epi8(1,2,3,0,5,6,7,4,9,10,11,8,13,14,15,12,1,2,3,0,5,6,7,4,9,10,11,8,13,14,15,12);
+
+	for (; n >= 8; n -= 8, in += 8 * B3_CHUNK, counter += 8, cvs += 8) {
+		uint32_t lo[8], hi[8];
+		__m256i h[8], clo, chi;
+		unsigned b, i;
+
+		for (i = 0; i < 8; ++i) {
+			h[i] = _mm256_set1_epi32(B3IV[i]);
+			lo[i] = (uint32_t) (counter + i);
+			hi[i] = (uint32_t) ((counter + i) >> 32);
+		}
+		clo = _mm256_loadu_si256((const __m256i *)lo);
+		chi = _mm256_loadu_si256((const __m256i *)hi);
+		for (b = 0; b < B3_CHUNK / B3_BLOCK; ++b) {
+			__m256i m[16], v[16];
+			for (i = 0; i < 8; ++i) {
+				m[i] = _mm256_loadu_si256((const __m256i *)(in + i * B3_CHUNK + b * B3_BLOCK));
+				m[i + 8] = _mm256_loadu_si256((const __m256i *)(in + i * B3_CHUNK + b * B3_BLOCK + 32));
+			}
+			transpose8(m);
+			transpose8(m + 8);
+			for (i = 0; i < 8; ++i)
+				v[i] = h[i];
+			v[8] = _mm256_set1_epi32(B3IV[0]);
+			v[9] = _mm256_set1_epi32(B3IV[1]);
+			v[10] = _mm256_set1_epi32(B3IV[2]);
+			v[11] = _mm256_set1_epi32(B3IV[3]);
+			v[12] = clo;
+			v[13] = chi;
+			v[14] = _mm256_set1_epi32(B3_BLOCK);
+			v[15] = _mm256_set1_epi32((b == 0 ? CHUNK_START : 0) | (b == B3_CHUNK / B3_BLOCK - 1 ? CHUNK_END : 0));
+			ROUNDS(G8);
+			for (i = 0; i < 8; ++i)
+				h[i] = _mm256_xor_si256(v[i],v[i + 8]);
+		}
+		transpose8(h);
+		for (i = 0; i < 8; ++i)
+			_mm256_storeu_si256((__m256i *)cvs[i],h[i]);
+	}
+	b3Chunks(in,counter,n,cvs);
+}
+
+
+#define G16(a,b,c,d,x,y) \
+	do { \
+		a = _mm512_add_epi32(_mm512_add_epi32(a,b),x); \
+		d = _mm512_ror_epi32(_mm512_xor_si512(d,a),16); \
+		c = _mm512_add_epi32(c,d); \
+		b = _mm512_ror_epi32(_mm512_xor_si512(b,c),12); \
+		a = _mm512_add_epi32(_mm512_add_epi32(a,b),y); \
+		d = _mm512_ror_epi32(_mm512_xor_si512(d,a),8); \
+		c = _mm512_add_epi32(c,d); \
+		b = _mm512_ror_epi32(_mm512_xor_si512(b,c),7); \
+	} while (0)
+
+/* turns sixteen rows of sixteen words into sixteen columns */
+__attribute__((target("avx512f")))
+static inline void transpose16(__m512i *v)
+{
+	__m512i t[16], u[16];
+	unsigned i;
+
+	for (i = 0; i < 16; i += 2) {
+		t[i] = _mm512_unpacklo_epi32(v[i],v[i + 1]);
+		t[i + 1] = _mm512_unpackhi_epi32(v[i],v[i + 1]);
+	}
+	for (i = 0; i < 16; i += 4) {
+		u[i] = _mm512_unpacklo_epi64(t[i],t[i + 2]);
+		u[i + 1] = _mm512_unpackhi_epi64(t[i],t[i + 2]);
+		u[i + 2] = _mm512_unpacklo_epi64(t[i + 1],t[i + 3]);
+		u[i + 3] = _mm512_unpackhi_epi64(t[i + 1],t[i + 3]);
+	}
+	/* u[4g+k] holds word 4l+k of rows 4g..4g+3 in its 128 bit lane l */
+	for (i = 0; i < 4; ++i) {
+		__m512i a = _mm512_shuffle_i32x4(u[i],u[i + 4],0x88);
+		__m512i b = _mm512_shuffle_i32x4(u[i],u[i + 4],0xdd);
+		__m512i c = _mm512_shuffle_i32x4(u[i + 8],u[i + 12],0x88);
+		__m512i d = _mm512_shuffle_i32x4(u[i + 8],u[i + 12],0xdd);
+		v[i] = _mm512_shuffle_i32x4(a,c,0x88);
+		v[i + 4] = _mm512_shuffle_i32x4(b,d,0x88);
+		v[i + 8] = _mm512_shuffle_i32x4(a,c,0xdd);
+		v[i + 12] = _mm512_shuffle_i32x4(b,d,0xdd);
+	}
+}
+
+
+/* like b3Avx2, but with sixteen chunks at once */
+__attribute__((target("avx512f")))
+static void b3Avx512(const unsigned char *in, uint64_t counter, size_t n, uint32_t (*cvs)[8])
+{
+	for (; n >= 16; n -= 16, in += 16 * B3_CHUNK, counter += 16, cvs += 16) {
+		uint32_t lo[16], hi[16], out[8][16];
+		__m512i h[8], clo, chi;
+		unsigned b, i, j;
+
+		for (i = 0; i < 16; ++i) {
+			lo[i] = (uint32_t) (counter + i);
+			hi[i] = (uint32_t) ((counter + i) >> 32);
+		}
+		for (i = 0; i < 8; ++i)
+			h[i] = _mm512_set1_epi32(B3IV[i]);
+		clo = _mm512_loadu_si512(lo);
+		chi = _mm512_loadu_si512(hi);
+		for (b = 0; b < B3_CHUNK / B3_BLOCK; ++b) {
+			__m512i m[16], v[16];
+			for (i = 0; i < 16; ++i)
+				m[i] = _mm512_loadu_si512(in + i * B3_CHUNK + b * B3_BLOCK);
+			transpose16(m);
+			for (i = 0; i < 8; ++i)
+				v[i] = h[i];
+			v[8] = _mm512_set1_epi32(B3IV[0]);
+			v[9] = _mm512_set1_epi32(B3IV[1]);
+			v[10] = _mm512_set1_epi32(B3IV[2]);
+			v[11] = _mm512_set1_epi32(B3IV[3]);
+			v[12] = clo;
+			v[13] = chi;
+			v[14] = _mm512_set1_epi32(B3_BLOCK);
+			v[15] = _mm512_set1_epi32((b == 0 ? CHUNK_START : 0) | (b == B3_CHUNK / B3_BLOCK - 1 ? CHUNK_END : 0));
+			ROUNDS(G16);
+			for (i = 0; i < 8; ++i)
+				h[i] = _mm512_xor_si512(v[i],v[i + 8]);
+		}
+		for (i = 0; i < 8; ++i)
+			_mm512_storeu_si512(out[i],h[i]);
+		for (i = 0; i < 16; ++i) {
+			for (j = 0; j < 8; ++j)
+				cvs[i][j] = out[j][i];
+		}
+	}
+	b3Avx2(in,counter,n,cvs);
+}
+#endif
+
+
+static void *blake3Init(void)
+{
+	blake3_t *b = calloc(1,sizeof(blake3_t));
+
+	if (b == 0)
+		fatal("out of memory\n");
+	(void) memcpy(b->cv,B3IV,sizeof(B3IV));
+	return b;
+}
+
+
+/* adds the chaining value of a chunk, merging the subtrees it completes */
+static void b3Push(blake3_t *b, uint32_t cv[8], uint64_t chunks)
+{
+	while ((chunks & 1) == 0) {
+		unsigned char block[B3_BLOCK];
+		uint32_t out[16];
+		unsigned i;
+		--b->depth;
+		for (i = 0; i < 8; ++i) {
+			wr32(block + 4 * i,b->stack[b->depth][i]);
+			wr32(block + 32 + 4 * i,cv[i]);
+		}
+		b3Compress(B3IV,block,B3_BLOCK,0,PARENT,out);
+		(void) memcpy(cv,out,32);
+		chunks >>= 1;
+	}
+	(void) memcpy(b->stack[b->depth++],cv,32);
+}
+
+
+static void b3EndChunk(blake3_t *b)
+{
+	uint32_t out[16];
+
+	b3Compress(b->cv,b->block,B3_BLOCK,b->chunk,CHUNK_END,out);
+	b3Push(b,out,++b->chunk);
+	(void) memcpy(b->cv,B3IV,sizeof(B3IV));
+	b->blocks = 0;
+	b->blen = 0;
+}
+
+
+static void blake3Update(void *ctx, const void *buf, size_t len)
+{
+	blake3_t *b = ctx;
+	const unsigned char *in = buf;
+
+	while (len) {
+		size_t k;
+		/* a chunk is only completed when more input follows */
+		if (b->blocks * B3_BLOCK + b->blen == B3_CHUNK)
+			b3EndChunk(b);
+		if ((b->blocks == 0) && (b->blen == 0) && (len > B3_CHUNK)) {
+			uint32_t cvs[B3_BATCH][8];
+			size_t i, n = (len - 1) / B3_CHUNK;
+			if (n > B3_BATCH)
+				n = B3_BATCH;
+			B3Kernel(in,b->chunk,n,cvs);
+			for (i = 0; i < n; ++i)
+				b3Push(b,cvs[i],++b->chunk);
+			in += n * B3_CHUNK;
+			len -= n * B3_CHUNK;
+			continue;
+		}
+		if (b->blen == B3_BLOCK) {
+			uint32_t out[16];
+			b3Compress(b->cv,b->block,B3_BLOCK,b->chunk,b->blocks ? 0 : CHUNK_START,out);
+			(void) memcpy(b->cv,out,32);
+			++b->blocks;
+			b->blen = 0;
+		}
+		k = B3_BLOCK - b->blen;
+		if (k > len)
+			k = len;
+		(void) memcpy(b->block + b->blen,in,k);
+		b->blen += k;
+		in += k;
+		len -= k;
+	}
+}
+
+
+static void blake3Final(void *ctx, unsigned char *md)
+{
+	blake3_t *b = ctx;
+	unsigned char block[B3_BLOCK];
+	uint32_t out[16];
+	unsigned flags = CHUNK_END | (b->blocks ? 0 : CHUNK_START);
+	unsigned i, blen = b->blen;
+	const uint32_t *cv = b->cv;
+	uint64_t counter = b->chunk;
+
+	(void) memset(block,0,sizeof(block));
+	(void) memcpy(block,b->block,blen);
+	/* the last compression of the root gets the ROOT flag */
+	while (b->depth) {
+		b3Compress(cv,block,blen,counter,flags,out);
+		--b->depth;
+		for (i = 0; i < 8; ++i) {
+			wr32(block + 4 * i,b->stack[b->depth][i]);
+			wr32(block + 32 + 4 * i,out[i]);
+		}
+		cv = B3IV;
+		blen = B3_BLOCK;
+		counter = 0;
+		flags = PARENT;
+	}
+	b3Compress(cv,block,blen,counter,flags | ROOT,out);
+	for (i = 0; i < 8; ++i)
+		wr32(md + 4 * i,out[i]);
+}
+
+
+/* roots of the complete subtrees that make up a chunk aligned piece */
+static unsigned blake3Subtrees(const void *buf, size_t len, uint64_t offset, subtree_t *t)
+{
+	const unsigned char *in = buf;
+	uint64_t c = offset / B3_CHUNK, end = c + len / B3_CHUNK;
+	unsigned n = 0;
+
+	assert((offset % B3_CHUNK == 0) && (len % B3_CHUNK == 0));
+	while (c < end) {
+		blake3_t b;
+		uint64_t size = c ? c & -c : 1ULL << 63, i = 0;
+		unsigned w;
+
+		/* the largest subtree that starts at chunk c */
+		while (size > end - c)
+			size >>= 1;
+		b.depth = 0;
+		while (i < size) {
+			uint32_t cvs[B3_BATCH][8];
+			uint64_t j, k = (size - i > B3_BATCH) ? B3_BATCH : size - i;
+			B3Kernel(in,c + i,k,cvs);
+			for (j = 0; j < k; ++j)
+				b3Push(&b,cvs[j],++i);
+			in += k * B3_CHUNK;
+		}
+		assert((b.depth == 1) && (n < DIGEST_MAXTREES));
+		t[n].leaves = size;
+		for (w = 0; w < 8; ++w)
+			wr32(t[n].cv + 4 * w,b.stack[0][w]);
+		++n;
+		c += size;
+	}
+	return n;
+}
+
+
+static void blake3Join(void *ctx, const subtree_t *t, unsigned n)
+{
+	blake3_t *b = ctx;
+
+	if (b->blocks * B3_BLOCK + b->blen == B3_CHUNK)
+		b3EndChunk(b);
+	assert((b->blocks == 0) && (b->blen == 0));
+	for (; n; --n, ++t) {
+		uint32_t cv[8];
+		unsigned w;
+		for (w = 0; w < 8; ++w)
+			cv[w] = rd32(t->cv + 4 * w);
+		assert(b->chunk % t->leaves == 0);
+		b->chunk += t->leaves;
+		b3Push(b,cv,b->chunk / t->leaves);
+	}
+}
+
+
+static void *crcInit(void)
+{
+	uint32_t *c = calloc(1,sizeof(uint32_t));
+
+	if (c == 0)
+		fatal("out of memory\n");
+	return c;
+}
+
+
+static void crcUpdate(void *ctx, const void *buf, size_t len)
+{
+	*(uint32_t *)ctx = crc32c(*(uint32_t *)ctx,buf,len);
+}
+
+
+static void crcFinal(void *ctx, unsigned char *md)
+{
+	wrbe(md,*(uint32_t *)ctx,4);
+}
+
+
+static void initKernels(void)
+{
+	initCrc();
+	XxhKernel = xxhScalar;
+	B3Kernel = b3Chunks;
+#ifdef X86_KERNELS
+	if (__builtin_cpu_supports("avx512f"))
+		XxhKernel = xxhAvx512;
+	else if (__builtin_cpu_supports("avx2"))
+		XxhKernel = xxhAvx2;
+	if (__builtin_cpu_supports("avx512f"))
+		B3Kernel = b3Avx512;
+	else if (__builtin_cpu_supports("avx2"))
+		B3Kernel = b3Avx2;
+#endif
+}
+
+
+static const struct {
+	const char *name;
+	size_t len;
+	void *(*init)(void);
+	void (*update)(void *, const void *, size_t);
+	void (*final)(void *, unsigned char *);
+	size_t leaf;
+	unsigned (*subtrees)(const void *, size_t, uint64_t, subtree_t *);
+	void (*join)(void *, const subtree_t *, unsigned);
+} Digests[] = {
+	{ "crc32c", 4, crcInit, crcUpdate, crcFinal, 0, 0, 0 },
+	{ "xxh3", 8, xxh3Init, xxh3Update, xxh3Final, 0, 0, 0 },
+	{ "xxh128", 16, xxh3Init, xxh3Update, xxh128Final, 0, 0, 0 },
+	{ "blake3", 32, blake3Init, blake3Update, blake3Final, B3_CHUNK, blake3Subtrees, blake3Join },
+};
+#define NUMDIGESTS (sizeof(Digests) / sizeof(Digests[0]))
+
+
+/* returns the number of the algorithm, or -1 if it is not built in */
+int digestLookup(const char *name)
+{
+	unsigned i;
+
+	if (0 == strncasecmp(name,"builtin:",8))
+		name += 8;
+	for (i = 0; i < NUMDIGESTS; ++i) {
+		if (0 == strcasecmp(name,Digests[i].name))
+			return i;
+	}
+	return -1;
+}
+
+
+/* returns the name of the algorithm, or 0 past the last one */
+const char *digestName(int algo)
+{
+	return ((algo >= 0) && (algo < (int)NUMDIGESTS)) ? Digests[algo].name : 0;
+}
+
+
+size_t digestLength(int algo)
+{
+	return Digests[algo].len;
+}
+
+
+void *digestInit(int algo)
+{
+	(void) pthread_once(&KernelOnce,initKernels);
+	return Digests[algo].init();
+}
+
+
+void digestUpdate(int algo, void *ctx, const void *buf, size_t len)
+{
+	Digests[algo].update(ctx,buf,len);
+}
+
+
+/* writes the digest in canonical byte order to md and frees ctx */
+void digestFinal(int algo, void *ctx, unsigned char *md)
+{
+	Digests[algo].final(ctx,md);
+	free(ctx);
+}
+
+
+/* bytes per leaf, if algo is a tree hash, 0 otherwise */
+size_t digestLeaf(int algo)
+{
+	return Digests[algo].leaf;
+}
+
+
+/*
+ * Hashes a piece of the input that starts at offset into the roots of
+ * its complete subtrees. Offset and len must be multiples of the leaf
+ * size. Returns the number of subtrees.
+ */
+unsigned digestSubtrees(int algo, const void *buf, size_t len, uint64_t offset, subtree_t *t)
+{
+	(void) pthread_once(&KernelOnce,initKernels);
+	return Digests[algo].subtrees(buf,len,offset,t);
+}
+
+
+/* adds the subtrees of the next piece, which must be followed by more input */
+void digestJoin(int algo, void *ctx, const subtree_t *t, unsigned n)
+{
+	Digests[algo].join(ctx,t,n);
+}
@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_MAXLEN 32	/* bytes of the longest built-in digest */
+#define DIGEST_MAXTREES 128	/* most subtrees of a piece of input */
+
+/* root of a complete subtree of a tree hash */
+typedef struct {
+	uint64_t leaves;
+	unsigned char cv[DIGEST_MAXLEN];
+} subtree_t;
+
+/* built-in hash algorithms, numbered from 0 */
+int digestLookup(const char *name);
+const char *digestName(int algo);
+size_t digestLength(int algo);
+void *digestInit(int algo);
+void digestUpdate(int algo, void *ctx, const void *buf, size_t len);
+void digestFinal(int algo, void *ctx, unsigned char *md);
+
+/* pieces of the input of a tree hash can be hashed in parallel */
+size_t digestLeaf(int algo);
+unsigned digestSubtrees(int algo, const void *buf, size_t len, uint64_t offset, subtree_t *t);
+void digestJoin(int algo, void *ctx, const subtree_t *t, unsigned n);
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
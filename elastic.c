@@ -0,0 +1,243 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "elastic.h"
+#include "common.h"
+#include "dest.h"
+#include "globals.h"
+#include "log.h"
+#include "ring.h"
+#include "settings.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Elastic buffer: the ring keeps its Numblocks slots, but only a
+ * varying number of them may be in use. The input attaches a block of
+ * memory to a slot when it acquires it, and the release gives the
+ * memory back. Free blocks are kept on a stack, so the most recently
+ * used blocks are reused first and only as many blocks get backed by
+ * memory as have been in use at once. When the buffer has stayed
+ * mostly empty, the capacity is reduced and the memory of the free
+ * blocks beyond it is returned to the system.
+ */
+
+int Elastic = 0;
+
+static char **Stack = 0;		/* free blocks, most recently used on top */
+static unsigned long
+	Top = 0,			/* number of free blocks on the stack */
+	Cold = 0,			/* blocks at the bottom without memory */
+	MinBlocks = 0;
+static time_t Denied = 0;		/* last time memory pressure prevented growth */
+static pthread_mutex_t StackMut = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* available memory in bytes, 0 if unknown */
+static unsigned long long memAvailable(void)
+{
+#ifdef __linux
+	char tmp[4096], *at;
+	int n, pm = open("/proc/meminfo",O_RDONLY);
+
+	if (pm == -1)
+		return 0;
+	n = read(pm,tmp,sizeof(tmp) - 1);
+	(void) close(pm);
+	if (n <= 0)
+		return 0;
+	tmp[n] = 0;
+	at = strstr(tmp,"MemAvailable:");
+	if (at)
+		return strtoull(at + 13,0,10) << 10;
+#endif
+	return 0;
+}
+
+
+/* would less than a tenth of the physical memory remain available? */
+static int memPressure(unsigned long long want)
+{
+	unsigned long long av = memAvailable();
+
+	if ((av == 0) || (NumP <= 0) || (PgSz <= 0))
+		return 0;
+	return av < want + (unsigned long long) NumP * PgSz / 10;
+}
+
+
+void elasticAttach(unsigned long slot)
+{
+	int err;
+
+	err = pthread_mutex_lock(&StackMut);
+	assert(err == 0);
+	assert(Top > 0);
+	Buffer[slot] = Stack[--Top];
+	if (Top < Cold)
+		Cold = Top;
+	err = pthread_mutex_unlock(&StackMut);
+	assert(err == 0);
+}
+
+
+void elasticDetach(unsigned long slot)
+{
+	int err;
+
+	err = pthread_mutex_lock(&StackMut);
+	assert(err == 0);
+	assert(Top < Numblocks);
+	Stack[Top++] = Buffer[slot];
+	err = pthread_mutex_unlock(&StackMut);
+	assert(err == 0);
+}
+
+
+static void shrink(unsigned long cap)
+{
+	unsigned long keep;
+	int err;
+
+	ringResize(cap);
+	err = pthread_mutex_lock(&StackMut);
+	assert(err == 0);
+	/* keep the memory of the free blocks that fit into the new capacity */
+	keep = Numblocks - Top;
+	keep = (cap > keep) ? cap - keep : 0;
+	while (Cold + keep < Top) {
+		if (-1 == madvise(Stack[Cold],Blocksize,MADV_DONTNEED)) {
+			warningmsg("unable to release buffer memory: %s\n",strerror(errno));
+			break;
+		}
+		++Cold;
+	}
+	err = pthread_mutex_unlock(&StackMut);
+	assert(err == 0);
+}
+
+
+/* called by the input when the buffer has run full */
+int elasticGrow(void)
+{
+	unsigned long cap = ringCapacity(), c = cap * 2;
+	time_t now;
+
+	if (cap >= Numblocks)
+		return 0;
+	if (c > Numblocks)
+		c = Numblocks;
+	now = time(0);
+	if (now == Denied)
+		return 0;
+	if (memPressure((c - cap) * Blocksize)) {
+		if (Denied == 0)
+			warningmsg("low memory - not growing buffer beyond %lu blocks\n",cap);
+		Denied = now;
+		return 0;
+	}
+	infomsg("buffer ran full - growing to %lu blocks (%llu kB)\n",c,(unsigned long long)((c * Blocksize) >> 10));
+	ringResize(c);
+	return 1;
+}
+
+
+static void *elasticThread(void *ignored)
+{
+	unsigned long peak = 0;
+	unsigned elapsed = 0;
+
+	(void) ringPeak();
+	while (!Done) {
+		unsigned long cap, p;
+
+		(void) mt_usleep(1000000);
+		cap = ringCapacity();
+		p = ringPeak();
+		if (p > peak)
+			peak = p;
+		++elapsed;
+		if (cap <= MinBlocks)
+			continue;
+		if (memPressure(0)) {
+			unsigned long c = ringUsed();
+			if (c < MinBlocks)
+				c = MinBlocks;
+			if (c < cap) {
+				warningmsg("low memory - shrinking buffer to %lu blocks\n",c);
+				shrink(c);
+			}
+			peak = 0;
+			elapsed = 0;
+		} else if (elapsed >= ElasticWindow) {
+			if (peak <= cap / 4) {
+				unsigned long c = (cap / 2 < MinBlocks) ? MinBlocks : cap / 2;
+				infomsg("buffer mostly empty - shrinking to %lu blocks (%llu kB)\n",c,(unsigned long long)((c * Blocksize) >> 10));
+				shrink(c);
+			}
+			peak = 0;
+			elapsed = 0;
+		}
+	}
+	return 0;
+}
+
+
+void elasticInit(void)
+{
+	pthread_t thr;
+	unsigned long i;
+	int err;
+
+	if (ElasticMin == 0)
+		return;
+	if (Memmap || Memlock || HugePgSz || SpillFile) {
+		warningmsg("elastic buffers are not supported with options -t, -L, --spill and hugetlb pages\n");
+		return;
+	}
+	MinBlocks = ElasticMin / Blocksize;
+	if (MinBlocks < 5)
+		MinBlocks = 5;
+	if (MinBlocks >= Numblocks) {
+		infomsg("minimum size of elastic buffer is not below its maximum size - using a fixed buffer\n");
+		return;
+	}
+	Stack = malloc(Numblocks * sizeof(char *));
+	if (Stack == 0)
+		fatal("out of memory\n");
+	/* initBuffer only touched the first MinBlocks blocks */
+	for (i = 0; i < Numblocks; ++i)
+		Stack[i] = Buffer[Numblocks - 1 - i];
+	Top = Numblocks;
+	Cold = Numblocks - MinBlocks;
+	Elastic = 1;
+	ringResize(MinBlocks);
+	err = pthread_create(&thr,0,elasticThread,0);
+	assert(err == 0);
+	err = pthread_detach(thr);
+	assert(err == 0);
+	infomsg("elastic buffer with %lu to %lu blocks\n",MinBlocks,Numblocks);
+}
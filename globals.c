@@ -33,9 +33,7 @@ int
 	Tmp = -1;
 
 volatile int
-	ActSenders = 0,
 	NumSenders = -1,	/* number of sender threads */
-	SendSize = 0,
 	Terminate = 0,		/* abort execution, because of error or signal */
 	Watchdog = 0;		/* 0: off, 1: started, 2: raised */
 
@@ -47,19 +45,19 @@ volatile unsigned
 
 volatile unsigned long long
 	Rest = 0,
+	Shortfall = 0,		/* bytes missing from the partial blocks written so far */
 	Numin = 0,
 	Numout = 0,
 	InSize = 0;
 
-char *volatile
-	SendAt = 0;
-
 size_t
 	IDevBSize = 0,
-	PrefixLen = 0;
+	PrefixLen = 0,
+	*Lengths = 0;		/* bytes in each block, if blocks can be partial */
 
 long
 	PgSz = 0,
+	HugePgSz = 0,		/* size of hugetlb pages backing the buffer */
 	Finish = -1,		/* this is for graceful termination */
 	TickTime = 0;
 
@@ -69,17 +67,9 @@ char
 
 pthread_mutex_t
 	TermMut = PTHREAD_MUTEX_INITIALIZER,	/* prevents statusThread from interfering with request*Volume */
-	LowMut = PTHREAD_MUTEX_INITIALIZER,
-	HighMut = PTHREAD_MUTEX_INITIALIZER,
 	SendMut = PTHREAD_MUTEX_INITIALIZER;
 
-sem_t
-	Dev2Buf,
-	Buf2Dev;
-
 pthread_cond_t
-	PercLow = PTHREAD_COND_INITIALIZER,	/* low watermark */
-	PercHigh = PTHREAD_COND_INITIALIZER,	/* high watermark */
 	SendCond = PTHREAD_COND_INITIALIZER;
 
 pthread_t
@@ -21,7 +21,6 @@
 #define GLOBALS_H
 
 #include <pthread.h>
-#include <semaphore.h>
 
 extern dest_t *Dest;
 
@@ -38,9 +37,7 @@ extern int
 	OptMode;
 
 extern volatile int
-	ActSenders,
 	NumSenders,	/* number of sender threads */
-	SendSize,
 	Terminate,	/* abort execution, because of error or signal */
 	Watchdog;	/* 0: off, 1: started, 2: raised */
 
@@ -52,19 +49,19 @@ extern volatile unsigned
 
 extern volatile unsigned long long
 	Rest,
+	Shortfall,	/* bytes missing from the partial blocks written so far */
 	Numin,
 	Numout,
 	InSize;
 
-extern char *volatile
-	SendAt;
-
 extern size_t
 	IDevBSize,
-	PrefixLen;
+	PrefixLen,
+	*Lengths;	/* bytes in each block, if blocks can be partial */
 
 extern long
 	PgSz,
+	HugePgSz,
 	Finish,		/* this is for graceful termination */
 	TickTime;
 
@@ -74,17 +71,9 @@ extern char
 
 extern pthread_mutex_t
 	TermMut,	/* prevents statusThread from interfering with request*Volume */
-	LowMut,
-	HighMut,
 	SendMut;
 
-extern sem_t
-	Dev2Buf,
-	Buf2Dev;
-
 extern pthread_cond_t
-	PercLow,	/* low watermark */
-	PercHigh,	/* high watermark */
 	SendCond;
 
 extern pthread_t
@@ -22,16 +22,24 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "common.h"
 #include "dest.h"
+#include "digest.h"
 #include "log.h"
+#include "manifest.h"
+#include "numa.h"
 #include "globals.h"
+#include "settings.h"
 
 
 #if defined HAVE_LIBMD5 && defined HAVE_MD5_H
@@ -50,6 +58,11 @@
 #define USE_LIBMD5 -5
 #define USE_SSLMD5 -6
 #define USE_RHASH -7
+#define USE_BUILTIN -8
+#define USE_MANIFEST -9
+
+#define HASH_NICE 5	/* priority of the hash threads below the outputs */
+#define HASH_CHUNK (64 << 10)	/* bytes fed to every fused hash at once */
 
 static void *LibMhash = 0, *LibGcrypt = 0, *LibRhash = 0;
 
@@ -144,6 +157,11 @@ void listHashAlgos()
 {
 	initHashLibs();
 	int n = 0;
+	(void) fprintf(stderr,"built-in hash functions are:\n");
+	while (digestName(n)) {
+		(void) fprintf(stderr,"\t%s\n",digestName(n));
+		++n;
+	}
 	if (LibGcrypt) {
 		(void) fprintf(stderr,"valid hash functions of libgcrypt are:\n");
 		int algo = 1;
@@ -211,6 +229,13 @@ static void addDigestDestination(int lib, int algo, const char *algoname)
 
 int addHashAlgorithm(const char *name)
 {
+	int builtin = digestLookup(name);
+
+	if (builtin != -1) {
+		addDigestDestination(USE_BUILTIN,builtin,digestName(builtin));
+		debugmsg("enabled built-in hash algorithm %s\n",digestName(builtin));
+		return 1;
+	}
 	initHashLibs();
 	if (LibGcrypt) {
 		const char *an = name;
@@ -270,139 +295,605 @@ int addHashAlgorithm(const char *name)
 }
 
 
-void *hashThread(void *arg)
+static manifest_t *Manifests[2] = { 0, 0 };	/* written and verified manifest */
+
+
+int addManifest(const char *path, int verify)
 {
-	dest_t *dest = (dest_t *) arg;
+	if (Manifests[verify])
+		fatal("only one manifest can be %s\n",verify ? "verified" : "written");
+	Manifests[verify] = manifestOpen(path,verify);
+	addDigestDestination(USE_MANIFEST,verify,path);
+	debugmsg("%s manifest %s\n",verify ? "verifying" : "writing",path);
+	return 1;
+}
+
+
+static pthread_mutex_t HashMut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t HashCond = PTHREAD_COND_INITIALIZER;
+static unsigned HashesDone = 0;
+
+
+/* called after the hash threads have been joined */
+void closeManifests(void)
+{
+	int i;
+
+	/* a manifest that has not been finalized belongs to a transfer that ended early */
+	for (i = 0; i < 2; ++i) {
+		if (Manifests[i])
+			manifestAbort(Manifests[i]);
+		Manifests[i] = 0;
+	}
+}
+
+
+static void hashDone(dest_t *dest, char *msg)
+{
+	int err;
+
+	err = pthread_mutex_lock(&HashMut);
+	assert(err == 0);
+	dest->result = msg;
+	++HashesDone;
+	err = pthread_cond_broadcast(&HashCond);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&HashMut);
+	assert(err == 0);
+}
+
+
+/*
+ * Waits for the hash threads to finish and returns their results in
+ * one string, or 0 if no hashes are calculated.
+ */
+char *hashResults(void)
+{
+	char *res = 0;
+	size_t len = 0;
+	dest_t *d;
+	int err;
+
+	if (Hashers == 0)
+		return 0;
+	err = pthread_mutex_lock(&HashMut);
+	assert(err == 0);
+	pthread_cleanup_push(releaseLock,&HashMut);
+	while ((HashesDone < Hashers) && !Terminate) {
+		err = pthread_cond_wait(&HashCond,&HashMut);
+		assert(err == 0);
+	}
+	pthread_cleanup_pop(1);
+	for (d = Dest; d; d = d->next) {
+		size_t l;
+		if (d->arg || (d->result == 0) || (d->fd == USE_MANIFEST))
+			continue;
+		l = strlen(d->result);
+		res = realloc(res,len + l + 1);
+		assert(res);
+		(void) memcpy(res + len,d->result,l + 1);
+		len += l;
+	}
+	return res;
+}
+
+
+/*
+ * A tree hash like blake3 is calculated by a pool of threads: each of
+ * them hashes whole blocks into the roots of their subtrees, and the
+ * hash thread joins these in order. The root of the tree gets
+ * finalized differently, so the last block is hashed by the hash
+ * thread itself.
+ */
+typedef struct {
+	const char *buf;
+	size_t len;
+	unsigned long long off;
+	unsigned num;		/* number of subtrees */
+	int tree, ready;	/* tree is 0 if the block is not leaf aligned */
+	subtree_t t[DIGEST_MAXTREES];
+} leafreq_t;
+
+typedef struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t posted, ready;
+	pthread_t *thr;
+	leafreq_t *req;
+	dest_t *dest;
+	unsigned nthr, depth;
+	unsigned long long Posted, Claimed;
+	int stop;
+} treepool_t;
+
+
+static unsigned hashThreads(void)
+{
+	long n;
+
+	if (HashThreads)
+		return HashThreads;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+}
+
+
+static void *treeThread(void *arg)
+{
+	treepool_t *p = (treepool_t *) arg;
+	int err;
+
+	numaPinThread(NUMA_OUTPUT,-1,p->dest->name);
+	err = pthread_mutex_lock(&p->mtx);
+	assert(err == 0);
+	for (;;) {
+		leafreq_t *r;
+
+		while ((p->Claimed == p->Posted) && !p->stop) {
+			err = pthread_cond_wait(&p->posted,&p->mtx);
+			assert(err == 0);
+		}
+		if (p->stop)
+			break;
+		r = p->req + p->Claimed++ % p->depth;
+		err = pthread_mutex_unlock(&p->mtx);
+		assert(err == 0);
+		if (r->tree)
+			r->num = digestSubtrees(p->dest->mode,r->buf,r->len,r->off,r->t);
+		err = pthread_mutex_lock(&p->mtx);
+		assert(err == 0);
+		r->ready = 1;
+		err = pthread_cond_broadcast(&p->ready);
+		assert(err == 0);
+	}
+	err = pthread_mutex_unlock(&p->mtx);
+	assert(err == 0);
+	return 0;
+}
+
+
+static void stopTree(void *arg)
+{
+	treepool_t *p = (treepool_t *) arg;
+	unsigned i;
+	int err;
+
+	err = pthread_mutex_lock(&p->mtx);
+	assert(err == 0);
+	p->stop = 1;
+	err = pthread_cond_broadcast(&p->posted);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&p->mtx);
+	assert(err == 0);
+	for (i = 0; i < p->nthr; ++i) {
+		err = pthread_join(p->thr[i],0);
+		assert(err == 0);
+	}
+	free(p->thr);
+	free(p->req);
+	(void) pthread_cond_destroy(&p->posted);
+	(void) pthread_cond_destroy(&p->ready);
+	(void) pthread_mutex_destroy(&p->mtx);
+}
+
+
+/* returns the number of the first block that was not hashed */
+static unsigned long long treeHash(dest_t *dest, void *ctxt, unsigned nthr)
+{
+	treepool_t p;
+	unsigned long long n = 0, d = 0, off = 0;
+	size_t leaf = digestLeaf(dest->mode);
+	unsigned i;
+	int end = 0, err;
+
+	bzero(&p,sizeof(p));
+	err = pthread_mutex_init(&p.mtx,0);
+	assert(err == 0);
+	err = pthread_cond_init(&p.posted,0);
+	assert(err == 0);
+	err = pthread_cond_init(&p.ready,0);
+	assert(err == 0);
+	p.dest = dest;
+	p.nthr = nthr;
+	/* two blocks per thread keep all of them busy */
+	p.depth = 2 * nthr;
+	if (p.depth > Numblocks / 2)
+		p.depth = Numblocks / 2;
+	if (p.depth < 2)
+		p.depth = 2;
+	p.thr = calloc(nthr,sizeof(pthread_t));
+	p.req = calloc(p.depth,sizeof(leafreq_t));
+	assert(p.thr && p.req);
+	for (i = 0; i < nthr; ++i) {
+		err = pthread_create(p.thr + i,0,treeThread,&p);
+		assert(err == 0);
+	}
+	infomsg("hashing %s with %u threads\n",dest->name,nthr);
+	pthread_cleanup_push(stopTree,&p);
+	for (;;) {
+		leafreq_t *r;
+
+		/* joining a block needs to know if another one follows */
+		while (!end && (n - d < p.depth)) {
+			int size = nextBlock(n,n <= d + 1);
+			if (size < 0)
+				break;
+			if (size == 0) {
+				end = 1;
+				break;
+			}
+			r = p.req + n % p.depth;
+			r->buf = Buffer[n % Numblocks];
+			r->len = size;
+			r->off = off;
+			r->tree = (off % leaf == 0) && (size % leaf == 0);
+			r->ready = 0;
+			off += size;
+			err = pthread_mutex_lock(&p.mtx);
+			assert(err == 0);
+			++p.Posted;
+			err = pthread_cond_signal(&p.posted);
+			assert(err == 0);
+			err = pthread_mutex_unlock(&p.mtx);
+			assert(err == 0);
+			++n;
+		}
+		if (Terminate || (d == n))
+			break;
+		r = p.req + d % p.depth;
+		err = pthread_mutex_lock(&p.mtx);
+		assert(err == 0);
+		pthread_cleanup_push(releaseLock,&p.mtx);
+		while (!r->ready) {
+			err = pthread_cond_wait(&p.ready,&p.mtx);
+			assert(err == 0);
+		}
+		pthread_cleanup_pop(1);
+		debugiomsg("hashThread(): joining %lu@0x%p\n",(unsigned long)r->len,(void*)r->buf);
+		if (r->tree && (d + 1 < n))
+			digestJoin(dest->mode,ctxt,r->t,r->num);
+		else
+			digestUpdate(dest->mode,ctxt,r->buf,r->len);
+		finishBlocks(dest,++d);
+	}
+	pthread_cleanup_pop(1);
+	return d;
+}
+
+
+typedef struct {
+	dest_t *dest;
+	void *ctxt;
 	gcry_md_hd_t hd;
-	void *ctxt = 0;
-	int algo = dest->mode;
+} hasher_t;
+
+
+static void hashInit(hasher_t *h)
+{
+	int algo = h->dest->mode;
 
-	switch (dest->fd) {
+	switch (h->dest->fd) {
 	case USE_MHASH:
-		ctxt = mhash_init(algo);
-		assert(ctxt != MHASH_FAILED);
+		h->ctxt = mhash_init(algo);
+		assert(h->ctxt != MHASH_FAILED);
 		break;
 	case USE_RHASH:
-		ctxt = rhash_init(algo);
-		assert(ctxt != 0);
+		h->ctxt = rhash_init(algo);
+		assert(h->ctxt != 0);
 		break;
 	case USE_GCRYPT:
-		gcry_md_open(&hd, dest->mode, 0);
+		gcry_md_open(&h->hd, algo, 0);
+		break;
+	case USE_BUILTIN:
+		h->ctxt = digestInit(algo);
+		break;
+	case USE_MANIFEST:
+		h->ctxt = Manifests[algo];
 		break;
 #ifdef WITH_LIBMD5
 	case USE_LIBMD5:
-		ctxt = malloc(sizeof(MD5_CTX));
-		MD5Init(ctxt);
+		h->ctxt = malloc(sizeof(MD5_CTX));
+		MD5Init(h->ctxt);
 		break;
 #endif
 #ifdef WITH_SSLMD5
 	case USE_SSLMD5:
-		ctxt = malloc(sizeof(MD5_CTX));
-		MD5_Init(ctxt);
+		h->ctxt = malloc(sizeof(MD5_CTX));
+		MD5_Init(h->ctxt);
 		break;
 #endif
 	default:
 		abort();
 	}
+}
 
-	debugmsg("hashThread(): starting...\n");
-	for (;;) {
-		int size;
 
-		(void) syncSenders(0,0);
-		size = SendSize;
-		if (0 == size) {
-			size_t ds,al;
-			unsigned char hashvalue[128];
-			char *msg, *m;
-			const char *an;
-			int i;
-			
-			debugmsg("hashThread(): done.\n");
-			switch (dest->fd) {
-			case USE_GCRYPT:
-				ds = gcry_md_get_algo_dlen(dest->mode);
-				assert(sizeof(hashvalue) >= ds);
-				an = gcry_md_algo_name(dest->mode);
-				memcpy(hashvalue,gcry_md_read(hd,dest->mode),ds);
-				break;
-			case USE_MHASH:
-				ds = mhash_get_block_size(algo);
-				assert(sizeof(hashvalue) >= ds);
-				mhash_deinit(ctxt,hashvalue);
-				an =  mhash_get_hash_name_static(algo);
-				break;
-			case USE_RHASH:
-				ds = rhash_get_digest_size(algo);
-				assert(sizeof(hashvalue) >= ds);
-				rhash_final(ctxt,hashvalue);
-				an =  rhash_get_name(algo);
-				break;
+static void hashUpdate(hasher_t *h, const char *buf, size_t size)
+{
+	switch (h->dest->fd) {
+	case USE_GCRYPT:
+		gcry_md_write(h->hd,buf,size);
+		break;
+	case USE_MHASH:
+		mhash(h->ctxt,buf,size);
+		break;
+	case USE_RHASH:
+		rhash_update(h->ctxt,buf,size);
+		break;
+	case USE_BUILTIN:
+		digestUpdate(h->dest->mode,h->ctxt,buf,size);
+		break;
+	case USE_MANIFEST:
+		manifestUpdate(h->ctxt,buf,size);
+		break;
 #ifdef WITH_LIBMD5
-			case USE_LIBMD5:
-				ds = 16;
-				MD5Final(hashvalue,ctxt);
-				free(ctxt);
-				an = "libmd5:md5";
-				break;
+	case USE_LIBMD5:
+		MD5Update(h->ctxt,buf,size);
+		break;
 #endif
 #ifdef WITH_SSLMD5
-			case USE_SSLMD5:
-				ds = 16;
-				MD5_Final(hashvalue,ctxt);
-				free(ctxt);
-				an = "openssl:md5";
-				break;
+	case USE_SSLMD5:
+		MD5_Update(h->ctxt,buf,size);
+		break;
+#endif
+	default:
+		abort();
+	}
+}
+
+
+/* returns the message with the hash value */
+static char *hashFinal(hasher_t *h)
+{
+	size_t ds,al;
+	unsigned char hashvalue[128];
+	char *msg, *m;
+	const char *an;
+	int i, algo = h->dest->mode;
+
+	switch (h->dest->fd) {
+	case USE_GCRYPT:
+		ds = gcry_md_get_algo_dlen(algo);
+		assert(sizeof(hashvalue) >= ds);
+		an = gcry_md_algo_name(algo);
+		memcpy(hashvalue,gcry_md_read(h->hd,algo),ds);
+		break;
+	case USE_MHASH:
+		ds = mhash_get_block_size(algo);
+		assert(sizeof(hashvalue) >= ds);
+		mhash_deinit(h->ctxt,hashvalue);
+		an =  mhash_get_hash_name_static(algo);
+		break;
+	case USE_RHASH:
+		ds = rhash_get_digest_size(algo);
+		assert(sizeof(hashvalue) >= ds);
+		rhash_final(h->ctxt,hashvalue);
+		an =  rhash_get_name(algo);
+		break;
+	case USE_BUILTIN:
+		ds = digestLength(algo);
+		digestFinal(algo,h->ctxt,hashvalue);
+		an = digestName(algo);
+		break;
+	case USE_MANIFEST:
+		Manifests[algo] = 0;
+		return manifestFinal(h->ctxt);
+#ifdef WITH_LIBMD5
+	case USE_LIBMD5:
+		ds = 16;
+		MD5Final(hashvalue,h->ctxt);
+		free(h->ctxt);
+		an = "libmd5:md5";
+		break;
+#endif
+#ifdef WITH_SSLMD5
+	case USE_SSLMD5:
+		ds = 16;
+		MD5_Final(hashvalue,h->ctxt);
+		free(h->ctxt);
+		an = "openssl:md5";
+		break;
 #endif
-			default:
-				abort();
+	default:
+		abort();
+	}
+	al = strlen(an);
+	// 9 = strlen(" hash: ") + \n + \0
+	msg = malloc(al+9+(ds<<1));
+	assert(msg);
+	memcpy(msg,an,al);
+	memcpy(msg+al," hash: ",7);
+	m = msg + al + 7;
+	for (i = 0; i < ds; ++i)
+		m += sprintf(m,"%02x",(unsigned int)hashvalue[i]);
+	*m++ = '\n';
+	*m = 0;
+	return msg;
+}
+
+
+/*
+ * Several hashes are calculated by one thread in a single pass over
+ * every block: the block is walked in chunks that fit into the cache of
+ * the CPU, and every hash gets fed a chunk while it is cached. By
+ * default all hashes share one pass, so every block is read from memory
+ * only once. Option --hash-groups spreads them over more threads. A tree
+ * hash that is calculated by a pool of threads keeps its own thread.
+ */
+typedef struct {
+	dest_t **dest;		/* the thread of dest[0] calculates all hashes */
+	unsigned num;
+	int done;
+} hashgroup_t;
+
+static hashgroup_t *Groups = 0;
+static unsigned NumGroups = 0;
+static pthread_once_t GroupOnce = PTHREAD_ONCE_INIT;
+
+
+static int treeHashed(dest_t *d)
+{
+	return (d->fd == USE_BUILTIN) && digestLeaf(d->mode) && (hashThreads() > 1);
+}
+
+
+static void groupHashes(void)
+{
+	unsigned num = 0, fused = 0, ng, i = 0, g = 0;
+	dest_t *d;
+
+	for (d = Dest; d; d = d->next) {
+		if (d->arg)
+			continue;
+		++num;
+		if (!treeHashed(d))
+			++fused;
+	}
+	ng = HashGroups;
+	if (ng > fused)
+		ng = fused;
+	Groups = calloc(num,sizeof(hashgroup_t));
+	assert(Groups || (num == 0));
+	for (d = Dest; d; d = d->next) {
+		hashgroup_t *h;
+		if (d->arg)
+			continue;
+		if (treeHashed(d))
+			h = Groups + ng + g++;
+		else
+			h = Groups + i++ % ng;
+		if (h->dest == 0) {
+			h->dest = calloc(num,sizeof(dest_t *));
+			assert(h->dest);
+		}
+		h->dest[h->num++] = d;
+	}
+	NumGroups = ng + g;
+	for (i = 0; i < NumGroups; ++i) {
+		if (Groups[i].num > 1)
+			infomsg("hashes of %s and %u more are calculated in one pass\n",Groups[i].dest[0]->name,Groups[i].num - 1);
+	}
+}
+
+
+static hashgroup_t *groupOf(dest_t *d)
+{
+	unsigned i, j;
+
+	(void) pthread_once(&GroupOnce,groupHashes);
+	for (i = 0; i < NumGroups; ++i) {
+		for (j = 0; j < Groups[i].num; ++j) {
+			if (Groups[i].dest[j] == d)
+				return Groups + i;
+		}
+	}
+	abort();
+	return 0;	/* for lint */
+}
+
+
+/* is the hash of d calculated by the thread of another hash? */
+int hashFused(dest_t *d)
+{
+	return groupOf(d)->dest[0] != d;
+}
+
+
+static void groupDone(hashgroup_t *g)
+{
+	int err;
+
+	err = pthread_mutex_lock(&HashMut);
+	assert(err == 0);
+	g->done = 1;
+	err = pthread_cond_broadcast(&HashCond);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&HashMut);
+	assert(err == 0);
+}
+
+
+/* the thread of a hash that another thread calculates waits for the result */
+static void *fusedThread(dest_t *dest, hashgroup_t *g)
+{
+	int err;
+
+	err = pthread_mutex_lock(&HashMut);
+	assert(err == 0);
+	pthread_cleanup_push(releaseLock,&HashMut);
+	while (!g->done) {
+		err = pthread_cond_wait(&HashCond,&HashMut);
+		assert(err == 0);
+	}
+	pthread_cleanup_pop(1);
+	pthread_exit((void *) dest->result);
+	return 0;	/* for lint */
+}
+
+
+void *hashThread(void *arg)
+{
+	dest_t *dest = (dest_t *) arg;
+	hashgroup_t *g = groupOf(dest);
+	hasher_t *h;
+	unsigned long long n = 0;
+	unsigned i;
+
+	if (g->dest[0] != dest)
+		return fusedThread(dest,g);
+	numaPinThread(NUMA_OUTPUT,-1,dest->name);
+#ifdef __linux
+	/* The nice value is per thread on Linux. Hashers run behind the
+	 * outputs and only stall the input when the buffer is full. */
+	errno = 0;
+	if ((-1 == nice(HASH_NICE)) && (errno != 0))
+		debugmsg("hashThread(): unable to lower priority: %s\n",strerror(errno));
+#endif
+	h = calloc(g->num,sizeof(hasher_t));
+	assert(h);
+	for (i = 0; i < g->num; ++i) {
+		h[i].dest = g->dest[i];
+		hashInit(h + i);
+	}
+
+	debugmsg("hashThread(): starting...\n");
+	if (treeHashed(dest))
+		n = treeHash(dest,h->ctxt,hashThreads());
+	for (;;) {
+		int size = nextBlock(n,1);
+		char *buf = Buffer[n % Numblocks];
+		char *msg = 0;
+
+		if (0 == size) {
+			debugmsg("hashThread(): done.\n");
+			for (i = g->num; i--; ) {
+				msg = hashFinal(h + i);
+				hashDone(g->dest[i],msg);
 			}
-			al = strlen(an);
-			// 9 = strlen(" hash: ") + \n + \0
-			msg = malloc(al+9+(ds<<1));
-			assert(msg);
-			memcpy(msg,an,al);
-			memcpy(msg+al," hash: ",7);
-			m = msg + al + 7;
-			for (i = 0; i < ds; ++i)
-				m += sprintf(m,"%02x",(unsigned int)hashvalue[i]);
-			*m++ = '\n';
-			*m = 0;
-			dest->result = msg;
+			free(h);
+			groupDone(g);
 			pthread_exit((void *) msg);
 			return 0;	/* for lint */
 		}
-		if (Terminate) {
-			(void) syncSenders(0,-1);
+		if ((size < 0) || Terminate) {
+			leaveSenders(dest);
+			for (i = 0; i < g->num; ++i)
+				hashDone(g->dest[i],0);
+			groupDone(g);
 			infomsg("hashThread(): terminating early upon request...\n");
 			pthread_exit((void *) 0);
 		}
-		debugiomsg("hashThread(): hashing %d@0x%p\n",size,(void*)SendAt);
-		switch (dest->fd) {
-		case USE_GCRYPT:
-			gcry_md_write(hd,SendAt,size);
-			break;
-		case USE_MHASH:
-			mhash(ctxt,SendAt,size);
-			break;
-		case USE_RHASH:
-			rhash_update(ctxt,SendAt,size);
-			break;
-#ifdef WITH_LIBMD5
-		case USE_LIBMD5:
-			MD5Update(ctxt,SendAt,size);
-			break;
-#endif
-#ifdef WITH_SSLMD5
-		case USE_SSLMD5:
-			MD5_Update(ctxt,SendAt,size);
-			break;
-#endif
-		default:
-			abort();
+		debugiomsg("hashThread(): hashing %d@0x%p\n",size,(void*)buf);
+		if (g->num == 1) {
+			hashUpdate(h,buf,size);
+		} else {
+			int off;
+			for (off = 0; off < size; off += HASH_CHUNK) {
+				size_t l = (size - off > HASH_CHUNK) ? HASH_CHUNK : size - off;
+				for (i = 0; i < g->num; ++i)
+					hashUpdate(h + i,buf + off,l);
+			}
 		}
+		finishBlocks(dest,++n);
 	}
 	return 0;
 }
-
-
@@ -30,8 +30,14 @@
 #define HAVE_MD5
 #endif
 
+#include "dest.h"
+
 int addHashAlgorithm(const char *name);
+int addManifest(const char *path, int verify);
 void listHashAlgos();
 void *hashThread(void *arg);
+int hashFused(dest_t *d);
+char *hashResults(void);
+void closeManifests(void);
 
 #endif
@@ -22,22 +22,32 @@
 #include "common.h"
 #include "log.h"
 #include "dest.h"
+#include "digest.h"
 #include "globals.h"
+#include "hashing.h"
 #include "settings.h"
+#include "ring.h"
+#include "cache.h"
+#include "compress.h"
+#include "network.h"
+#include "numa.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <float.h>
 #include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
@@ -167,10 +177,12 @@ static int requestInputVolume()
 		In = open(Infile, O_RDONLY | O_LARGEFILE);
 		if ((-1 == In) && (errno == EINVAL))
 			In = open(Infile,O_RDONLY);
-		if (-1 != In)
-			enable_directio(In,Infile);
-		else
+		if (-1 == In)
 			errormsg("could not reopen input %s: %s\n",Infile,strerror(errno));
+		else if (NoCache)
+			cacheInitInput(In);
+		else
+			enable_directio(In,Infile);
 	} while (In == -1);
 	(void) clock_gettime(ClockSrc,&volstart);
 	diff = volstart.tv_sec - now.tv_sec + (double) (volstart.tv_nsec - now.tv_nsec) * 1E-9;
@@ -184,6 +196,9 @@ static int requestInputVolume()
 }
 
 
+static int Seekable = 0;	/* input can be read at explicit offsets */
+
+
 void openInput()
 {
 	debugmsg("opening input %s\n",Infile);
@@ -195,10 +210,14 @@ void openInput()
 	}
 	if (-1 == In)
 		fatal("could not open input file: %s\n",strerror(errno));
-	enable_directio(In,Infile);
+	if (!NoCache)
+		enable_directio(In,Infile);
 	struct stat st;
-	if ((0 == fstat(In,&st)) && ((st.st_mode & S_IFMT) == S_IFREG))
-		InSize = st.st_size;
+	if (0 == fstat(In,&st)) {
+		if ((st.st_mode & S_IFMT) == S_IFREG)
+			InSize = st.st_size;
+		Seekable = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+	}
 #ifdef __sun
 	if (0 == directio(In,DIRECTIO_ON))
 		infomsg("direct I/O hinting enabled for input\n");
@@ -208,7 +227,7 @@ void openInput()
 }
 
 
-static int devread(unsigned at)
+static int devread(char *buf)
 {
 	static char *DevBuf = 0;
 	static size_t IFill = 0, Off = 0;
@@ -220,7 +239,7 @@ static int devread(unsigned at)
 			if (IFill > (Blocksize-num))
 				s = Blocksize-num;
 			debugmsg("fillop %d, fill %d, off %d\n",s,IFill,Off);
-			memcpy(Buffer[at]+num,DevBuf+Off,s);
+			memcpy(buf+num,DevBuf+Off,s);
 			Off += s;
 			IFill -= s;
 			num += s;
@@ -231,7 +250,9 @@ static int devread(unsigned at)
 			hadzero = 0;
 			return 0;
 		}
-		ssize_t in = read(In,Buffer[at] + num,Blocksize - num);
+		ssize_t in = read(In,buf + num,Blocksize - num);
+		if ((-1 == in) && (errno == EINVAL))
+			in = directio_retry(In,Infile,buf + num,Blocksize - num,-1,0);
 		debugmsg("devread %d = %d\n",Blocksize-num,in);
 		if (in > 0) {
 			num += in;
@@ -240,8 +261,6 @@ static int devread(unsigned at)
 				hadzero = 1;
 			return num;
 		} else if (in == -1) {
-			if ((errno == EINVAL) && disable_directio(In,Infile))
-				continue;
 			if (errno != ENOMEM)
 				return -1;
 			if (DevBuf == 0) {
@@ -252,9 +271,9 @@ static int devread(unsigned at)
 			}
 			assert(IFill == 0);
 			ssize_t i2 = read(In,DevBuf,IDevBSize);
+			if ((i2 == -1) && (errno == EINVAL))
+				i2 = directio_retry(In,Infile,DevBuf,IDevBSize,-1,0);
 			debugmsg("devread2 %d = %d %d/%s\n",IDevBSize,i2,errno,strerror(errno));
-			if ((i2 == -1) && (errno == EINVAL) && disable_directio(In,Infile))
-				continue;
 			if (i2 == -1) {
 				assert(errno != ENOMEM);
 				return -1;
@@ -273,73 +292,1203 @@ static int devread(unsigned at)
 }
 
 
-int readBlock(unsigned at)
+static void lastBlock(unsigned at, size_t num)
+{
+	Rest = num;
+	Finish = at;
+	debugmsg("inputThread: last block has %llu bytes\n",(unsigned long long)num);
+	ringPublish();
+	infomsg("inputThread: exiting...\n");
+}
+
+
+/*
+ * Waits until the input is readable. Returns 0 if a block that started
+ * to fill at since has to be passed on first (option --flush-after).
+ */
+static int waitFlush(const struct timespec *since)
 {
+	struct timespec now;
+	struct pollfd p;
+	long long ms;
 	int err;
+
+	if (FlushAfter == 0)
+		return 1;
+	(void) clock_gettime(ClockSrc,&now);
+	ms = FlushAfter - ((now.tv_sec - since->tv_sec) * 1000LL + (now.tv_nsec - since->tv_nsec) / 1000000);
+	if (ms <= 0)
+		return 0;
+	p.fd = In;
+	p.events = POLLIN;
+	p.revents = 0;
+	do
+		err = poll(&p,1,(int)ms);
+	while ((err == -1) && (errno == EINTR));
+	return err != 0;
+}
+
+
+/*
+ * Reads a block into buf. Returns 1 if the block is full, 2 if it is
+ * partial but has to be passed on because of option --flush-after,
+ * otherwise 0 at the end of the input or a negative value on error.
+ * The number of bytes read is stored in *n.
+ */
+static int fillBlock(char *buf, size_t *n, int flush)
+{
+	struct timespec since;
 	size_t num = 0;
 	waitInput();
 	do {
 		ssize_t in;
+		if (flush && num && !waitFlush(&since)) {
+			debugiomsg("inputThread: passing on partial block with %llu bytes\n",(unsigned long long)num);
+			*n = num;
+			return 2;
+		}
 		if (IDevBSize)
-			in = devread(at);
+			in = devread(buf);
 		else
-			in = read(In,Buffer[at] + num,Blocksize - num);
-		debugiomsg("inputThread: read(In, Buffer[%d] + %llu, %llu) = %d\n", at, num, Blocksize - num, in);
+			in = read(In,buf + num,Blocksize - num);
+		if ((-1 == in) && (errno == EINVAL))
+			in = directio_retry(In,Infile,buf + num,Blocksize - num,-1,0);
+		debugiomsg("inputThread: read(In, %p + %llu, %llu) = %d\n", buf, num, Blocksize - num, in);
 		if (in > 0) {
+			if (num == 0)
+				(void) clock_gettime(ClockSrc,&since);
 			num += in;
+			cacheInput(in);
 		} else if (((0 == in) || ((-1 == in) && (errno == EIO))) && (Terminal||Autoloader) && (NumVolumes != 1)) {
 			if (0 == requestInputVolume()) {
-				Finish = at;
-				Rest = num;
-				debugmsg("inputThread: last block has %llu bytes\n",num);
-				err = pthread_mutex_lock(&HighMut);
-				assert(err == 0);
-				err = sem_post(&Buf2Dev);
-				assert(err == 0);
-				err = pthread_cond_signal(&PercHigh);
-				assert(err == 0);
-				err = pthread_mutex_unlock(&HighMut);
-				assert(err == 0);
-				infomsg("inputThread: exiting...\n");
-				if (Status)
-					pthread_exit(0);
+				*n = num;
 				return 0;
 			}
 		} else if (in <= 0) {
 			/* error or end-of-file */
-			if ((-1 == in) && (errno == EINVAL) && disable_directio(In,Infile))
-				continue;
 			if ((-1 == in) && (errno == EINTR))
 				continue;
 			if ((-1 == in) && (Terminate == 0))
 				errormsg("inputThread: error reading at offset 0x%llx: %s\n",Numin*Blocksize,strerror(errno));
-			Rest = num;
-			Finish = at;
-			debugmsg("inputThread: last block has %llu bytes\n",num);
-			err = pthread_mutex_lock(&HighMut);
+			*n = num;
+			return in;
+		}
+	} while (num < Blocksize);
+	*n = num;
+	return 1;
+}
+
+
+int readBlock(unsigned at)
+{
+	size_t num;
+	int ret = fillBlock(Buffer[at],&num,FlushAfter != 0);
+
+	if (ret <= 0) {
+		lastBlock(at,num);
+		if (Status)
+			pthread_exit((void *)(ptrdiff_t) ret);
+	}
+	if (Lengths)
+		Lengths[at] = num;
+	return ret;
+}
+
+
+typedef struct {
+	size_t num;	/* bytes read into the slot so far */
+	int done;	/* slot is complete: full, end-of-file, or error */
+	int err;	/* errno of a failed read */
+} inreq_t;
+
+
+#ifdef HAVE_IO_URING
+
+/*
+ * Keeps up to InQueue reads in flight, each into its own free buffer
+ * block, and hands the blocks over to the output in the order of
+ * their file offsets. Multiple reads in flight need explicit offsets
+ * so this is only used for seekable inputs. Returns 0 if io_uring
+ * cannot be used and the caller has to fall back to read().
+ */
+static int uringInput(void)
+{
+	unsigned at = 0, depth = InQueue, inflight = 0, eof = 0;
+	long long xfer = 0;
+	struct timespec last;
+	struct stat st;
+	uring_t *ring;
+	inreq_t *req;
+	off_t base;
+
+	if ((NumVolumes != 1) || (IDevBSize != 0))
+		return 0;
+	if ((-1 == fstat(In,&st)) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+		infomsg("input is not seekable - not using io_uring\n");
+		return 0;
+	}
+	base = lseek(In,0,SEEK_CUR);
+	if (base == -1)
+		return 0;
+	if (depth > Numblocks)
+		depth = Numblocks;
+	ring = uringOpen(depth);
+	if (ring == 0)
+		return 0;
+	req = calloc(depth,sizeof(inreq_t));
+	assert(req);
+	infomsg("inputThread: reading with %u requests in flight\n",depth);
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		unsigned long long seq;
+		inreq_t *r;
+		int res;
+
+		if (Terminate) {
+			debugmsg("inputThread: terminating early upon request...\n");
+			uringDrain(ring);
+			uringClose(ring);
+			free(req);
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			return 1;
+		}
+		while (!eof && (inflight < depth)) {
+			if (0 == ringAcquire(inflight == 0))
+				break;
+			seq = Numin + inflight;
+			r = req + seq % depth;
+			bzero(r,sizeof(inreq_t));
+			if (-1 == uringPrepare(ring,URING_READ,In,Buffer[(at + inflight) % Numblocks],Blocksize,base + seq * Blocksize,seq)) {
+				r->done = 1;
+				r->err = errno;
+				eof = 1;
+			}
+			++inflight;
+		}
+		if (-1 == uringSubmit(ring,1)) {
+			unsigned i;
+			for (i = 0; i < inflight; ++i) {
+				r = req + (Numin + i) % depth;
+				if (!r->done) {
+					r->done = 1;
+					r->err = errno;
+				}
+			}
+			eof = 1;
+		}
+		while (uringComplete(ring,&seq,&res)) {
+			r = req + seq % depth;
+			debugiomsg("inputThread: io_uring read of block %llu = %d\n",seq,res);
+			if (res == -EINVAL) {
+				res = directio_retry(In,Infile,Buffer[(at + seq - Numin) % Numblocks] + r->num,Blocksize - r->num,base + seq * Blocksize + r->num,0);
+				if (res == -1)
+					res = -errno;
+			}
+			if (res > 0) {
+				r->num += res;
+				if (r->num == Blocksize) {
+					r->done = 1;
+					continue;
+				}
+			} else if (res == 0) {
+				r->done = 1;
+				eof = 1;
+				continue;
+			} else if ((res != -EINTR) && (res != -EAGAIN)) {
+				r->err = -res;
+				r->done = 1;
+				eof = 1;
+				continue;
+			}
+			/* short read or retryable error: request the rest */
+			if (-1 == uringPrepare(ring,URING_READ,In,Buffer[(at + seq - Numin) % Numblocks] + r->num,Blocksize - r->num,base + seq * Blocksize + r->num,seq)) {
+				r->err = errno;
+				r->done = 1;
+				eof = 1;
+			}
+		}
+		/* publish completed blocks in order */
+		while (inflight) {
+			r = req + Numin % depth;
+			if (!r->done)
+				break;
+			if (r->num != Blocksize) {
+				if (r->err && (Terminate == 0))
+					errormsg("inputThread: error reading at offset 0x%llx: %s\n",(unsigned long long)(base + Numin * Blocksize + r->num),strerror(r->err));
+				uringDrain(ring);
+				uringClose(ring);
+				(void) lseek(In,base + Numin * Blocksize + r->num,SEEK_SET);
+				lastBlock(at,r->num);
+				free(req);
+				return 1;
+			}
+			if (MaxReadSpeed)
+				xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+			ringPublish();
+			cacheInput(Blocksize);
+			if (++at == Numblocks)
+				at = 0;
+			Numin++;
+			--inflight;
+		}
+	}
+}
+#endif
+
+
+/* state shared by the parallel reader threads */
+static pthread_mutex_t ReqMut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t
+	ReqIssued = PTHREAD_COND_INITIALIZER,	/* a block waits for a reader */
+	ReqDone = PTHREAD_COND_INITIALIZER;	/* a reader has completed a block */
+static inreq_t *Req = 0;
+static unsigned ReqDepth = 0;
+static unsigned long long Issued = 0, Claimed = 0;	/* blocks handed out and picked up by readers */
+static off_t ReqBase = 0;
+static int ReqStop = 0;
+
+
+/* reads the blocks handed out by parallelInput with pread */
+static void *readerThread(void *arg)
+{
+	int err;
+
+	numaPinThread(NUMA_INPUT,In,"readerThread");
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	for (;;) {
+		unsigned long long seq;
+		size_t num = 0;
+		char *buf;
+		int rerr = 0;
+
+		while ((Claimed == Issued) && !ReqStop) {
+			err = pthread_cond_wait(&ReqIssued,&ReqMut);
 			assert(err == 0);
-			err = sem_post(&Buf2Dev);
+		}
+		if (ReqStop)
+			break;
+		seq = Claimed++;
+		err = pthread_mutex_unlock(&ReqMut);
+		assert(err == 0);
+		buf = Buffer[seq % Numblocks];
+		while (num < Blocksize) {
+			ssize_t in = pread(In,buf + num,Blocksize - num,ReqBase + seq * Blocksize + num);
+			if ((-1 == in) && (errno == EINVAL))
+				in = directio_retry(In,Infile,buf + num,Blocksize - num,ReqBase + seq * Blocksize + num,0);
+			debugiomsg("readerThread: pread(In, Buffer[%llu] + %llu, %llu, %llu) = %d\n",seq % Numblocks,num,Blocksize - num,seq * Blocksize + num,in);
+			if (in > 0) {
+				num += in;
+			} else if ((-1 == in) && (errno == EINTR)) {
+				continue;
+			} else {
+				if (-1 == in)
+					rerr = errno;
+				break;
+			}
+		}
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		Req[seq % ReqDepth].num = num;
+		Req[seq % ReqDepth].err = rerr;
+		Req[seq % ReqDepth].done = 1;
+		err = pthread_cond_broadcast(&ReqDone);
+		assert(err == 0);
+	}
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	return 0;
+}
+
+
+static void stopReaders(pthread_t *thr, unsigned n)
+{
+	int err;
+
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	ReqStop = 1;
+	err = pthread_cond_broadcast(&ReqIssued);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	while (n) {
+		err = pthread_join(thr[--n],0);
+		assert(err == 0);
+	}
+}
+
+
+/*
+ * Reads seekable input with Readers threads. Each reader reads a whole
+ * block with pread straight into the block of the buffer it belongs to.
+ * Up to two blocks per reader are handed out ahead, and the completed
+ * blocks are passed on to the output in the order of their offsets.
+ * Returns 0 if the input cannot be read this way.
+ */
+static int parallelInput(void)
+{
+	unsigned at = 0, inflight = 0, n;
+	long long xfer = 0;
+	struct timespec last;
+	pthread_t *thr;
+	int err;
+
+	if (!Seekable || (NumVolumes != 1) || (IDevBSize != 0))
+		return 0;
+	ReqBase = lseek(In,0,SEEK_CUR);
+	if (ReqBase == -1)
+		return 0;
+	ReqDepth = Readers * 2;
+	if (ReqDepth > Numblocks)
+		ReqDepth = Numblocks;
+	Req = calloc(ReqDepth,sizeof(inreq_t));
+	thr = calloc(Readers,sizeof(pthread_t));
+	if ((Req == 0) || (thr == 0))
+		fatal("out of memory\n");
+	for (n = 0; n < Readers; ++n) {
+		err = pthread_create(thr + n,0,readerThread,0);
+		if (err) {
+			warningmsg("unable to create reader thread: %s\n",strerror(err));
+			break;
+		}
+	}
+	if (n == 0) {
+		free(thr);
+		return 0;
+	}
+	infomsg("inputThread: reading with %u threads\n",n);
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		inreq_t r;
+
+		if (Terminate) {
+			debugmsg("inputThread: terminating early upon request...\n");
+			stopReaders(thr,n);
+			free(thr);
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			return 1;
+		}
+		while (inflight < ReqDepth) {
+			if (0 == ringAcquire(inflight == 0))
+				break;
+			err = pthread_mutex_lock(&ReqMut);
 			assert(err == 0);
-			err = pthread_cond_signal(&PercHigh);
+			bzero(Req + Issued % ReqDepth,sizeof(inreq_t));
+			++Issued;
+			err = pthread_cond_signal(&ReqIssued);
 			assert(err == 0);
-			err = pthread_mutex_unlock(&HighMut);
+			err = pthread_mutex_unlock(&ReqMut);
 			assert(err == 0);
-			infomsg("inputThread: exiting...\n");
-			if (Status)
-				pthread_exit((void *)(ptrdiff_t) in);
-			return in;
+			++inflight;
 		}
-	} while (num < Blocksize);
+		if (inflight == 0)
+			continue;
+		/* wait for the oldest block */
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		pthread_cleanup_push(releaseLock,&ReqMut);
+		while (!Req[Numin % ReqDepth].done) {
+			err = pthread_cond_wait(&ReqDone,&ReqMut);
+			assert(err == 0);
+		}
+		r = Req[Numin % ReqDepth];
+		pthread_cleanup_pop(1);
+		if (r.num != Blocksize) {
+			if (r.err && (Terminate == 0))
+				errormsg("inputThread: error reading at offset 0x%llx: %s\n",(unsigned long long)(ReqBase + Numin * Blocksize + r.num),strerror(r.err));
+			stopReaders(thr,n);
+			free(thr);
+			(void) lseek(In,ReqBase + Numin * Blocksize + r.num,SEEK_SET);
+			lastBlock(at,r.num);
+			return 1;
+		}
+		if (MaxReadSpeed)
+			xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+		ringPublish();
+		cacheInput(Blocksize);
+		if (++at == Numblocks)
+			at = 0;
+		Numin++;
+		--inflight;
+	}
+}
+
+
+/* state of the framed network input, see options --framed and --streams */
+static int *StreamFd = 0;
+static unsigned NumStreams = 0, StreamsEnded = 0;
+static unsigned long long
+	StreamEnd = 0,		/* number of blocks, once known */
+	StreamBytes = 0,	/* bytes received */
+	SentBytes = 0;		/* bytes sent according to the trailer */
+static int StreamErr = 0, HaveTrailer = 0;
+char *SenderHashes = 0;		/* hash results of the sender */
+
+
+/* decompression of compressed frames, see option --compress */
+typedef struct {
+	unsigned long long seq;
+	char *buf;		/* compressed payload in a scratch buffer */
+	size_t len;
+	uint32_t crc;
+	int flags;
+} unpack_t;
+
+static pthread_cond_t
+	UnpackIssued = PTHREAD_COND_INITIALIZER,	/* a frame waits for decompression */
+	ScratchFreed = PTHREAD_COND_INITIALIZER;	/* a scratch buffer has been returned */
+static unpack_t *Unpack = 0;		/* queue of frames to decompress */
+static char **Scratch = 0;		/* free scratch buffers */
+static pthread_t *Unpackers = 0;
+static unsigned NumScratch = 0, NumFree = 0, NumUnpack = 0, UnpackHead = 0, NumUnpackers = 0;
+static unsigned Unpacking = 0;		/* frames queued or being decompressed */
+
+
+static void streamFailed(int e)
+{
+	int err;
+
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	if (StreamErr == 0)
+		StreamErr = e;
+	err = pthread_cond_broadcast(&ReqDone);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+}
+
+
+/* marks block seq as complete with len bytes; called with ReqMut held */
+static void streamBlock(unsigned long long seq, size_t len)
+{
+	int err;
+
+	StreamBytes += len;
+	Req[seq % ReqDepth].num = len;
+	Req[seq % ReqDepth].done = 1;
+	err = pthread_cond_broadcast(&ReqDone);
+	assert(err == 0);
+}
+
+
+/* decompresses queued frames into their buffer blocks */
+static void *unpackThread(void *ignored)
+{
+	codec_t *c = codecOpen();
+	int err;
+
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	for (;;) {
+		unpack_t u;
+		ssize_t num;
+		char *buf;
+		int e = 0;
+
+		while ((NumUnpack == 0) && !ReqStop) {
+			err = pthread_cond_wait(&UnpackIssued,&ReqMut);
+			assert(err == 0);
+		}
+		if (ReqStop)
+			break;
+		u = Unpack[UnpackHead];
+		UnpackHead = (UnpackHead + 1) % NumScratch;
+		--NumUnpack;
+		err = pthread_mutex_unlock(&ReqMut);
+		assert(err == 0);
+		buf = Buffer[u.seq % Numblocks];
+		num = codecDecompress(c,(u.flags & FRAME_LZ4) ? CODEC_LZ4 : CODEC_ZSTD,u.buf,u.len,buf,Blocksize);
+		debugiomsg("unpackThread: block %llu: %zu bytes to %zd bytes\n",u.seq,u.len,num);
+		if (num == -1) {
+			errormsg("unpackThread: unable to decompress block %llu\n",u.seq);
+			e = EBADMSG;
+		} else if ((u.flags & FRAME_CRC) && (crc32c(0,buf,num) != u.crc)) {
+			errormsg("unpackThread: checksum mismatch in block %llu\n",u.seq);
+			e = EBADMSG;
+		} else {
+			Lengths[u.seq % Numblocks] = num;
+		}
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		Scratch[NumFree++] = u.buf;
+		--Unpacking;
+		err = pthread_cond_signal(&ScratchFreed);
+		assert(err == 0);
+		if (e == 0) {
+			streamBlock(u.seq,num);
+		} else {
+			if (StreamErr == 0)
+				StreamErr = e;
+			err = pthread_cond_broadcast(&ReqDone);
+			assert(err == 0);
+		}
+	}
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	codecClose(c);
+	return 0;
+}
+
+
+static void startUnpackers(void)
+{
+	unsigned i;
+	int err;
+
+	NumUnpackers = codecThreads();
+	NumScratch = NumUnpackers * 2;
+	if (NumScratch < NumStreams)
+		NumScratch = NumStreams;
+	Unpack = calloc(NumScratch,sizeof(unpack_t));
+	Scratch = calloc(NumScratch,sizeof(char *));
+	Unpackers = calloc(NumUnpackers,sizeof(pthread_t));
+	if ((Unpack == 0) || (Scratch == 0) || (Unpackers == 0))
+		fatal("out of memory\n");
+	for (NumFree = 0; NumFree < NumScratch; ++NumFree) {
+		Scratch[NumFree] = malloc(Blocksize);
+		if (Scratch[NumFree] == 0)
+			fatal("out of memory\n");
+	}
+	for (i = 0; i < NumUnpackers; ++i) {
+		err = pthread_create(Unpackers + i,0,unpackThread,0);
+		if (err)
+			fatal("unable to create decompression thread: %s\n",strerror(err));
+	}
+	debugmsg("decompressing with %u threads\n",NumUnpackers);
+}
+
+
+/* reads a compressed payload into a scratch buffer and queues it */
+static int streamUnpack(int fd, unsigned long long seq, size_t len, uint32_t crc, int flags)
+{
+	ssize_t num;
+	char *buf;
+	int err;
+
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	while ((NumFree == 0) && !ReqStop) {
+		err = pthread_cond_wait(&ScratchFreed,&ReqMut);
+		assert(err == 0);
+	}
+	buf = ReqStop ? 0 : Scratch[--NumFree];
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	if (buf == 0)
+		return 0;
+	num = readAll(fd,buf,len);
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	if (num == (ssize_t)len) {
+		unpack_t *u = Unpack + (UnpackHead + NumUnpack++) % NumScratch;
+		u->seq = seq;
+		u->buf = buf;
+		u->len = len;
+		u->crc = crc;
+		u->flags = flags;
+		++Unpacking;
+		err = pthread_cond_signal(&UnpackIssued);
+	} else {
+		Scratch[NumFree++] = buf;
+		err = pthread_cond_signal(&ScratchFreed);
+	}
+	assert(err == 0);
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	if (num != (ssize_t)len) {
+		streamFailed(num == -1 ? errno : ECONNRESET);
+		return 0;
+	}
+	return 1;
+}
+
+
+/* receives the blocks of one stream straight into their buffer blocks */
+static void *streamThread(void *arg)
+{
+	unsigned idx = (unsigned)(size_t) arg;
+	unsigned long long next = idx;	/* stream idx carries blocks idx, idx+N, idx+2N, ... */
+	int fd = StreamFd[idx], err;
+
+	for (;;) {
+		unsigned long long seq;
+		size_t len;
+		ssize_t num;
+		uint32_t crc;
+		char *buf;
+		int r = recvFrame(fd,&seq,&len,&crc);
+
+		if (r == -1) {
+			streamFailed(errno);
+			return 0;
+		}
+		if (r & FRAME_END) {
+			unsigned long long bytes = 0;
+			char *hashes = 0;
+			/* the end is after the last block of this stream */
+			if ((seq > next) || (seq + NumStreams <= next)) {
+				streamFailed(EPROTO);
+				return 0;
+			}
+			if (len && (-1 == recvTrailer(fd,len,&bytes,&hashes))) {
+				streamFailed(errno);
+				return 0;
+			}
+			err = pthread_mutex_lock(&ReqMut);
+			assert(err == 0);
+			if (len) {
+				SentBytes = bytes;
+				SenderHashes = hashes;
+				HaveTrailer = 1;
+			}
+			if (StreamsEnded && (StreamEnd != seq) && (StreamErr == 0))
+				StreamErr = EPROTO;
+			StreamEnd = seq;
+			++StreamsEnded;
+			err = pthread_cond_broadcast(&ReqDone);
+			assert(err == 0);
+			err = pthread_mutex_unlock(&ReqMut);
+			assert(err == 0);
+			return 0;
+		}
+		if ((len > Blocksize) || (seq != next)) {
+			streamFailed(EPROTO);
+			return 0;
+		}
+		next += NumStreams;
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		while ((seq >= Issued) && !ReqStop) {
+			err = pthread_cond_wait(&ReqIssued,&ReqMut);
+			assert(err == 0);
+		}
+		err = pthread_mutex_unlock(&ReqMut);
+		assert(err == 0);
+		if (ReqStop)
+			return 0;
+		if (r & (FRAME_LZ4|FRAME_ZSTD)) {
+			if (Unpackers == 0) {
+				streamFailed(EPROTO);
+				return 0;
+			}
+			if (streamUnpack(fd,seq,len,crc,r))
+				continue;
+			return 0;
+		}
+		buf = Buffer[seq % Numblocks];
+		num = readAll(fd,buf,len);
+		debugiomsg("streamThread: stream %u, block %llu: %zd of %zu bytes\n",idx,seq,num,len);
+		if (num != (ssize_t)len) {
+			streamFailed(num == -1 ? errno : ECONNRESET);
+			return 0;
+		}
+		if ((r & FRAME_CRC) && (crc32c(0,buf,len) != crc)) {
+			errormsg("streamThread: checksum mismatch in block %llu\n",seq);
+			streamFailed(EBADMSG);
+			return 0;
+		}
+		Lengths[seq % Numblocks] = len;
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		streamBlock(seq,len);
+		err = pthread_mutex_unlock(&ReqMut);
+		assert(err == 0);
+	}
+}
+
+
+static void stopStreams(pthread_t *thr, unsigned n)
+{
+	unsigned i;
+	int err;
+
+	for (i = 0; i < NumStreams; ++i)
+		(void) shutdown(StreamFd[i],SHUT_RDWR);
+	err = pthread_mutex_lock(&ReqMut);
+	assert(err == 0);
+	ReqStop = 1;
+	err = pthread_cond_broadcast(&UnpackIssued);
+	assert(err == 0);
+	err = pthread_cond_broadcast(&ScratchFreed);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&ReqMut);
+	assert(err == 0);
+	stopReaders(thr,n);
+	for (i = 0; i < NumUnpackers; ++i) {
+		err = pthread_join(Unpackers[i],0);
+		assert(err == 0);
+	}
+	for (i = 0; i < NumFree; ++i)
+		free(Scratch[i]);
+	free(Scratch);
+	free(Unpack);
+	free(Unpackers);
+	for (i = 1; i < NumStreams; ++i)
+		(void) close(StreamFd[i]);
+	free(StreamFd);
+	free(thr);
+}
+
+
+/*
+ * Receives the frames of a sender with option --framed or --streams,
+ * which distributes the blocks round-robin across its connections.
+ * Every stream has a thread that reads the blocks into the buffer
+ * blocks given by their sequence numbers, and the completed blocks are
+ * passed on in order. Compressed blocks are read into scratch buffers
+ * and decompressed into their buffer blocks by a pool of threads.
+ * Returns 0 if the sender does not use frames.
+ */
+static int streamInput(void)
+{
+	unsigned at = 0, inflight = 0, n;
+	long long xfer = 0;
+	struct timespec last;
+	unsigned features;
+	pthread_t *thr;
+	int err;
+
+	NumStreams = acceptStreams(&StreamFd,&features);
+	if (NumStreams == 0)
+		return 0;
+	if (features & (CODEC_LZ4|CODEC_ZSTD))
+		startUnpackers();
+	ReqDepth = NumStreams * 2;
+	if (ReqDepth > Numblocks)
+		ReqDepth = Numblocks;
+	Req = calloc(ReqDepth,sizeof(inreq_t));
+	thr = calloc(NumStreams,sizeof(pthread_t));
+	if ((Req == 0) || (thr == 0))
+		fatal("out of memory\n");
+	for (n = 0; n < NumStreams; ++n) {
+		err = pthread_create(thr + n,0,streamThread,(void *)(size_t) n);
+		if (err)
+			fatal("unable to create stream thread: %s\n",strerror(err));
+	}
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		inreq_t r;
+		unsigned long long end, sent, got;
+		int e, trailer;
+
+		if (Terminate) {
+			debugmsg("inputThread: terminating early upon request...\n");
+			stopStreams(thr,n);
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			return 1;
+		}
+		while (inflight < ReqDepth) {
+			if (0 == ringAcquire(inflight == 0))
+				break;
+			err = pthread_mutex_lock(&ReqMut);
+			assert(err == 0);
+			bzero(Req + Issued % ReqDepth,sizeof(inreq_t));
+			++Issued;
+			err = pthread_cond_broadcast(&ReqIssued);
+			assert(err == 0);
+			err = pthread_mutex_unlock(&ReqMut);
+			assert(err == 0);
+			++inflight;
+		}
+		if (inflight == 0)
+			continue;
+		/* wait for the oldest block, the end of all streams, or an error */
+		err = pthread_mutex_lock(&ReqMut);
+		assert(err == 0);
+		pthread_cleanup_push(releaseLock,&ReqMut);
+		while (!Req[Numin % ReqDepth].done && (StreamErr == 0) && ((StreamsEnded < NumStreams) || Unpacking)) {
+			err = pthread_cond_wait(&ReqDone,&ReqMut);
+			assert(err == 0);
+		}
+		r = Req[Numin % ReqDepth];
+		e = StreamErr;
+		end = StreamEnd;
+		trailer = HaveTrailer;
+		sent = SentBytes;
+		got = StreamBytes;
+		pthread_cleanup_pop(1);
+		if (!r.done) {
+			if (e || (Numin != end))
+				errormsg("inputThread: error receiving block %llu: %s\n",Numin,strerror(e ? e : EPROTO));
+			else if (trailer && (sent != got))
+				errormsg("inputThread: received %llu bytes, but the sender sent %llu bytes\n",got,sent);
+			else
+				debugmsg("inputThread: received %llu bytes as announced by the sender\n",got);
+			stopStreams(thr,n);
+			lastBlock(at,0);
+			return 1;
+		}
+		if (MaxReadSpeed)
+			xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+		ringPublish();
+		if (++at == Numblocks)
+			at = 0;
+		Numin++;
+		--inflight;
+	}
+}
+
+
+static int Spill = -1;			/* overflow tier, see option --spill */
+static off_t SpillRd = 0, SpillWr = 0;	/* offsets of the next block to read back and to write */
+static volatile unsigned long Spilled = 0;	/* blocks in the spill file */
+
+
+void openSpill()
+{
+	int flags = O_RDWR | O_LARGEFILE;
+
+	if (SpillFile == 0)
+		return;
+	if (strncmp(SpillFile,"/dev/",5))
+		flags |= O_CREAT | O_EXCL;
+	Spill = open(SpillFile,flags,0600);
+	if (-1 == Spill)
+		fatal("could not create spill file (%s): %s\n",SpillFile,strerror(errno));
+	if (strncmp(SpillFile,"/dev/",5))
+		(void) unlink(SpillFile);
+	/* blocks are only read back once, so keep them out of the page cache */
+	enable_directio(Spill,SpillFile);
+}
+
+
+unsigned long spillBlocks()
+{
+	return Spilled;
+}
+
+
+/* appends a block to the spill file; returns 0 if it is full */
+static int spillWrite(const char *buf)
+{
+	size_t num = 0;
+
+	while (num < Blocksize) {
+		ssize_t w = pwrite(Spill,buf + num,Blocksize - num,SpillWr + num);
+		if ((-1 == w) && (errno == EINVAL))
+			w = directio_retry(Spill,SpillFile,(char *)buf + num,Blocksize - num,SpillWr + num,1);
+		debugiomsg("inputThread: pwrite(Spill, %p, %llu, 0x%llx) = %d\n",buf + num,Blocksize - num,(unsigned long long)(SpillWr + num),w);
+		if (w > 0) {
+			num += w;
+		} else if ((-1 == w) && (errno == EINTR)) {
+			continue;
+		} else if ((0 == w) || (errno == ENOSPC) || (errno == EFBIG)) {
+			static int warned = 0;
+			if (!warned)
+				warningmsg("spill file is full after %llu blocks - waiting for the buffer to drain\n",(unsigned long long)(SpillWr / Blocksize));
+			warned = 1;
+			return 0;
+		} else {
+			fatal("error writing spill file: %s\n",strerror(errno));
+		}
+	}
+	SpillWr += Blocksize;
+	++Spilled;
 	return 1;
 }
 
 
+/* reads the oldest block of the spill file back into the buffer */
+static void spillRead(unsigned at)
+{
+	size_t num = 0;
+
+	while (num < Blocksize) {
+		ssize_t r = pread(Spill,Buffer[at] + num,Blocksize - num,SpillRd + num);
+		if ((-1 == r) && (errno == EINVAL))
+			r = directio_retry(Spill,SpillFile,Buffer[at] + num,Blocksize - num,SpillRd + num,0);
+		debugiomsg("inputThread: pread(Spill, Buffer[%d] + %llu, %llu, 0x%llx) = %d\n",at,num,Blocksize - num,(unsigned long long)(SpillRd + num),r);
+		if (r > 0) {
+			num += r;
+		} else if ((-1 == r) && (errno == EINTR)) {
+			continue;
+		} else {
+			fatal("error reading spill file: %s\n",r ? strerror(errno) : "unexpected end of file");
+		}
+	}
+	SpillRd += Blocksize;
+	--Spilled;
+	if (Lengths)
+		Lengths[at] = Blocksize;
+	/* start over at the beginning of the file once it has drained */
+	if (SpillRd == SpillWr)
+		SpillRd = SpillWr = 0;
+}
+
+
+/* is input available without waiting for long? */
+static int inputReady(void)
+{
+	struct pollfd p;
+
+	p.fd = In;
+	p.events = POLLIN;
+	p.revents = 0;
+	return poll(&p,1,10) != 0;
+}
+
+
+/*
+ * Input with an overflow tier: while the buffer has room, blocks are
+ * read into it directly. Once it has run full, further blocks are
+ * appended to the spill file and read back in order as soon as the
+ * output has freed some room. Spilled blocks always go first, so the
+ * order of the data is kept and the input only has to wait when the
+ * spill file is full, too.
+ */
+static void *spillInput(void)
+{
+	unsigned at = 0;
+	size_t staged = 0, tail = 0;	/* bytes of the block that did not fit, and of the last spilled block */
+	long long xfer = 0;
+	struct timespec last;
+	void *result = 0;
+	int eof = 0;
+	char *stage = valloc(Blocksize);
+
+	if (stage == 0)
+		fatal("out of memory\n");
+	infomsg("inputThread: spilling to %s when the buffer is full\n",SpillFile);
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		size_t num;
+		int ret;
+
+		if (Terminate) {	/* for async termination requests */
+			debugmsg("inputThread: terminating early upon request...\n");
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			if (Status)
+				pthread_exit((void *)1);
+			return (void *) 1;
+		}
+		if (Spilled) {
+			/* refill the buffer first, and only wait for room if no more input can be taken */
+			if (ringAcquire(eof || staged)) {
+				spillRead(at);
+				if (eof && tail && (Spilled == 0)) {
+					lastBlock(at,tail);
+					return result;
+				}
+				ringPublish();
+				if (++at == Numblocks)
+					at = 0;
+				continue;
+			}
+			if (eof || staged || !inputReady())
+				continue;
+		} else if (staged) {
+			/* the spill file has drained: pass on the block that did not fit */
+			if (0 == ringAcquire(1))
+				continue;
+			(void) memcpy(Buffer[at],stage,staged);
+			if (Lengths)
+				Lengths[at] = staged;
+			if (eof) {
+				lastBlock(at,staged);
+				return result;
+			}
+			ringPublish();
+			if (++at == Numblocks)
+				at = 0;
+			staged = 0;
+			continue;
+		} else if (eof) {
+			if (0 == ringAcquire(1))
+				continue;
+			lastBlock(at,0);
+			return result;
+		} else if (ringAcquire(0)) {
+			if (0 >= readBlock(at)) {
+				debugmsg("inputThread: no more blocks\n");
+				return 0;
+			}
+			if (MaxReadSpeed)
+				xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+			ringPublish();
+			if (++at == Numblocks)
+				at = 0;
+			Numin++;
+			continue;
+		}
+		/* the buffer is full: the next block goes to the spill file */
+		ret = fillBlock(stage,&num,0);
+		if (ret <= 0) {
+			eof = 1;
+			result = (void *)(ptrdiff_t) ret;
+		} else {
+			if (MaxReadSpeed)
+				xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+			Numin++;
+		}
+		if (num == 0)
+			continue;
+		if (spillWrite(stage))
+			tail = (num < Blocksize) ? num : 0;
+		else
+			staged = num;
+	}
+}
+
+
+/*
+ * Reads into up to max consecutive free blocks of the buffer with a
+ * single readv, which saves system calls for small block sizes. Full
+ * blocks are passed on right away, and a partially filled block is
+ * completed by the next read.
+ */
+static void *batchInput(unsigned max)
+{
+	unsigned at = 0, acquired = 0;
+	size_t num = 0;		/* bytes in the block at */
+	long long xfer = 0;
+	struct timespec last, since;
+	struct iovec *iov = calloc(max,sizeof(struct iovec));
+
+	assert(iov);
+	debugmsg("inputThread: reading up to %u blocks at once\n",max);
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		unsigned i;
+		ssize_t in;
+
+		if ((acquired == 0) && ringAcquire(1))
+			++acquired;
+		if (Terminate) {	/* for async termination requests */
+			debugmsg("inputThread: terminating early upon request...\n");
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			if (Status)
+				pthread_exit((void *)1);
+			return (void *) 1;
+		}
+		assert(acquired);
+		if (FlushAfter && num && !waitFlush(&since)) {
+			debugiomsg("inputThread: passing on partial block with %llu bytes\n",(unsigned long long)num);
+			Lengths[at] = num;
+			ringPublish();
+			if (++at == Numblocks)
+				at = 0;
+			Numin++;
+			num = 0;
+			--acquired;
+			continue;
+		}
+		while ((acquired < max) && ringAcquire(0))
+			++acquired;
+		iov[0].iov_base = Buffer[at] + num;
+		iov[0].iov_len = Blocksize - num;
+		for (i = 1; i < acquired; ++i) {
+			iov[i].iov_base = Buffer[(at + i) % Numblocks];
+			iov[i].iov_len = Blocksize;
+		}
+		waitInput();
+		in = readv(In,iov,acquired);
+		if ((-1 == in) && (errno == EINVAL))
+			in = directio_retryv(In,Infile,iov,acquired,-1,0);
+		debugiomsg("inputThread: readv(In, Buffer[%d] + %llu, %u blocks) = %d\n",at,num,acquired,in);
+		if (in > 0) {
+			if ((num == 0) || (num + in >= Blocksize))
+				(void) clock_gettime(ClockSrc,&since);
+			num += in;
+			cacheInput(in);
+			while (num >= Blocksize) {
+				if (MaxReadSpeed)
+					xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+				if (Lengths)
+					Lengths[at] = Blocksize;
+				ringPublish();
+				if (++at == Numblocks)
+					at = 0;
+				Numin++;
+				num -= Blocksize;
+				--acquired;
+			}
+			continue;
+		}
+		/* error or end-of-file */
+		if ((-1 == in) && (errno == EINTR))
+			continue;
+		if ((-1 == in) && (Terminate == 0))
+			errormsg("inputThread: error reading at offset 0x%llx: %s\n",Numin*Blocksize,strerror(errno));
+		free(iov);
+		lastBlock(at,num);
+		if (Status)
+			pthread_exit((void *)(ptrdiff_t) in);
+		return 0;
+	}
+}
+
+
+/*
+ * Reads one record of a variable block tape into each block of the
+ * buffer and stores its length, so that the output writes the records
+ * unchanged. Unlike devread, this needs no intermediate copy, but the
+ * block size must be at least the size of the largest record.
+ */
+static void *recordInput(void)
+{
+	unsigned at = 0;
+	long long xfer = 0;
+	struct timespec last;
+
+	infomsg("inputThread: keeping input records of up to %llu bytes\n",Blocksize);
+	(void) clock_gettime(ClockSrc,&last);
+	for (;;) {
+		int acquired = ringAcquire(1);
+		ssize_t in;
+
+		if (Terminate) {	/* for async termination requests */
+			debugmsg("inputThread: terminating early upon request...\n");
+			if (-1 == close(In))
+				errormsg("error closing input: %s\n",strerror(errno));
+			if (Status)
+				pthread_exit((void *)1);
+			return (void *) 1;
+		}
+		assert(acquired);
+		waitInput();
+		do
+			in = read(In,Buffer[at],Blocksize);
+		while ((-1 == in) && (errno == EINTR));
+		debugiomsg("inputThread: read(In, Buffer[%d], %llu) = %d\n",at,Blocksize,in);
+		if (in > 0) {
+			Lengths[at] = in;
+			cacheInput(in);
+			if (MaxReadSpeed)
+				xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
+			ringPublish();
+			if (++at == Numblocks)
+				at = 0;
+			Numin++;
+			continue;
+		}
+		if (((0 == in) || ((-1 == in) && (errno == EIO))) && (Terminal||Autoloader) && (NumVolumes != 1)) {
+			/* the block stays acquired for the first record of the next volume */
+			if (requestInputVolume())
+				continue;
+		} else if ((-1 == in) && (errno == ENOMEM)) {
+			errormsg("inputThread: record larger than the block size of %llu bytes - increase it with option -s\n",Blocksize);
+		} else if ((-1 == in) && (Terminate == 0)) {
+			errormsg("inputThread: error reading record %llu: %s\n",Numin,strerror(errno));
+		}
+		lastBlock(at,0);
+		if (Status)
+			pthread_exit((void *)(ptrdiff_t) in);
+		return 0;
+	}
+}
+
+
 void *inputThread(void *ignored)
 {
-	int fill = 0;
 	unsigned at = 0;
 	long long xfer = 0;
-	const double startread = StartRead, startwrite = StartWrite;
 	struct timespec last;
 
 #ifndef __sun
@@ -349,26 +1498,27 @@ void *inputThread(void *ignored)
 	(void) clock_gettime(ClockSrc,&last);
 	assert(ignored == 0);
 	infomsg("inputThread: starting with threadid 0x%lx...\n",(long)pthread_self());
+	numaPinThread(NUMA_INPUT,In,"inputThread");
+	if (Framed && streamInput())
+		return 0;
+	if (Records)
+		return recordInput();
+	if (Spill != -1)
+		return spillInput();
+#ifdef HAVE_IO_URING
+	if (InQueue && uringInput())
+		return 0;
+#endif
+	if ((Readers > 1) && parallelInput())
+		return 0;
+	if ((NumVolumes == 1) && (IDevBSize == 0)) {
+		unsigned batch = batchBlocks(In);
+		if (batch > 1)
+			return batchInput(batch);
+	}
 	for (;;) {
-		int err;
+		int acquired = ringAcquire(1);
 
-		if (startread < 1) {
-			err = pthread_mutex_lock(&LowMut);
-			assert(err == 0);
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if (fill == Numblocks - 1) {
-				debugmsg("inputThread: buffer full, waiting for it to drain.\n");
-				pthread_cleanup_push(releaseLock,&LowMut);
-				err = pthread_cond_wait(&PercLow,&LowMut);
-				assert(err == 0);
-				pthread_cleanup_pop(0);
-				++FullCount;
-				debugmsg("inputThread: low watermark reached, continuing...\n");
-			}
-			err = pthread_mutex_unlock(&LowMut);
-			assert(err == 0);
-		}
 		if (Terminate) {	/* for async termination requests */
 			debugmsg("inputThread: terminating early upon request...\n");
 			if (-1 == close(In))
@@ -377,32 +1527,16 @@ void *inputThread(void *ignored)
 				pthread_exit((void *)1);
 			return (void *) 1;
 		}
-		err = sem_wait(&Dev2Buf); /* Wait for one or more buffer blocks to be free */
-		assert(err == 0);
+		assert(acquired);
 		if (0 >= readBlock(at)) {
 			debugmsg("inputThread: no more blocks\n");
 			return 0;
 		}
 		if (MaxReadSpeed)
 			xfer = enforceSpeedLimit(MaxReadSpeed,xfer,&last);
-		err = sem_post(&Buf2Dev);
-		assert(err == 0);
-		if (startwrite > 0) {
-			err = pthread_mutex_lock(&HighMut);
-			assert(err == 0);
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if (((double) fill / (double) Numblocks) + DBL_EPSILON >= startwrite) {
-				err = pthread_cond_signal(&PercHigh);
-				assert(err == 0);
-			}
-			err = pthread_mutex_unlock(&HighMut);
-			assert(err == 0);
-		}
+		ringPublish();
 		if (++at == Numblocks)
 			at = 0;
 		Numin++;
 	}
 }
-
-
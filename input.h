@@ -20,7 +20,11 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+extern char *SenderHashes;	/* hash results of a framed sender */
+
 void *inputThread(void *ignored);
 void openInput();
+void openSpill();
+unsigned long spillBlocks();
 
 #endif
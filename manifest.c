@@ -0,0 +1,242 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "manifest.h"
+#include "digest.h"
+#include "log.h"
+#include "settings.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A manifest lists the XXH3 hash of every chunk of the data. The
+ * chunks have the size of the buffer blocks of the mbuffer that wrote
+ * the manifest, and the last one may be shorter:
+ *
+ *	mbuffer manifest xxh3 <chunk size>
+ *	<hash of chunk 0>
+ *	...
+ *	end <number of bytes>
+ *
+ * When verifying, the chunks that differ from the manifest are reported
+ * as ranges, so only these parts need to be transferred again.
+ */
+
+#define MANIFEST_MAGIC "mbuffer manifest xxh3"
+
+struct manifest {
+	const char *path;
+	FILE *file;
+	int verify, algo;
+	void *ctxt;			/* hash of the current chunk */
+	size_t chunk, fill;		/* chunk size, bytes in the current chunk */
+	unsigned long long num,		/* completed chunks */
+		checked,		/* chunks compared with the manifest */
+		bad, first,		/* chunks that differ, first of the current range */
+		total;			/* bytes */
+	int inbad, end;			/* in a range that differs, manifest ended */
+};
+
+
+manifest_t *manifestOpen(const char *path, int verify)
+{
+	manifest_t *m = calloc(1,sizeof(manifest_t));
+
+	if (m == 0)
+		fatal("out of memory\n");
+	m->path = path;
+	m->verify = verify;
+	m->algo = digestLookup("xxh3");
+	m->file = fopen(path,verify ? "r" : "w");
+	if (m->file == 0)
+		fatal("unable to open manifest %s: %s\n",path,strerror(errno));
+	if (verify) {
+		char line[128];
+		unsigned long chunk = 0;
+		if ((0 == fgets(line,sizeof(line),m->file))
+			|| (0 != strncmp(line,MANIFEST_MAGIC " ",sizeof(MANIFEST_MAGIC)))
+			|| (1 != sscanf(line + sizeof(MANIFEST_MAGIC),"%lu",&chunk))
+			|| (chunk == 0))
+			fatal("%s is no valid manifest\n",path);
+		m->chunk = chunk;
+	}
+	return m;
+}
+
+
+/* the block size is only known once all options have been parsed */
+static void writeHeader(manifest_t *m)
+{
+	m->chunk = Blocksize;
+	if (0 > fprintf(m->file,MANIFEST_MAGIC " %lu\n",(unsigned long)m->chunk)) {
+		errormsg("unable to write manifest %s: %s\n",m->path,strerror(errno));
+		(void) fclose(m->file);
+		m->file = 0;
+	}
+}
+
+
+/* chunks first to last, which ends at byte end, differ */
+static void reportRange(manifest_t *m, unsigned long long last, unsigned long long end)
+{
+	if (m->first == last)
+		errormsg("manifest %s: chunk %llu (bytes %llu-%llu) differs\n",m->path,last,m->first * m->chunk,end);
+	else
+		errormsg("manifest %s: chunks %llu-%llu (bytes %llu-%llu) differ\n",m->path,m->first,last,m->first * m->chunk,end);
+	m->inbad = 0;
+}
+
+
+/* the current chunk is complete with m->fill bytes */
+static void endChunk(manifest_t *m)
+{
+	unsigned char md[DIGEST_MAXLEN];
+	char hex[2 * DIGEST_MAXLEN + 2], line[128];
+	size_t i, l = digestLength(m->algo);
+
+	digestFinal(m->algo,m->ctxt,md);
+	m->ctxt = 0;
+	for (i = 0; i < l; ++i)
+		(void) sprintf(hex + 2 * i,"%02x",(unsigned int)md[i]);
+	hex[2 * l] = '\n';
+	hex[2 * l + 1] = 0;
+	++m->num;
+	if (!m->verify) {
+		if (EOF == fputs(hex,m->file)) {
+			errormsg("unable to write manifest %s: %s\n",m->path,strerror(errno));
+			(void) fclose(m->file);
+			m->file = 0;
+		}
+		return;
+	}
+	if (m->end)
+		return;
+	if ((0 == fgets(line,sizeof(line),m->file)) || (0 == strncmp(line,"end ",4))) {
+		if (m->inbad)
+			reportRange(m,m->num - 2,(m->num - 1) * m->chunk - 1);
+		errormsg("manifest %s: data is longer than the %llu chunks of the manifest\n",m->path,m->num - 1);
+		m->end = 1;
+		return;
+	}
+	++m->checked;
+	if (strcmp(line,hex)) {
+		++m->bad;
+		if (!m->inbad) {
+			m->first = m->num - 1;
+			m->inbad = 1;
+		}
+	} else if (m->inbad) {
+		/* the range ended with the previous chunk */
+		reportRange(m,m->num - 2,(m->num - 1) * m->chunk - 1);
+	}
+}
+
+
+void manifestUpdate(manifest_t *m, const void *buf, size_t len)
+{
+	const char *b = (const char *) buf;
+
+	if (m->chunk == 0)
+		writeHeader(m);
+	if (m->file == 0)
+		return;
+	m->total += len;
+	while (len) {
+		size_t l = m->chunk - m->fill;
+		if (l > len)
+			l = len;
+		if (m->ctxt == 0)
+			m->ctxt = digestInit(m->algo);
+		digestUpdate(m->algo,m->ctxt,b,l);
+		m->fill += l;
+		b += l;
+		len -= l;
+		if (m->fill == m->chunk) {
+			endChunk(m);
+			m->fill = 0;
+		}
+	}
+}
+
+
+/* returns the message with the result */
+char *manifestFinal(manifest_t *m)
+{
+	char *msg = malloc(strlen(m->path) + 80);
+
+	if (msg == 0)
+		fatal("out of memory\n");
+	if (m->chunk == 0)
+		writeHeader(m);
+	if (m->file == 0) {
+		free(msg);
+		free(m);
+		return 0;
+	}
+	if (m->fill)
+		endChunk(m);
+	if (m->inbad)
+		reportRange(m,m->num - 1,m->total - 1);
+	if (!m->verify) {
+		if ((0 > fprintf(m->file,"end %llu\n",m->total)) | (0 != fclose(m->file))) {
+			errormsg("unable to write manifest %s: %s\n",m->path,strerror(errno));
+			free(msg);
+			free(m);
+			return 0;
+		}
+		(void) sprintf(msg,"manifest %s: %llu chunks written\n",m->path,m->num);
+	} else {
+		char line[128];
+		unsigned long long total;
+		if (m->end) {
+			/* already reported */
+		} else if ((0 == fgets(line,sizeof(line),m->file)) || (1 != sscanf(line,"end %llu",&total))) {
+			errormsg("manifest %s: data is shorter than the manifest\n",m->path);
+		} else if (total != m->total) {
+			errormsg("manifest %s: data has %llu bytes instead of %llu\n",m->path,m->total,total);
+		}
+		(void) fclose(m->file);
+		(void) sprintf(msg,"manifest %s: %llu chunks verified, %llu differ\n",m->path,m->checked,m->bad);
+	}
+	free(m);
+	return msg;
+}
+
+
+/* closes the manifest of a transfer that ended early */
+void manifestAbort(manifest_t *m)
+{
+	if (m->file) {
+		if (!m->verify) {
+			/* the chunks so far are kept, but without the end line */
+			if (0 != fclose(m->file))
+				errormsg("unable to write manifest %s: %s\n",m->path,strerror(errno));
+			errormsg("manifest %s is incomplete, as the transfer ended after %llu bytes\n",m->path,m->total);
+		} else {
+			(void) fclose(m->file);
+		}
+	}
+	if (m->ctxt)
+		free(m->ctxt);
+	free(m);
+}
@@ -34,7 +34,6 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <semaphore.h>
 #include <unistd.h>
 
 #ifndef O_LARGEFILE
@@ -49,12 +48,6 @@
 #define PATH_MAX 1024
 #endif
 
-#ifndef S_SPLINT_S
-#ifndef _POSIX_SEMAPHORES
-#error posix sempahores are required
-#endif
-#endif
-
 #ifdef __CYGWIN__
 #include <malloc.h>
 #undef assert
@@ -65,5 +58,24 @@
 #include <sys/sysctl.h>
 #endif
 
+#if defined(__linux) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2,27)
+#define HAVE_OFFLOAD	/* copy_file_range() and sendfile() from files */
+#endif
+#endif
+
+#if defined(__linux) && defined(SPLICE_F_MOVE) && defined(F_SETPIPE_SZ)
+#define HAVE_VMSPLICE
+#endif
+
+#if defined(__linux) && defined(__GNUC__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#if __has_include(<linux/mempolicy.h>)
+#define HAVE_NUMA
+#endif
+#endif
+
 
 #endif
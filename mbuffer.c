@@ -52,12 +52,23 @@ typedef int caddr_t;
 #endif
 #endif
 
+#ifdef HAVE_VMSPLICE
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_OFFLOAD
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
+
 #ifndef EBADRQC
 #define EBADRQC EINVAL
 #endif
 
 
+#include "cache.h"
 #include "common.h"
+#include "compress.h"
 #include "dest.h"
 #include "globals.h"
 #include "hashing.h"
@@ -65,6 +76,10 @@ typedef int caddr_t;
 #include "log.h"
 #include "network.h"
 #include "settings.h"
+#include "ring.h"
+#include "numa.h"
+#include "elastic.h"
+#include "uring.h"
 
 /* if this sendfile implementation does not support sending from buffers,
    disable sendfile support */
@@ -160,6 +175,9 @@ static void summary(unsigned long long numb, int numthreads)
 }
 
 
+static int Offloading = 0;	/* the kernel copies the data without the buffer */
+
+
 static void cancelAll(void)
 {
 	dest_t *d = Dest;
@@ -169,8 +187,10 @@ static void cancelAll(void)
 			d->result = "canceled";
 		d = d->next;
 	} while (d);
-	if (Status)
+	if (Status && !Offloading)
 		(void) pthread_cancel(ReaderThr);
+	/* threads waiting for the buffer have to notice the cancellation */
+	ringWakeup();
 }
 
 
@@ -184,10 +204,7 @@ static RETSIGTYPE sigHandler(int signr)
 		(void) close(In);
 		if (TermQ[1] != -1)
 			(void) write(TermQ[1],"0",1);
-		if (StartWrite > 0)
-			(void) pthread_cond_signal(&PercHigh);
-		if (StartRead < 1)
-			(void) pthread_cond_signal(&PercLow);
+		ringWakeup();
 		break;
 	default:
 		(void) raise(SIGABRT);
@@ -224,12 +241,24 @@ void *watchdogThread(void *ignored)
 }
 
 
+/*
+ * Blocks taken by the main output thread are published to the senders
+ * and hashers. Each of them walks the published blocks with its own
+ * cursor, so a slow destination does not stall the others until the
+ * buffer is exhausted. A buffer block is given back to the input once
+ * the slowest active cursor has passed it.
+ */
+static volatile unsigned long long Published = 0, Released = 0, LastAt = ~0ULL;
+static volatile size_t LastSize = 0;
+static volatile int EndOfData = 0, Waiting = 0;
+
+
 static void statusThread(void) 
 {
 	struct timespec last, now;
 	double in = 0, out = 0, total, diff, fill;
 	unsigned long long lin = 0, lout = 0;
-	int unwritten = 1;	/* assumption: initially there is at least one unwritten block */
+	unsigned long unwritten;
  	fd_set readfds;
  	struct timeval timeout;
 	int maxfd = 0;
@@ -259,7 +288,7 @@ static void statusThread(void)
 	while (!Done) {
 		int err,numsender;
 		ssize_t nw = 0;
-		char buf[256], *b = buf;
+		char buf[512], *b = buf;
 
  		timeout.tv_sec = tsec;
  		timeout.tv_usec = tusec;
@@ -282,9 +311,8 @@ static void statusThread(void)
 		diff = now.tv_sec - last.tv_sec + (double) (now.tv_nsec - last.tv_nsec) * 1E-9;
 		err = pthread_mutex_lock(&TermMut);
 		assert(0 == err);
-		err = sem_getvalue(&Buf2Dev,&unwritten);
-		assert(0 == err);
-		fill = (double)unwritten / (double)Numblocks * 100.0;
+		unwritten = ringFill() + (Published - Released);	/* blocks still held by lagging senders */
+		fill = (double)unwritten / (double)ringCapacity() * 100.0;
 		in = (double)(((Numin - lin) * Blocksize) >> 10);
 		in /= diff;
 		out = (double)(((Numout - lout) * Blocksize) >> 10);
@@ -292,7 +320,7 @@ static void statusThread(void)
 		lin = Numin;
 		lout = Numout;
 		last = now;
-		total = (double)((Numout * Blocksize) >> 10);
+		total = (double)((Numout * Blocksize - Shortfall) >> 10);
 		fill = (fill < 0.0) ? 0.0 : fill;
 		b += sprintf(b,"\rin @ ");
 		b += kb2str(b,in);
@@ -305,8 +333,50 @@ static void statusThread(void)
 			b += sprintf(b,"B/s, ");
 		b += kb2str(b,total);
 		b += sprintf(b,"B total, buffer %3.0f%% full",fill);
+		if (Elastic) {
+			b += sprintf(b," of ");
+			b += kb2str(b,(double)((ringCapacity() * Blocksize) >> 10));
+			b += sprintf(b,"B");
+		}
+		if (spillBlocks()) {
+			b += sprintf(b,", ");
+			b += kb2str(b,(double)((spillBlocks() * Blocksize) >> 10));
+			b += sprintf(b,"B spilled");
+		}
+		if (numsender > 1) {
+			/* how far each output trails the main output, relative to the buffer size */
+			dest_t *d = Dest;
+			const char *sep = ", lag ";
+			for (; d && (b < buf + sizeof(buf) - 32); d = d->next) {
+				if ((d->arg == 0) || !d->active)
+					continue;
+				b += sprintf(b,"%s%.0f%%",sep,(double)(Published - d->cursor) / (double)ringCapacity() * 100.0);
+				sep = "/";
+			}
+		}
+		if (Hashers) {
+			/* hashers only hold back the reuse of blocks, so their lag is shown apart */
+			dest_t *d = Dest;
+			const char *sep = ", hash lag ";
+			for (; d && (b < buf + sizeof(buf) - 32); d = d->next) {
+				if (d->arg || (d->name == 0) || !d->active)
+					continue;
+				b += sprintf(b,"%s%.0f%%",sep,(double)(Published - d->cursor) / (double)ringCapacity() * 100.0);
+				sep = "/";
+			}
+		}
+		if (OutQueue) {
+			dest_t *d = Dest;
+			const char *sep = ", qd ";
+			for (; d && (b < buf + sizeof(buf) - 32); d = d->next) {
+				if ((d->arg == 0) || (d->name == 0))
+					continue;
+				b += sprintf(b,"%s%u",sep,d->inflight);
+				sep = "/";
+			}
+		}
 		if (InSize != 0) {
-			double done = (double)Numout*Blocksize/(double)InSize*100;
+			double done = (double)(Numout*Blocksize-Shortfall)/(double)InSize*100;
 			b += sprintf(b,", %3.0f%% done",done);
 		}
 		if (Quiet == 0) {
@@ -332,49 +402,158 @@ static void statusThread(void)
 }
 
 
-int syncSenders(char *b, int s)
+#ifdef HAVE_VMSPLICE
+/*
+ * Spliced pages stay referenced by the pipe or socket until the reader
+ * has consumed them. Therefore, the pages of a released block are
+ * replaced by fresh ones, before the input refills the block.
+ */
+static volatile int Detach = 0;
+
+
+static void detachBlock(unsigned at)
+{
+	if (-1 == madvise(Buffer[at],Blocksize,MADV_DONTNEED)) {
+		errormsg("unable to detach spliced buffer block: %s\n",strerror(errno));
+		Terminate = 1;
+	}
+}
+#endif
+
+
+/* SendMut must be held */
+static void releaseBlocks(void)
+{
+	unsigned long long min = Published;
+	dest_t *d;
+
+	for (d = Dest; d; d = d->next) {
+		if (d->active && (d->cursor < min))
+			min = d->cursor;
+	}
+	if (Released < min) {
+#ifdef HAVE_VMSPLICE
+		if (Detach) {
+			unsigned long long b;
+			for (b = Released; b < min; ++b)
+				detachBlock(b % Numblocks);
+		}
+#endif
+		ringRelease(min - Released);
+		Released = min;
+	}
+	if (EndOfData) {
+		int err = pthread_cond_broadcast(&SendCond);
+		assert(err == 0);
+	}
+}
+
+
+static void publishBlock(size_t size)
 {
-	static volatile int size = 0, skipped = 0;
-	static char *volatile buf = 0;
 	int err;
 
 	err = pthread_mutex_lock(&SendMut);
 	assert(err == 0);
-	if (b) {
-		buf = b;
-		size = s;
+	if (size != Blocksize) {
+		LastAt = Published;
+		LastSize = size;
 	}
-	if (s < 0)
-		--NumSenders;
-	if (--ActSenders) {
-		debugiomsg("syncSenders(%p,%d): ActSenders = %d\n",b,s,ActSenders);
-		pthread_cleanup_push(releaseLock,&SendMut);
+	++Published;
+	if (Waiting) {
+		debugiomsg("publishBlock(%llu): BROADCAST\n",(unsigned long long)size);
+		err = pthread_cond_broadcast(&SendCond);
+		assert(err == 0);
+	}
+	err = pthread_mutex_unlock(&SendMut);
+	assert(err == 0);
+}
+
+
+/* signal the end of data and wait for all senders to catch up */
+static void publishEnd(void)
+{
+	int err;
+
+	err = pthread_mutex_lock(&SendMut);
+	assert(err == 0);
+	EndOfData = 1;
+	err = pthread_cond_broadcast(&SendCond);
+	assert(err == 0);
+	pthread_cleanup_push(releaseLock,&SendMut);
+	while ((Released < Published) && (Terminate == 0)) {
+		debugmsg("outputThread: waiting for senders to catch up (%llu blocks)\n",Published-Released);
 		err = pthread_cond_wait(&SendCond,&SendMut);
 		assert(err == 0);
-		pthread_cleanup_pop(1);
-		debugiomsg("syncSenders(): continue\n");
-		return 0;
-	} else {
-		ActSenders = NumSenders + 1;
-		assert((buf != 0) || Terminate);
-		SendAt = buf;
-		SendSize = size;
-		buf = 0;
-		if (skipped) {
-			// after the first time, always give a buffer free after sync
-			err = sem_post(&Dev2Buf);
-			assert(err == 0);
-		} else {
-			// the first time no buffer has been given free
-			skipped = 1;
+	}
+	pthread_cleanup_pop(1);
+}
+
+
+/*
+ * Returns the size of the published block n, 0 at the end of data, or
+ * -1 if the block is not yet available and wait is 0, or if
+ * termination was requested.
+ */
+int nextBlock(unsigned long long n, int wait)
+{
+	int err, size = -1;
+
+	err = pthread_mutex_lock(&SendMut);
+	assert(err == 0);
+	pthread_cleanup_push(releaseLock,&SendMut);
+	while (Terminate == 0) {
+		if (n < Published) {
+			if (n == LastAt)
+				size = LastSize;
+			else
+				size = Lengths ? Lengths[n % Numblocks] : Blocksize;
+			break;
 		}
-		err = pthread_mutex_unlock(&SendMut);
-		assert(err == 0);
-		debugiomsg("syncSenders(): send %d@%p, BROADCAST\n",SendSize,SendAt);
-		err = pthread_cond_broadcast(&SendCond);
+		if (EndOfData) {
+			size = 0;
+			break;
+		}
+		if (!wait)
+			break;
+		++Waiting;
+		err = pthread_cond_wait(&SendCond,&SendMut);
 		assert(err == 0);
-		return 1;
+		--Waiting;
 	}
+	pthread_cleanup_pop(1);
+	return size;
+}
+
+
+/* destination d is done with all blocks before block n */
+void finishBlocks(dest_t *d, unsigned long long n)
+{
+	int err;
+
+	err = pthread_mutex_lock(&SendMut);
+	assert(err == 0);
+	d->cursor = n;
+	releaseBlocks();
+	err = pthread_mutex_unlock(&SendMut);
+	assert(err == 0);
+}
+
+
+/* destination d stops and no longer holds back any blocks */
+void leaveSenders(dest_t *d)
+{
+	int err;
+
+	err = pthread_mutex_lock(&SendMut);
+	assert(err == 0);
+	if (d->active) {
+		d->active = 0;
+		--NumSenders;
+		releaseBlocks();
+	}
+	err = pthread_mutex_unlock(&SendMut);
+	assert(err == 0);
 }
 
 
@@ -395,23 +574,298 @@ static inline void terminateSender(int fd, dest_t *d, intptr_t ret)
 				warningmsg("unable to sync %s: %s\n",d->arg,strerror(errno));
 			}
 		}
+		cacheFinishOutput(d,fd);
 		if (-1 == close(fd))
 			errormsg("error closing file %s: %s\n",d->arg,strerror(errno));
 	}
-	if (ret != 0) {
-		ret = syncSenders(0,-1);
-		debugmsg("terminateSender(%s): sendSender(0,-1) = %d\n",d->arg,ret);
-	}
+	if (ret != 0)
+		leaveSenders(d);
 	pthread_exit((void *) ret);
 }
 
 
 
+#ifdef HAVE_IO_URING
+static uring_t *openOutputRing(dest_t *d, int fd, off_t *off)
+{
+	struct stat st;
+	uring_t *ring;
+
+	if (OutQueue == 0)
+		return 0;
+	if (Autoloader || OutVolsize || TapeAware) {
+		infomsg("io_uring output is not supported with multiple volumes\n");
+		return 0;
+	}
+	if (Lengths) {
+		infomsg("io_uring output is not supported with blocks of varying size\n");
+		return 0;
+	}
+	if ((-1 == fstat(fd,&st)) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) || (fcntl(fd,F_GETFL) & O_APPEND)) {
+		infomsg("output %s is not seekable - not using io_uring\n",d->arg);
+		return 0;
+	}
+	*off = lseek(fd,0,SEEK_CUR);
+	if (*off == -1)
+		return 0;
+	ring = uringOpen(OutQueue);
+	if (ring)
+		infomsg("writing to %s with up to %u requests in flight\n",d->arg,OutQueue);
+	return ring;
+}
+
+
+typedef struct {
+	size_t size, num;	/* bytes to write and bytes written */
+	int done, err, last;
+} outreq_t;
+
+
+/*
+ * Submits the prepared writes and collects completed ones. Request
+ * seq writes block seq of the stream at offset base + seq * Blocksize.
+ * Short writes are resubmitted. The inflight requests starting with
+ * first are marked failed, if submitting is impossible.
+ */
+static void uringCollect(uring_t *ring, dest_t *d, outreq_t *req, unsigned depth, unsigned long long first, unsigned inflight, off_t base)
+{
+	unsigned long long seq;
+	outreq_t *r;
+	int res;
+
+	d->inflight = uringPending(ring);
+	if (-1 == uringSubmit(ring,1)) {
+		unsigned i;
+		for (i = 0; i < inflight; ++i) {
+			r = req + (first + i) % depth;
+			if (!r->done) {
+				r->err = errno;
+				r->done = 1;
+			}
+		}
+	}
+	while (uringComplete(ring,&seq,&res)) {
+		r = req + seq % depth;
+		debugiomsg("output(%s): io_uring write of block %llu = %d\n",d->arg,seq,res);
+		if (res == -EINVAL) {
+			res = directio_retry(d->fd,d->arg,Buffer[seq % Numblocks] + r->num,r->size - r->num,base + seq * Blocksize + r->num,1);
+			if (res == -1)
+				res = -errno;
+		}
+		if (res > 0) {
+			r->num += res;
+			if (r->num == r->size) {
+				r->done = 1;
+				continue;
+			}
+		} else if (res == 0) {
+			r->err = ENOSPC;
+			r->done = 1;
+			continue;
+		} else if ((res != -EINTR) && (res != -EAGAIN)) {
+			r->err = -res;
+			r->done = 1;
+			continue;
+		}
+		if (-1 == uringPrepare(ring,URING_WRITE,d->fd,Buffer[seq % Numblocks] + r->num,r->size - r->num,base + seq * Blocksize + r->num,seq)) {
+			r->err = errno;
+			r->done = 1;
+		}
+	}
+}
+
+
+/*
+ * Sender to a seekable destination with up to OutQueue blocks in
+ * flight. Its cursor only advances over blocks that have been written
+ * completely.
+ */
+static void uringSender(dest_t *dest, uring_t *ring, off_t base)
+{
+	unsigned long long n = 0;
+	unsigned depth = OutQueue, inflight = 0, finished = 0;
+	off_t end = base;
+	outreq_t *req;
+
+	if (depth > Numblocks)
+		depth = Numblocks;
+	req = calloc(depth,sizeof(outreq_t));
+	assert(req);
+	for (;;) {
+		outreq_t *r;
+
+		while (!finished && (inflight < depth)) {
+			unsigned long long seq = n + inflight;
+			int size = nextBlock(seq,inflight == 0);
+			if (Terminate) {
+				infomsg("senderThread(\"%s\"): terminating early upon request...\n",dest->arg);
+				dest->result = "canceled";
+				uringDrain(ring);
+				terminateSender(dest->fd,dest,1);
+			}
+			if (size == -1)
+				break;
+			if (size == 0) {
+				finished = 1;
+				break;
+			}
+			r = req + seq % depth;
+			bzero(r,sizeof(outreq_t));
+			r->size = size;
+			++inflight;
+			if (-1 == uringPrepare(ring,URING_WRITE,dest->fd,Buffer[seq % Numblocks],size,base + seq * Blocksize,seq)) {
+				r->err = errno;
+				r->done = 1;
+			}
+		}
+		if (inflight == 0) {
+			debugmsg("senderThread(\"%s\"): done.\n",dest->arg);
+			uringClose(ring);
+			free(req);
+			dest->inflight = 0;
+			(void) lseek(dest->fd,end,SEEK_SET);
+			terminateSender(dest->fd,dest,0);
+		}
+		uringCollect(ring,dest,req,depth,n,inflight,base);
+		while (inflight) {
+			r = req + n % depth;
+			if (!r->done)
+				break;
+			if (r->err) {
+				errormsg("error writing to %s: %s\n",dest->arg,strerror(r->err));
+				dest->result = strerror(r->err);
+				uringDrain(ring);
+				dest->inflight = 0;
+				terminateSender(dest->fd,dest,1);
+			}
+			end = base + n * Blocksize + r->size;
+			cacheOutput(dest,dest->fd,r->size);
+			finishBlocks(dest,++n);
+			--inflight;
+		}
+	}
+}
+#endif
+
+
+/*
+ * Sender to a receiver with option --streams. Up to two blocks per
+ * stream are in flight, and the cursor only advances over blocks that
+ * have been sent completely.
+ */
+static void streamSender(dest_t *dest, stripe_t *s)
+{
+	unsigned long long n = 0;
+	unsigned depth = stripeDepth(s), inflight = 0, finished = 0;
+
+	for (;;) {
+		int err;
+
+		while (!finished && (inflight < depth)) {
+			int size = nextBlock(n + inflight,inflight == 0);
+			if (Terminate) {
+				infomsg("senderThread(\"%s\"): terminating early upon request...\n",dest->arg);
+				dest->result = "canceled";
+				stripeClose(s,1);
+				terminateSender(dest->fd,dest,1);
+			}
+			if (size == -1)
+				break;
+			if (size == 0) {
+				finished = 1;
+				break;
+			}
+			stripePost(s,Buffer[(n + inflight) % Numblocks],size);
+			++inflight;
+		}
+		if (inflight == 0) {
+			debugmsg("senderThread(\"%s\"): done.\n",dest->arg);
+			stripeClose(s,0);
+			terminateSender(dest->fd,dest,0);
+		}
+		err = stripeWait(s);
+		if (err) {
+			errormsg("error writing to %s: %s\n",dest->arg,strerror(err));
+			dest->result = strerror(err);
+			stripeClose(s,1);
+			terminateSender(dest->fd,dest,1);
+		}
+		finishBlocks(dest,++n);
+		--inflight;
+	}
+}
+
+
+#ifdef HAVE_VMSPLICE
+/*
+ * Check if the buffer pages can be spliced to output fd. Pipes get the
+ * pages directly, sockets via the intermediate pipe sp.
+ */
+static int openSplice(dest_t *d, int fd, int sp[2])
+{
+	struct stat st;
+
+	sp[0] = -1;
+	sp[1] = -1;
+	if (!Splice)
+		return 0;
+	if (Memmap || Memlock || HugePgSz || (PgSz == 0) || (Blocksize % PgSz)) {
+		infomsg("cannot splice to %s: requires page aligned blocks without -L, -t and hugetlb pages\n",d->arg);
+		return 0;
+	}
+	if (-1 == fstat(fd,&st))
+		return 0;
+	if (S_ISFIFO(st.st_mode)) {
+		setPipeSize(fd,d->arg);
+	} else if (S_ISSOCK(st.st_mode)) {
+		if (-1 == pipe(sp)) {
+			warningmsg("unable to create pipe for splicing to %s: %s\n",d->arg,strerror(errno));
+			return 0;
+		}
+		setPipeSize(sp[1],d->arg);
+	} else {
+		debugmsg("output %s is no pipe or socket - not splicing\n",d->arg);
+		return 0;
+	}
+	Detach = 1;
+	infomsg("splicing buffer pages to %s\n",d->arg);
+	return 1;
+}
+
+
+/* returns the number of bytes passed to out, or -1 on error */
+static ssize_t spliceBlock(int out, int sp[2], char *buf, size_t n)
+{
+	struct iovec iov;
+	ssize_t num, done = 0;
+
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	if (sp[1] == -1)
+		return vmsplice(out,&iov,1,0);
+	num = vmsplice(sp[1],&iov,1,0);
+	while (done < num) {
+		ssize_t s = splice(sp[0],0,out,0,num - done,SPLICE_F_MOVE);
+		if (s == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += s;
+	}
+	return num;
+}
+#endif
+
+
 static void *senderThread(void *arg)
 {
-	unsigned long long outsize = Blocksize;
+	unsigned long long outsize = Blocksize, n = 0;
 	dest_t *dest = (dest_t *)arg;
 	int out = dest->fd;
+#ifdef HAVE_VMSPLICE
+	int spliceout, sp[2];
+#endif
 #ifdef HAVE_SENDFILE
 	int sendout = 1;
 #endif
@@ -442,16 +896,36 @@ static void *senderThread(void *arg)
 		infomsg("no device on output stream %s\n",dest->arg);
 #endif
 	debugmsg("sender(%s): starting...\n",dest->arg);
+	numaPinThread(NUMA_OUTPUT,out,dest->arg);
+	if (FlushAfter)
+		setTCPNoDelay(out,dest->arg);
+	cacheInitOutput(dest,out);
+	if (Framed && dest->port) {
+		stripe_t *stripe = stripeOpen(dest);
+		if (stripe == 0) {
+			dest->result = "stream setup failed";
+			terminateSender(out,dest,1);
+		}
+		streamSender(dest,stripe);
+	}
+#ifdef HAVE_IO_URING
+	off_t outoff = 0;
+	uring_t *ring = openOutputRing(dest,out,&outoff);
+	if (ring)
+		uringSender(dest,ring,outoff);
+#endif
+#ifdef HAVE_VMSPLICE
+	spliceout = openSplice(dest,out,sp);
+#endif
 	for (;;) {
-		int size, num = 0;
-		(void) syncSenders(0,0);
-		size = SendSize;
+		int size = nextBlock(n,1), num = 0;
+		char *buf = Buffer[n % Numblocks];
 		if (0 == size) {
 			debugmsg("senderThread(\"%s\"): done.\n",dest->arg);
 			terminateSender(out,dest,0);
 			return 0;	/* for lint */
 		}
-		if (Terminate) {
+		if ((size < 0) || Terminate) {
 			infomsg("senderThread(\"%s\"): terminating early upon request...\n",dest->arg);
 			dest->result = "canceled";
 			terminateSender(out,dest,1);
@@ -460,9 +934,20 @@ static void *senderThread(void *arg)
 			unsigned long long rest = size - num;
 			int ret;
 			assert(size >= num);
+#ifdef HAVE_VMSPLICE
+			if (spliceout) {
+				ret = spliceBlock(out,sp,buf+num,rest);
+				debugiomsg("sender(%s): vmsplice(%d, %p, %llu) = %d\n", dest->arg, out, (void*)(buf+num), rest, ret);
+				if ((ret == -1) && (errno == EINVAL)) {
+					spliceout = 0;
+					debugmsg("sender(%s): vmsplice unsupported - falling back to write\n", dest->arg);
+					continue;
+				}
+			} else
+#endif
 #ifdef HAVE_SENDFILE
 			if (sendout) {
-				off_t baddr = (off_t) (SendAt+num);
+				off_t baddr = (off_t) (buf+num);
 				unsigned long long n = SetOutsize ? (rest > Outsize ? (rest/Outsize)*Outsize : rest) : rest;
 				ret = sendfile(out,SFV_FD_SELF,&baddr,n);
 				debugiomsg("sender(%s): sendfile(%d, SFV_FD_SELF, &%p, %llu) = %d\n", dest->arg, dest->fd, (void*)baddr, n, ret);
@@ -474,21 +959,23 @@ static void *senderThread(void *arg)
 			} else
 #endif
 			{
-				char *baddr = SendAt+num;
+				char *baddr = buf+num;
 				ret = write(out,baddr,rest > outsize ? outsize :rest);
+				if ((-1 == ret) && (errno == EINVAL))
+					ret = directio_retry(out,dest->arg,baddr,rest > outsize ? outsize : rest,-1,1);
 				debugiomsg("sender(%s): writing %llu@0x%p: ret = %d\n",dest->arg,rest,(void*)baddr,ret);
 			}
 			if (-1 == ret) {
 				if (errno == EINTR)
 					continue;
-				if ((errno == EINVAL) && disable_directio(out,dest->arg))
-					continue;
 				errormsg("error writing to %s: %s\n",dest->arg,strerror(errno));
 				dest->result = strerror(errno);
 				terminateSender(out,dest,1);
 			}
 			num += ret;
 		} while (num != size);
+		cacheOutput(dest,out,size);
+		finishBlocks(dest,++n);
 	}
 }
 
@@ -582,7 +1069,8 @@ static int requestOutputVolume(int out, const char *outfile)
 		out = open(outfile,mode,0666);
 		if (-1 == out)
 			errormsg("error reopening output file: %s\n",strerror(errno));
-		enable_directio(out,outfile);
+		else if (!NoCache)
+			enable_directio(out,outfile);
 	} while (-1 == out);
 	(void) clock_gettime(ClockSrc,&volstart);
 	diff = volstart.tv_sec - now.tv_sec + (double) (volstart.tv_nsec - now.tv_nsec) * 1E-9;
@@ -611,6 +1099,7 @@ static void terminateOutputThread(dest_t *d, int status)
 			warningmsg("unable to sync %s: %s\n",d->arg,strerror(errno));
 		}
 	}
+	cacheFinishOutput(d,d->fd);
 	infomsg("outputThread: finished - exiting...\n");
 	if (-1 == close(d->fd))
 		errormsg("error closing %s: %s\n",d->arg,strerror(errno));
@@ -620,7 +1109,7 @@ static void terminateOutputThread(dest_t *d, int status)
 			errormsg("error writing to termination queue: %s\n",strerror(errno));
 	}
 	if (status) {
-		(void) sem_post(&Dev2Buf);
+		ringWakeup();
 		(void) pthread_cond_broadcast(&SendCond);
 	}
 	Done = 1;
@@ -629,11 +1118,315 @@ static void terminateOutputThread(dest_t *d, int status)
 
 
 
+#ifdef HAVE_IO_URING
+/*
+ * Output to a seekable destination with up to OutQueue block writes in
+ * flight. Blocks are given back to the input or handed on to the
+ * senders in order, as soon as their writes have completed.
+ */
+static void uringOutput(dest_t *dest, uring_t *ring, off_t base, struct timespec *last, int multipleSenders)
+{
+	unsigned at = 0, depth = OutQueue, inflight = 0, finished = 0;
+	int haderror = 0;
+	long long xfer = 0;
+	outreq_t *req;
+
+	if (depth > Numblocks)
+		depth = Numblocks;
+	req = calloc(depth,sizeof(outreq_t));
+	assert(req);
+	for (;;) {
+		unsigned long long seq;
+		outreq_t *r;
+		while (!finished && (inflight < depth)) {
+			unsigned slot = (at + inflight) % Numblocks;
+			int taken = ringTake(inflight == 0);
+			if (taken == 2)
+				(void) clock_gettime(ClockSrc,last);
+			else if ((taken == 0) && !Terminate)
+				break;
+			if (haderror && (NumSenders == 0))
+				Terminate = 1;
+			if (Terminate) {
+				infomsg("outputThread: terminating upon termination request...\n");
+				dest->result = "canceled";
+				uringDrain(ring);
+				terminateOutputThread(dest,1);
+			}
+			seq = Numout + inflight;
+			r = req + seq % depth;
+			bzero(r,sizeof(outreq_t));
+			r->size = Blocksize;
+			if ((Finish == slot) && (ringFill() == 0)) {
+				debugmsg("outputThread: last block has %llu bytes\n",(unsigned long long)Rest);
+				r->size = Rest;
+				r->last = 1;
+				finished = 1;
+			}
+			if (multipleSenders && r->size)
+				publishBlock(r->size);
+			++inflight;
+			if ((r->size == 0) || haderror)
+				r->done = 1;
+			else if (-1 == uringPrepare(ring,URING_WRITE,dest->fd,Buffer[slot],r->size,base + seq * Blocksize,seq)) {
+				r->err = errno;
+				r->done = 1;
+			}
+		}
+		uringCollect(ring,dest,req,depth,Numout,inflight,base);
+		/* give completed blocks back in order */
+		while (inflight) {
+			r = req + Numout % depth;
+			if (!r->done)
+				break;
+			if (r->err && !haderror) {
+				unsigned i;
+				dest->result = strerror(r->err);
+				errormsg("outputThread: error writing to %s at offset 0x%llx: %s\n",dest->arg,(long long)(base + Blocksize * Numout + r->num),strerror(r->err));
+				MainOutOK = 0;
+				uringDrain(ring);
+				dest->inflight = 0;
+				if (!multipleSenders || (NumSenders == 0)) {
+					Terminate = 1;
+					terminateOutputThread(dest,1);
+				}
+				debugmsg("outputThread: %d senders remaining - continuing...\n",NumSenders);
+				haderror = 1;
+				for (i = 0; i < inflight; ++i)
+					req[(Numout + i) % depth].done = 1;
+			}
+			if (!haderror)
+				cacheOutput(dest,dest->fd,r->size);
+			if (multipleSenders)
+				finishBlocks(dest,Numout + 1);
+			else
+				ringRelease(1);
+			if (r->last) {
+				if (!haderror)
+					(void) lseek(dest->fd,base + Numout * Blocksize + r->size,SEEK_SET);
+				uringClose(ring);
+				free(req);
+				dest->inflight = 0;
+				if (multipleSenders)
+					publishEnd();
+				terminateOutputThread(dest,haderror);
+			}
+			if (MaxWriteSpeed)
+				xfer = enforceSpeedLimit(MaxWriteSpeed,xfer,last);
+			if (Pause)
+				(void) mt_usleep(Pause);
+			if (Numblocks == ++at)
+				at = 0;
+			Numout++;
+			--inflight;
+		}
+	}
+}
+#endif
+
+
+
+/*
+ * Output to a receiver with option --streams. The blocks are passed
+ * to the streams in order, and given back to the input or handed on
+ * to the senders as soon as they have been sent. Without streams s,
+ * the blocks are only passed on to the senders.
+ */
+static void streamOutput(dest_t *dest, stripe_t *s, struct timespec *last, int multipleSenders)
+{
+	unsigned at = 0, depth = s ? stripeDepth(s) : 1, inflight = 0, finished = 0;
+	int haderror = (s == 0);
+	long long xfer = 0;
+	size_t *sizes = calloc(depth,sizeof(size_t));
+
+	assert(sizes);
+	for (;;) {
+		while (!finished && (inflight < depth)) {
+			unsigned slot = (at + inflight) % Numblocks;
+			size_t size;
+			int taken = ringTake(inflight == 0);
+			if (taken == 2)
+				(void) clock_gettime(ClockSrc,last);
+			else if ((taken == 0) && !Terminate)
+				break;
+			if (haderror && (NumSenders == 0))
+				Terminate = 1;
+			if (Terminate) {
+				infomsg("outputThread: terminating upon termination request...\n");
+				if (!haderror) {
+					dest->result = "canceled";
+					stripeClose(s,1);
+				}
+				terminateOutputThread(dest,1);
+			}
+			size = Lengths ? Lengths[slot] : Blocksize;
+			if ((Finish == slot) && (ringFill() == 0)) {
+				debugmsg("outputThread: last block has %llu bytes\n",(unsigned long long)Rest);
+				size = Rest;
+				finished = 1;
+			}
+			if (multipleSenders && size)
+				publishBlock(size);
+			/* the empty last block is not sent */
+			if (size && !haderror)
+				stripePost(s,Buffer[slot],size);
+			sizes[(Numout + inflight) % depth] = size;
+			++inflight;
+		}
+		/* give sent blocks back in order */
+		while (inflight) {
+			size_t size = sizes[Numout % depth];
+			int err = (size && !haderror) ? stripeWait(s) : 0;
+			if (err) {
+				dest->result = strerror(err);
+				errormsg("outputThread: error writing to %s: %s\n",dest->arg,strerror(err));
+				MainOutOK = 0;
+				stripeClose(s,1);
+				if (!multipleSenders || (NumSenders == 0)) {
+					Terminate = 1;
+					terminateOutputThread(dest,1);
+				}
+				debugmsg("outputThread: %d senders remaining - continuing...\n",NumSenders);
+				haderror = 1;
+			}
+			if (multipleSenders)
+				finishBlocks(dest,Numout + 1);
+			else
+				ringRelease(1);
+			if (finished && (inflight == 1)) {
+				free(sizes);
+				if (multipleSenders)
+					publishEnd();
+				if (!haderror)
+					stripeClose(s,0);
+				terminateOutputThread(dest,haderror);
+			}
+			if (MaxWriteSpeed)
+				xfer = enforceSpeedLimit(MaxWriteSpeed,xfer,last);
+			if (Pause)
+				(void) mt_usleep(Pause);
+			if (Numblocks == ++at)
+				at = 0;
+			Numout++;
+			Shortfall += Blocksize - size;
+			--inflight;
+		}
+	}
+}
+
+
+/*
+ * Writes up to max consecutive filled blocks of the buffer with a
+ * single writev, which saves system calls for small block sizes. Only
+ * used for a single output without volume size, device block size or
+ * tape handling. Never returns.
+ */
+static void batchOutput(dest_t *dest, int out, unsigned max, struct timespec *last)
+{
+	struct iovec *iov = calloc(max,sizeof(struct iovec));
+	unsigned at = 0, taken = 0, final = 0;
+	size_t done = 0;	/* bytes of the block at written already */
+	long long xfer = 0;
+
+	assert(iov);
+	debugmsg("outputThread: writing up to %u blocks at once\n",max);
+	for (;;) {
+		unsigned i, n = 0;
+		ssize_t num;
+
+		while (!final && (taken < max)) {
+			int t = ringTake(taken == 0);
+			if (t == 2)
+				(void) clock_gettime(ClockSrc,last);
+			else if ((t == 0) && !Terminate)
+				break;
+			if (Terminate) {
+				infomsg("outputThread: terminating upon termination request...\n");
+				dest->result = "canceled";
+				terminateOutputThread(dest,1);
+			}
+			if ((Finish == (at + taken) % Numblocks) && (ringFill() == 0)) {
+				debugmsg("outputThread: last block has %llu bytes\n",(unsigned long long)Rest);
+				final = 1;
+			}
+			++taken;
+		}
+		for (i = 0; i < taken; ++i) {
+			unsigned slot = (at + i) % Numblocks;
+			size_t size = (final && (i == taken - 1)) ? Rest : Lengths ? Lengths[slot] : Blocksize;
+			iov[n].iov_base = Buffer[slot];
+			iov[n].iov_len = size;
+			if (i == 0) {
+				iov[n].iov_base = (char *)iov[n].iov_base + done;
+				iov[n].iov_len -= done;
+			}
+			if (iov[n].iov_len)
+				++n;
+		}
+		if (n == 0) {
+			/* only an empty last block is left */
+			assert(final && (taken == 1));
+			infomsg("outputThread: finished - exiting...\n");
+			terminateOutputThread(dest,0);
+		}
+		num = writev(out,iov,n);
+		if ((-1 == num) && (errno == EINVAL))
+			num = directio_retryv(out,dest->arg,iov,n,-1,1);
+		debugiomsg("outputThread: writev(%d, Buffer[%d] + %llu, %u blocks) = %d\n",out,at,(unsigned long long)done,n,num);
+		if ((Terminal||Autoloader) && (((-1 == num) && ((errno == ENOMEM) || (errno == ENOSPC))) || (0 == num))) {
+			/* request a new volume */
+			out = requestOutputVolume(out,dest->name);
+			if (out == -1) {
+				dest->result = "canceled";
+				MainOutOK = 0;
+				Terminate = 1;
+				terminateOutputThread(dest,1);
+			}
+			cacheInitOutput(dest,out);
+			continue;
+		}
+		if (-1 == num) {
+			if (errno == EINTR)
+				continue;
+			dest->result = strerror(errno);
+			errormsg("outputThread: error writing to %s at offset 0x%llx: %s\n",dest->arg,(long long)Blocksize*Numout+done,strerror(errno));
+			MainOutOK = 0;
+			debugmsg("outputThread: terminating...\n");
+			Terminate = 1;
+			terminateOutputThread(dest,1);
+		}
+		done += num;
+		while (taken) {
+			size_t size = (final && (taken == 1)) ? Rest : Lengths ? Lengths[at] : Blocksize;
+			if (done < size)
+				break;
+			done -= size;
+			cacheOutput(dest,out,size);
+			ringRelease(1);
+			if (MaxWriteSpeed)
+				xfer = enforceSpeedLimit(MaxWriteSpeed,xfer,last);
+			if (Pause)
+				(void) mt_usleep(Pause);
+			if (final && (taken == 1))
+				terminateOutputThread(dest,0);
+			if (Numblocks == ++at)
+				at = 0;
+			Numout++;
+			Shortfall += Blocksize - size;
+			--taken;
+		}
+	}
+}
+
+
 static void *outputThread(void *arg)
 {
 	dest_t *dest = (dest_t *) arg;
-	unsigned at = 0;
-	int fill = 0, haderror = 0, out, multipleSenders;
+	unsigned at = 0, batch;
+	int haderror = 0, out, multipleSenders;
+#ifdef HAVE_VMSPLICE
+	int spliceout, sp[2];
+#endif
 #ifdef HAVE_SENDFILE
 	int sendout = 1;
 #endif
@@ -643,11 +1436,15 @@ static void *outputThread(void *arg)
 	struct timespec last;
 
 	assert(NumSenders >= 0);
+	/* senders and hashers start on the same CPUs */
+	numaPinThread(NUMA_OUTPUT,dest->fd,"outputThread");
+	if (FlushAfter && (dest->fd != -1))
+		setTCPNoDelay(dest->fd,dest->arg);
 	if (dest->next) {
 		int ret;
 		dest_t *d = dest->next;
 		debugmsg("NumSenders = %d\n",NumSenders);
-		ActSenders = NumSenders + 1;
+		dest->active = (NumSenders > 0);
 		ret = pthread_mutex_init(&SendMut,0);
 		assert(ret == 0);
 		ret = pthread_cond_init(&SendCond,0);
@@ -655,10 +1452,13 @@ static void *outputThread(void *arg)
 		do {
 			if (d->arg == 0) {
 				debugmsg("creating hash thread with algorithm %s\n",d->name);
+				/* a hash calculated by the thread of another one holds back no blocks */
+				d->active = !hashFused(d);
 				ret = pthread_create(&d->thread,0,hashThread,d);
 				assert(ret == 0);
 			} else if (d->fd != -1) {
 				debugmsg("creating sender for %s\n",d->arg);
+				d->active = 1;
 				ret = pthread_create(&d->thread,0,senderThread,d);
 				assert(ret == 0);
 			} else {
@@ -671,68 +1471,69 @@ static void *outputThread(void *arg)
 	multipleSenders = (NumSenders > 0);
 	dest->result = 0;
 	out = dest->fd;
+	cacheInitOutput(dest,out);
 	if ((StartWrite > 0) && (Finish == -1)) {
-		int err;
 		debugmsg("outputThread: delaying start until buffer reaches high watermark\n");
-		err = pthread_mutex_lock(&HighMut);
-		assert(err == 0);
-		pthread_cleanup_push(releaseLock,&HighMut);
-		err = pthread_cond_wait(&PercHigh,&HighMut);
-		assert(err == 0);
-		pthread_cleanup_pop(0);
-		err = pthread_mutex_unlock(&HighMut);
-		assert(err == 0);
-		debugmsg("outputThread: high watermark reached, starting...\n");
 	} else
 		infomsg("outputThread: starting output on %s...\n",dest->arg);
 	/* initialize last to 0, because we don't want to wait initially */
 	(void) clock_gettime(ClockSrc,&last);
+	if (Framed && dest->port) {
+		stripe_t *stripe = stripeOpen(dest);
+		if (stripe == 0) {
+			dest->result = "stream setup failed";
+			MainOutOK = 0;
+		}
+		streamOutput(dest,stripe,&last,multipleSenders);
+	}
+#ifdef HAVE_IO_URING
+	off_t outoff = 0;
+	uring_t *ring = openOutputRing(dest,out,&outoff);
+	if (ring)
+		uringOutput(dest,ring,outoff,&last,multipleSenders);
+#endif
+#ifdef HAVE_VMSPLICE
+	spliceout = openSplice(dest,out,sp);
+#endif
+	batch = 1;
+	if (!multipleSenders && (OutVolsize == 0) && !TapeAware && !SetOutsize)
+		batch = batchBlocks(out);
+#ifdef HAVE_VMSPLICE
+	if (spliceout)
+		batch = 1;
+#endif
+#ifdef HAVE_SENDFILE
+	/* sendfile avoids copying the data altogether */
+	batch = 1;
+#endif
+	if (batch > 1)
+		batchOutput(dest,out,batch,&last);
 	for (;;) {
-		unsigned long long rest = blocksize;
-		int err;
+		unsigned long long rest;
 
-		if ((StartWrite > 0) && (fill <= 0)) {
-			assert(fill == 0);
-			err = pthread_mutex_lock(&HighMut);
-			assert(err == 0);
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if (fill == 0) {
-				debugmsg("outputThread: buffer empty, waiting for it to fill\n");
-				pthread_cleanup_push(releaseLock,&HighMut);
-				err = pthread_cond_wait(&PercHigh,&HighMut);
-				assert(err == 0);
-				pthread_cleanup_pop(0);
-				++EmptyCount;
-				debugmsg("outputThread: high watermark reached, continuing...\n");
-				(void) clock_gettime(ClockSrc,&last);
-			}
-			err = pthread_mutex_unlock(&HighMut);
-			assert(err == 0);
-		} else
-			--fill;
-		err = sem_wait(&Buf2Dev);
-		assert(err == 0);
+		if (2 == ringTake(1))
+			(void) clock_gettime(ClockSrc,&last);
 		if (Terminate) {
 			infomsg("outputThread: terminating upon termination request...\n");
 			dest->result = "canceled";
 			terminateOutputThread(dest,1);
 		}
 		if (Finish == at) {
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if ((fill == 0) && (0 == Rest)) {
+			if ((ringFill() == 0) && (0 == Rest)) {
 				if (multipleSenders)
-					(void) syncSenders((char*)0xdeadbeef,0);
+					publishEnd();
 				infomsg("outputThread: finished - exiting...\n");
 				terminateOutputThread(dest,haderror);
 			} else {
-				blocksize = rest = Rest;
+				blocksize = Rest;
 				debugmsg("outputThread: last block has %llu bytes\n",(unsigned long long)Rest);
 			}
+		} else if (Lengths) {
+			blocksize = Lengths[at];
 		}
+		rest = blocksize;
 		if (multipleSenders)
-			(void) syncSenders(Buffer[at],blocksize);
+			publishBlock(blocksize);
 		/* switch output volume if -D <size> has been reached */
 		if ( (OutVolsize != 0) && (Numout > 0) && (Numout % (OutVolsize/Blocksize)) == 0 ) {
 			/* Sleep to let status thread "catch up" so that the displayed total is a multiple of OutVolsize */
@@ -741,9 +1542,11 @@ static void *outputThread(void *arg)
 			if (out == -1) {
 				haderror = 1;
 				dest->result = strerror(errno);
+			} else {
+				cacheInitOutput(dest,out);
 			}
 		}
-		do {
+		while (rest > 0) {
 			/* use Outsize which could be the blocksize of the device (option -d) */
 			unsigned long long n = rest > Outsize ? Outsize : rest;
 			int num;
@@ -752,6 +1555,17 @@ static void *outputThread(void *arg)
 					Terminate = 1;
 				num = (int)rest;
 			} else
+#ifdef HAVE_VMSPLICE
+			if (spliceout) {
+				num = spliceBlock(out,sp,Buffer[at] + blocksize - rest,rest);
+				debugiomsg("outputThread: vmsplice(%d, &(Buffer[%d] + %llu), %llu) = %d\n", out, at, blocksize - rest, rest, num);
+				if ((num == -1) && (errno == EINVAL)) {
+					infomsg("vmsplice not supported - falling back to write...\n");
+					spliceout = 0;
+					continue;
+				}
+			} else
+#endif
 #ifdef HAVE_SENDFILE
 			if (sendout) {
 				off_t baddr = (off_t) (Buffer[at] + blocksize - rest);
@@ -766,6 +1580,8 @@ static void *outputThread(void *arg)
 #endif
 			{
 				num = write(out,Buffer[at] + blocksize - rest, n);
+				if ((-1 == num) && (errno == EINVAL))
+					num = directio_retry(out,dest->arg,Buffer[at] + blocksize - rest,n,-1,1);
 				debugiomsg("outputThread: writing %lld@0x%p: ret = %d\n", n, Buffer[at] + blocksize - rest, num);
 			}
 			if (TapeAware) {
@@ -798,13 +1614,13 @@ static void *outputThread(void *arg)
 					out = requestOutputVolume(out,dest->name);
 					if (out == -1)
 						haderror = 1;
+					else
+						cacheInitOutput(dest,out);
 					tapeEWEOM = 0; /* No longer at end of tape */
 					continue;
 				}
 			}
 			if (-1 == num) {
-				if ((errno == EINVAL) && disable_directio(out,dest->arg))
-					continue;
 				if (errno == EINTR)
 					continue;
 				dest->result = strerror(errno);
@@ -813,52 +1629,154 @@ static void *outputThread(void *arg)
 				if (NumSenders == 0) {
 					debugmsg("outputThread: terminating...\n");
 					Terminate = 1;
-					err = sem_post(&Dev2Buf);
-					assert(err == 0);
 					terminateOutputThread(dest,1);
 				}
 				debugmsg("outputThread: %d senders remaining - continuing...\n",NumSenders);
 				haderror = 1;
 			}
 			rest -= num;
-		} while (rest > 0);
-		if (multipleSenders == 0) {
-			err = sem_post(&Dev2Buf);
-			assert(err == 0);
+		}
+		if (!haderror)
+			cacheOutput(dest,out,blocksize);
+		if (multipleSenders) {
+			finishBlocks(dest,Numout + 1);
+		} else {
+#ifdef HAVE_VMSPLICE
+			if (Detach)
+				detachBlock(at);
+#endif
+			ringRelease(1);
 		}
 		if (MaxWriteSpeed)
 			xfer = enforceSpeedLimit(MaxWriteSpeed,xfer,&last);
 		if (Pause)
 			(void) mt_usleep(Pause);
-		if (Finish == at) {
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if (fill == 0) {
-				if (multipleSenders)
-					(void) syncSenders((char*)0xdeadbeef,0);
-				terminateOutputThread(dest,0);
-				return 0;	/* make lint happy */
-			}
+		if ((Finish == at) && (ringFill() == 0)) {
+			if (multipleSenders)
+				publishEnd();
+			terminateOutputThread(dest,0);
+			return 0;	/* make lint happy */
 		}
 		if (Numblocks == ++at)
 			at = 0;
-		if (StartRead < 1) {
-			err = pthread_mutex_lock(&LowMut);
-			assert(err == 0);
-			err = sem_getvalue(&Buf2Dev,&fill);
-			assert(err == 0);
-			if (((double)fill / (double)Numblocks) < StartRead) {
-				err = pthread_cond_signal(&PercLow);
-				assert(err == 0);
-			}
-			err = pthread_mutex_unlock(&LowMut);
-			assert(err == 0);
-		}
 		Numout++;
+		Shortfall += Blocksize - blocksize;
+	}
+}
+
+
+
+#ifdef HAVE_OFFLOAD
+/*
+ * A regular input file that goes to a single output without rate
+ * limits, watermarks, hashing or volume changes does not need the
+ * buffer. Then the kernel copies the data with copy_file_range() to
+ * regular files and with sendfile() to sockets and pipes.
+ */
+static ssize_t offloadChunk(int out, size_t n)
+{
+	struct pollfd pfd;
+
+	if (Offloading == 1)
+		return copy_file_range(In,0,out,0,n,0);
+	/* sendfile is no cancellation point, but poll is */
+	pfd.fd = out;
+	pfd.events = POLLOUT;
+	if (-1 == poll(&pfd,1,-1))
+		return -1;
+	return sendfile(out,In,0,n);
+}
+
+
+static void *offloadThread(void *arg)
+{
+	dest_t *dest = (dest_t *) arg;
+	unsigned long long num = Rest;
+
+	Rest = 0;
+	dest->result = 0;
+	numaPinThread(NUMA_OUTPUT,dest->fd,"outputThread");
+	for (;;) {
+		ssize_t ret;
+
+		if (num == Blocksize) {
+			++Numin;
+			++Numout;
+			num = 0;
+		}
+		if (Terminate) {
+			infomsg("outputThread: terminating upon termination request...\n");
+			dest->result = "canceled";
+			terminateOutputThread(dest,1);
+		}
+		ret = offloadChunk(dest->fd,Blocksize - num);
+		debugiomsg("outputThread: %s(%d, %d, %llu) = %zd\n",Offloading == 1 ? "copy_file_range" : "sendfile",In,dest->fd,Blocksize - num,ret);
+		if (ret == 0)
+			break;
+		if (ret == -1) {
+			if ((errno == EINTR) || Terminate)
+				continue;
+			dest->result = strerror(errno);
+			errormsg("outputThread: error copying to %s at offset 0x%llx: %s\n",dest->arg,(long long)Blocksize*Numout+num,strerror(errno));
+			MainOutOK = 0;
+			Terminate = 1;
+			terminateOutputThread(dest,1);
+		}
+		cacheOutput(dest,dest->fd,ret);
+		num += ret;
 	}
+	Rest = num;
+	Finish = 0;
+	terminateOutputThread(dest,0);
+	return 0;	/* make lint happy */
 }
 
 
+/*
+ * Returns 1 if the kernel copies the data to dest by itself. The first
+ * chunk is transferred here, so that unsupported combinations of file
+ * systems and devices can still fall back to the buffer.
+ */
+static int startOffload(dest_t *dest)
+{
+	struct stat st;
+	ssize_t ret;
+
+	if (!Offload || !Infile || NumSenders || Hashers || MaxReadSpeed || MaxWriteSpeed || Pause
+		|| OutVolsize || Autoloader || TapeAware || (NumVolumes != 1) || SetOutsize || InQueue || OutQueue
+		|| (Readers > 1) || Records || Elastic || Splice || SpillFile || NoCache || (Framed && dest->port)
+		|| (StartRead < 1) || (StartWrite > 0))
+		return 0;
+	if ((-1 == fstat(In,&st)) || !S_ISREG(st.st_mode))
+		return 0;
+	if (-1 == fstat(dest->fd,&st))
+		return 0;
+	if (S_ISREG(st.st_mode))
+		Offloading = 1;
+	else if (S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode))
+		Offloading = 2;
+	else
+		return 0;
+	/* O_DIRECT would fail on the unaligned end of the file */
+	(void) fcntl(In,F_SETFL,fcntl(In,F_GETFL) & ~O_DIRECT);
+	(void) fcntl(dest->fd,F_SETFL,fcntl(dest->fd,F_GETFL) & ~O_DIRECT);
+	cacheInitOutput(dest,dest->fd);
+	do
+		ret = offloadChunk(dest->fd,Blocksize);
+	while ((ret == -1) && (errno == EINTR));
+	if (ret == -1) {
+		infomsg("kernel copy to %s failed (%s) - passing data through the buffer\n",dest->arg,strerror(errno));
+		Offloading = 0;
+		return 0;
+	}
+	cacheOutput(dest,dest->fd,ret);
+	/* the thread starts with the bytes transferred here */
+	Rest = ret;
+	infomsg("copying %s to %s with %s\n",Infile,dest->arg,Offloading == 1 ? "copy_file_range" : "sendfile");
+	return 1;
+}
+#endif
+
 
 static void openDestinationFiles(dest_t *d)
 {
@@ -883,7 +1801,8 @@ static void openDestinationFiles(dest_t *d)
 			} else {
 				++NumSenders;
 				debugmsg("successfully opened destination file %s with fd %d\n",d->arg,d->fd);
-				enable_directio(d->fd,d->arg);
+				if (!NoCache)
+					enable_directio(d->fd,d->arg);
 			}
 		}
 		if (-1 == d->fd)
@@ -926,15 +1845,47 @@ static int joinSenders()
 			ret = pthread_join(d->thread,&status);
 			if (ret != 0)
 				errormsg("error joining %s: %s\n",d->arg,d->name,strerror(errno));
+			/* canceled outputs still hold their preallocated space */
+			if (d->allocated)
+				cacheFinishOutput(d,d->fd);
 			if (status == 0)
 				++numthreads;
 		}
 		d = d->next;
 	} while (d);
+	closeManifests();
 	return numthreads;
 }
 
 
+/* compares the hashes with those that the sender of framed input reported */
+static void verifyHashes()
+{
+	dest_t *d;
+	int local = 0;
+
+	if (SenderHashes == 0)
+		return;
+	for (d = Dest; d; d = d->next) {
+		const char *h;
+		if (d->arg || (d->result == 0) || (0 == (h = strstr(d->result," hash: "))))
+			continue;
+		local = 1;
+		if (strstr(SenderHashes,d->result)) {
+			infomsg("%.*s hash matches the sender\n",(int)(h - d->result),d->result);
+		} else {
+			char *prefix = strndup(d->result,h - d->result + 7);
+			assert(prefix);
+			if (strstr(SenderHashes,prefix))
+				errormsg("%.*s hash differs from the sender\n",(int)(h - d->result),d->result);
+			free(prefix);
+		}
+	}
+	if (!local && SenderHashes[0])
+		infomsg("sender reported %s",SenderHashes);
+}
+
+
 static void reportSenders()
 {
 	dest_t *d = Dest;
@@ -1031,8 +1982,7 @@ static void initDefaults()
 		Blocksize = PgSz;
 		debugmsg("Blocksize set to physical page size of %ld bytes\n",PgSz);
 		Numblocks = NumP/50;
-		long mxsemv = maxSemValue();
-		while ((Numblocks > mxsemv) || (Numblocks > 200)) {
+		while (Numblocks > 200) {
 			Numblocks >>= 1;
 			Blocksize <<= 1;
 		}
@@ -1151,6 +2101,9 @@ int main(int argc, const char **argv)
 	debugmsg("default buffer set to %d blocks of %lld bytes\n",Numblocks,Blocksize);
 	for (c = 1; c < argc; c++)
 		c = parseOption(c,argc,argv);
+	if ((Streams > 1) || FrameCRC || Compression)
+		Framed = 1;
+	initStreams();
 
 	/* consistency check for options */
 	if (AutoloadTime && Timeout && Timeout <= AutoloadTime)
@@ -1196,26 +2149,46 @@ int main(int argc, const char **argv)
 		fatal("If non-zero, OutVolsize must be at least as large as the buffer blocksize (%llu)!\n",Blocksize);
 	/* SPW END */
 
+	if (Framed) {
+		unsigned long long bs;
+		long long size;
+		if (framedInput(&bs,&size)) {
+			if (size >= 0)
+				InSize = size;
+			if (!(Options & OPTION_S) && (bs != Blocksize)) {
+				if ((bs == 0) || (bs > FRAME_MAXBLOCK) || (PgSz && (bs % PgSz))) {
+					errormsg("sender uses an invalid block size of %llu bytes - use option -s\n",bs);
+					exit(EXIT_FAILURE);
+				}
+				/* keep the size of the buffer, unless -b was given */
+				if (!(Options & OPTION_B) || (Options & OPTION_M))
+					Numblocks = Numblocks * Blocksize / bs;
+				Blocksize = bs;
+				infomsg("using block size %llu of the sender: %lu blocks\n",Blocksize,Numblocks);
+			}
+		}
+	}
 	if (Numblocks < 5)
 		fatal("Minimum block count is 5.\n");
 
 	initBuffer();
 
-	debugmsg("creating semaphores...\n");
-	if (0 != sem_init(&Buf2Dev,0,0))
-		fatal("Error creating semaphore Buf2Dev: %s\n",strerror(errno));
-	if (0 != sem_init(&Dev2Buf,0,Numblocks))
-		fatal("Error creating semaphore Dev2Buf: %s\n",strerror(errno));
-
 	if (Infile)
 		openInput();
 	if (In == -1) {
 		debugmsg("input is stdin\n");
 		In = STDIN_FILENO;
 	}
+	cacheInitInput(In);
+	openSpill();
+#ifdef HAVE_VMSPLICE
+	if (Splice)
+		setPipeSize(In,"input");
+#endif
 	if (!outputIsSet()) {
 		debugmsg("no output set - adding stdout as destination\n");
 		dest_t *d = malloc(sizeof(dest_t));
+		bzero(d,sizeof(dest_t));
 		d->fd = dup(STDOUT_FILENO);
 		err = dup2(STDERR_FILENO,STDOUT_FILENO);
 		assert(err != -1);
@@ -1303,8 +2276,13 @@ int main(int argc, const char **argv)
 		dest = dest->next;
 	}
 
+	if (Records && SetOutsize) {
+		warningmsg("option -d is ignored when keeping input records\n");
+		SetOutsize = 0;
+	}
 	if (dest)
 		checkBlocksizes(dest);
+	numaPlaceBuffer(Buffer[0],Blocksize*Numblocks,In,dest ? dest->fd : -1);
 
 	if (((Verbose < 3) || (StatusLog == 0)) && (Quiet != 0))
 		Status = 0;
@@ -1325,19 +2303,30 @@ int main(int argc, const char **argv)
 		/* no real output, only hashing functions */
 		fatal("no output to send data to\n");
 	}
+	elasticInit();
+#ifdef HAVE_OFFLOAD
+	if (startOffload(dest))
+		err = pthread_create(&dest->thread,0,&offloadThread,dest);
+	else
+#endif
 	err = pthread_create(&dest->thread,0,&outputThread,dest);
 	assert(0 == err);
 	if (Status) {
-		err = pthread_create(&ReaderThr,0,&inputThread,0);
-		assert(0 == err);
+		if (!Offloading) {
+			err = pthread_create(&ReaderThr,0,&inputThread,0);
+			assert(0 == err);
+		}
 		(void) pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL);
 		statusThread();
-		err = pthread_join(ReaderThr,0);
-		if (err != 0)
-			errormsg("error joining reader: %s\n",strerror(errno));
+		if (!Offloading) {
+			err = pthread_join(ReaderThr,0);
+			if (err != 0)
+				errormsg("error joining reader: %s\n",strerror(errno));
+		}
 	} else {
 		(void) pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL);
-		(void) inputThread(0);
+		if (!Offloading)
+			(void) inputThread(0);
 		debugmsg("waiting for output to finish...\n");
 		if (TermQ[0] != -1) {
 			err = read(TermQ[0],&null,1);
@@ -1351,9 +2340,10 @@ int main(int argc, const char **argv)
 	}
 	if (Tmp != -1)
 		(void) close(Tmp);
+	verifyHashes();
 	reportSenders();
 	if (Status || Log != STDERR_FILENO)
-		summary(Numout * Blocksize + Rest, numthreads);
+		summary(Numout * Blocksize + Rest - Shortfall, numthreads);
 	exit(ErrorOccurred ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
@@ -32,19 +32,30 @@ void *alloca(size_t);
 
 
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#include "common.h"
+#include "compress.h"
 #include "dest.h"
+#include "digest.h"
 #include "globals.h"
+#include "hashing.h"
 #include "network.h"
 #include "settings.h"
 #include "log.h"
@@ -56,6 +67,9 @@ int AddrFam = PF_UNSPEC;
 int AddrFam = PF_INET;
 #endif
 
+static int Listener = -1;	/* accepts the additional streams of the input */
+static int NetIn = 0;		/* input is a network connection */
+
 
 static void setTCPBufferSize(int sock, int buffer)
 {
@@ -88,6 +102,34 @@ static void setTCPBufferSize(int sock, int buffer)
 }
 
 
+/* send partial blocks right away instead of waiting for more data */
+void setTCPNoDelay(int fd, const char *name)
+{
+	int one = 1;
+
+	if (0 == setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one)))
+		debugmsg("disabled delayed sending on %s\n",name);
+}
+
+
+/* the listening socket is kept until option --streams cannot follow anymore */
+static void doneListening(int sock)
+{
+	NetIn = 1;
+	Listener = sock;
+}
+
+
+/* called after all options have been parsed */
+void initStreams(void)
+{
+	if ((Streams <= 1) && (Listener >= 0)) {
+		(void) close(Listener);
+		Listener = -1;
+	}
+}
+
+
 #ifdef HAVE_GETADDRINFO
 
 void initNetworkInput(const char *addr)
@@ -156,7 +198,7 @@ void initNetworkInput(const char *addr)
 	if (x == 0)
 		fatal("Unable to initialize network input.\n");
 	infomsg("listening on socket...\n");
-	if (0 > listen(sock,1))		/* accept only 1 incoming connection */
+	if (0 > listen(sock,UINT8_MAX))		/* accept one connection per stream */
 		fatal("could not listen on socket for network input: %s\n",strerror(errno));
 	for (;;) {
 		char chost[NI_MAXHOST], serv[NI_MAXSERV];
@@ -195,7 +237,7 @@ void initNetworkInput(const char *addr)
 		freeaddrinfo(cinfo);
 	debugmsg("input connection accepted\n");
 	setTCPBufferSize(In,SO_RCVBUF);
-	(void) close(sock);
+	doneListening(sock);
 }
 
 
@@ -247,6 +289,7 @@ dest_t *createNetworkOutput(const char *addr)
 	else
 		host = 0;	// tag as start failed
 	d = (dest_t *) malloc(sizeof(dest_t));
+	bzero(d,sizeof(dest_t));
 	d->arg = addr;
 	d->name = host;
 	d->port = port;
@@ -292,7 +335,7 @@ static void openNetworkInput(const char *host, unsigned short port)
 	if (0 > bind(sock, (struct sockaddr *) &saddr, sizeof(saddr)))
 		fatal("could not bind to socket for network input: %s\n",strerror(errno));
 	debugmsg("listening on socket...\n");
-	if (0 > listen(sock,1))		/* accept only 1 incoming connection */
+	if (0 > listen(sock,UINT8_MAX))		/* accept one connection per stream */
 		fatal("could not listen on socket for network input: %s\n",strerror(errno));
 	for (;;) {
 		struct sockaddr_in caddr;
@@ -304,13 +347,13 @@ static void openNetworkInput(const char *host, unsigned short port)
 			fatal("could not accept connection for network input: %s\n",strerror(errno));
 		if (host[0] == 0) {
 			infomsg("accepted connection from %s\n",inet_ntoa(caddr.sin_addr));
-			(void) close(sock);
+			doneListening(sock);
 			return;
 		}
 		for (p = h->h_addr_list; *p; ++p) {
 			if (0 == memcmp(&caddr.sin_addr,*p,h->h_length)) {
 				infomsg("accepted connection from %s\n",inet_ntoa(caddr.sin_addr));
-				(void) close(sock);
+				doneListening(sock);
 				return;
 			}
 		}
@@ -423,5 +466,822 @@ dest_t *createNetworkOutput(const char *addr)
 #endif /* HAVE_GETADDRINFO */
 
 
-/* vim:tw=0
+/*
+ * Framed transfers (options --framed and --streams): the sender opens
+ * the transfer with a hello that carries the protocol version, its
+ * block size, the size of its input if known, the number of streams it
+ * proposes, and the features it requests. The receiver answers with
+ * what it accepts, and the sender opens the remaining connections, each
+ * introduced by a hello with its index. Every block travels behind a
+ * frame header with its sequence number, its length, and optionally its
+ * CRC32C. Blocks may be compressed with the codecs that the receiver
+ * supports. The blocks are sent round-robin over the streams. Finally,
+ * every stream gets an end frame with the total number of blocks. The
+ * end frame of the first stream carries a trailer with the number of
+ * bytes sent and the hash results of the sender.
  */
+
+#define FRAME_MAGIC 0x6d624652		/* "mbFR" */
+#define FRAME_VERSION 1
+#define FRAME_TIMEOUT 30000		/* ms to wait for the answer to a hello */
+#define FEATURE_CRC 1			/* blocks carry their CRC32C */
+#define FEATURE_CODECS (CODEC_LZ4|CODEC_ZSTD)	/* codecs of compressed blocks */
+#define MAX_TRAILER 4096
+
+typedef struct {
+	uint32_t magic, version, count, index, blocksize, features, sizehi, sizelo;
+} hello_t;
+
+typedef struct {
+	uint32_t seqhi, seqlo, len, flags, crc;
+} frame_t;
+
+static hello_t Hello;		/* hello of the sender in host byte order */
+static int HelloState = 0;	/* 1: sender uses frames, -1: it does not, 0: unknown */
+
+
+ssize_t readAll(int fd, void *buf, size_t n)
+{
+	size_t num = 0;
+
+	while (num < n) {
+		ssize_t r = read(fd,(char *)buf + num,n - num);
+		if (r > 0)
+			num += r;
+		else if (r == 0)
+			return num;
+		else if (errno != EINTR)
+			return -1;
+	}
+	return num;
+}
+
+
+static int writeAll(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt) {
+		ssize_t w = writev(fd,iov,cnt);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt && ((size_t)w >= iov->iov_len)) {
+			w -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+
+static int sendHello(int fd, unsigned count, unsigned index, unsigned features, long long size)
+{
+	struct iovec iov;
+	hello_t h;
+
+	h.magic = htonl(FRAME_MAGIC);
+	h.version = htonl(FRAME_VERSION);
+	h.count = htonl(count);
+	h.index = htonl(index);
+	h.blocksize = htonl(Blocksize);
+	h.features = htonl(features);
+	h.sizehi = htonl((unsigned long long)size >> 32);
+	h.sizelo = htonl(size & 0xffffffff);
+	iov.iov_base = &h;
+	iov.iov_len = sizeof(h);
+	return writeAll(fd,&iov,1);
+}
+
+
+/* reads a hello; returns 0 upon success */
+static int recvHello(int fd, hello_t *h)
+{
+	if ((sizeof(*h) != readAll(fd,h,sizeof(*h))) || (ntohl(h->magic) != FRAME_MAGIC))
+		return -1;
+	h->magic = FRAME_MAGIC;
+	h->version = ntohl(h->version);
+	h->count = ntohl(h->count);
+	h->index = ntohl(h->index);
+	h->blocksize = ntohl(h->blocksize);
+	h->features = ntohl(h->features);
+	h->sizehi = ntohl(h->sizehi);
+	h->sizelo = ntohl(h->sizelo);
+	return (h->version != FRAME_VERSION) ? -1 : 0;
+}
+
+
+/* checks if the sender of the network input uses frames */
+static int peekHello(void)
+{
+	hello_t h;
+
+	if (HelloState != 0)
+		return HelloState == 1;
+	HelloState = -1;
+	if (!Framed || !NetIn)
+		return 0;
+	if ((sizeof(h) != recv(In,&h,sizeof(h),MSG_PEEK|MSG_WAITALL)) || (ntohl(h.magic) != FRAME_MAGIC) || (h.index != 0)) {
+		infomsg("sender does not use frames\n");
+		if (Listener >= 0)
+			(void) close(Listener);
+		Listener = -1;
+		return 0;
+	}
+	if (-1 == recvHello(In,&Hello))
+		fatal("invalid hello from sender\n");
+	HelloState = 1;
+	return 1;
+}
+
+
+/*
+ * Returns 1 if the sender of the network input uses frames, with its
+ * block size in bs and the size of its input in size, which is -1 if
+ * the sender does not know it.
+ */
+int framedInput(unsigned long long *bs, long long *size)
+{
+	if (!peekHello())
+		return 0;
+	*bs = Hello.blocksize;
+	*size = (long long)((unsigned long long)Hello.sizehi << 32 | Hello.sizelo);
+	return 1;
+}
+
+
+static int sameHost(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return 0 == memcmp(&((struct sockaddr_in *)a)->sin_addr,&((struct sockaddr_in *)b)->sin_addr,sizeof(struct in_addr));
+#ifdef PF_INET6
+	if (a->ss_family == AF_INET6)
+		return 0 == memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,&((struct sockaddr_in6 *)b)->sin6_addr,sizeof(struct in6_addr));
+#endif
+	return 1;
+}
+
+
+/*
+ * Negotiates the framed transfer with the sender on input In and
+ * accepts its additional connections. Returns the number of streams
+ * with their descriptors in fds, In being the first, and the accepted
+ * features, or 0 if the sender does not use frames.
+ */
+unsigned acceptStreams(int **fds, unsigned *features)
+{
+	struct sockaddr_storage peer;
+	socklen_t pl = sizeof(peer);
+	unsigned count, got;
+	int *f;
+
+	if (!peekHello())
+		return 0;
+	count = Hello.count;
+	if (count > Streams)
+		count = Streams;
+	else if (count == 0)
+		count = 1;
+	if (Hello.blocksize > Blocksize) {
+		(void) sendHello(In,0,0,0,-1);
+		fatal("sender uses blocks of %u bytes, which exceeds the block size of %llu - use option -s\n",Hello.blocksize,Blocksize);
+	}
+	*features = Hello.features & (FEATURE_CRC | codecsAvailable(FEATURE_CODECS));
+	if (-1 == sendHello(In,count,0,*features,-1))
+		fatal("unable to answer the sender: %s\n",strerror(errno));
+	f = malloc(count * sizeof(int));
+	if (f == 0)
+		fatal("out of memory\n");
+	f[0] = In;
+	for (got = 1; got < count; ++got)
+		f[got] = -1;
+	if ((count > 1) && (-1 == getpeername(In,(struct sockaddr *)&peer,&pl)))
+		fatal("unable to get address of sender: %s\n",strerror(errno));
+	got = 1;
+	while (got < count) {
+		struct sockaddr_storage ca;
+		socklen_t cl = sizeof(ca);
+		struct pollfd pfd;
+		hello_t h;
+		int fd, n;
+
+		/* a sender that does not open all streams must not block the receiver forever */
+		pfd.fd = Listener;
+		pfd.events = POLLIN;
+		n = poll(&pfd,1,FRAME_TIMEOUT);
+		if (n == 0)
+			fatal("sender opened only %u of %u streams within %d seconds\n",got,count,FRAME_TIMEOUT / 1000);
+		if ((n == -1) && (errno != EINTR))
+			fatal("unable to wait for connections of network input: %s\n",strerror(errno));
+		if (n != 1)
+			continue;
+		fd = accept(Listener,(struct sockaddr *)&ca,&cl);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("unable to accept connection for network input: %s\n",strerror(errno));
+		}
+		if (!sameHost(&ca,&peer)) {
+			warningmsg("rejected connection from another host\n");
+			(void) close(fd);
+			continue;
+		}
+		pfd.fd = fd;
+		if ((1 != poll(&pfd,1,FRAME_TIMEOUT)) || (-1 == recvHello(fd,&h)) || (h.count != count) || (h.index == 0) || (h.index >= count) || (f[h.index] != -1)) {
+			warningmsg("rejected connection without valid stream hello\n");
+			(void) close(fd);
+			continue;
+		}
+		setTCPBufferSize(fd,SO_RCVBUF);
+		f[h.index] = fd;
+		++got;
+	}
+	if (Listener >= 0)
+		(void) close(Listener);
+	Listener = -1;
+	if (count > 1)
+		infomsg("receiving with %u streams\n",count);
+	else
+		infomsg("receiving frames\n");
+	if (*features & FEATURE_CRC)
+		infomsg("checking CRC32C of every block\n");
+	if ((Hello.features & FEATURE_CODECS) != (*features & FEATURE_CODECS))
+		warningmsg("unable to decompress all codecs of the sender - install liblz4 and libzstd\n");
+	*fds = f;
+	return count;
+}
+
+
+/*
+ * Negotiates the framed transfer with the receiver of d and opens the
+ * additional connections. Returns the number of streams with their
+ * descriptors in fds, d->fd being the first, or 0 upon failure.
+ */
+static unsigned connectStreams(dest_t *d, int **fds, unsigned *features)
+{
+	struct sockaddr_storage peer;
+	socklen_t pl = sizeof(peer);
+	struct pollfd pfd;
+	unsigned count, i, want = (FrameCRC ? FEATURE_CRC : 0) | codecsAvailable(Compression);
+	hello_t h;
+	int *f;
+
+	if (Compression && !(want & FEATURE_CODECS))
+		warningmsg("no library for compression with %s - sending uncompressed\n",codecName(Compression));
+	if (-1 == sendHello(d->fd,Streams,0,want,InSize ? (long long)InSize : -1)) {
+		errormsg("unable to send hello to %s: %s\n",d->arg,strerror(errno));
+		return 0;
+	}
+	pfd.fd = d->fd;
+	pfd.events = POLLIN;
+	if ((1 != poll(&pfd,1,FRAME_TIMEOUT)) || (-1 == recvHello(d->fd,&h))) {
+		errormsg("%s did not answer the hello - is option --framed or --streams set on the receiver?\n",d->arg);
+		return 0;
+	}
+	if (h.count == 0) {
+		errormsg("%s refused the block size of %llu bytes - its block size is %u\n",d->arg,Blocksize,h.blocksize);
+		return 0;
+	}
+	count = (h.count < Streams) ? h.count : Streams;
+	*features = h.features & want;
+	if ((want & FEATURE_CODECS) && !(*features & FEATURE_CODECS))
+		warningmsg("%s cannot decompress %s - sending uncompressed\n",d->arg,codecName(want & FEATURE_CODECS));
+	if ((count > 1) && (-1 == getpeername(d->fd,(struct sockaddr *)&peer,&pl))) {
+		errormsg("unable to get address of %s: %s\n",d->arg,strerror(errno));
+		return 0;
+	}
+	f = malloc(count * sizeof(int));
+	if (f == 0)
+		fatal("out of memory\n");
+	f[0] = d->fd;
+	for (i = 1; i < count; ++i) {
+		f[i] = socket(peer.ss_family,SOCK_STREAM,0);
+		if ((f[i] == -1) || (-1 == connect(f[i],(struct sockaddr *)&peer,pl))
+			|| (setTCPBufferSize(f[i],SO_SNDBUF), -1 == sendHello(f[i],count,i,*features,-1))) {
+			errormsg("unable to open stream %u to %s: %s\n",i,d->arg,strerror(errno));
+			while (i) {
+				if (f[i] != -1)
+					(void) close(f[i]);
+				--i;
+			}
+			free(f);
+			return 0;
+		}
+		if (FlushAfter)
+			setTCPNoDelay(f[i],d->arg);
+	}
+	if (count > 1)
+		infomsg("sending to %s with %u streams\n",d->arg,count);
+	else
+		infomsg("sending frames to %s\n",d->arg);
+	*fds = f;
+	return count;
+}
+
+
+/* reads a frame header; returns the flags of the frame, or -1 on errors */
+int recvFrame(int fd, unsigned long long *seq, size_t *len, uint32_t *crc)
+{
+	frame_t fr;
+	ssize_t r = readAll(fd,&fr,sizeof(fr));
+
+	if (r != sizeof(fr)) {
+		if (r >= 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	*seq = ((unsigned long long)ntohl(fr.seqhi) << 32) | ntohl(fr.seqlo);
+	*len = ntohl(fr.len);
+	*crc = ntohl(fr.crc);
+	return ntohl(fr.flags) & (FRAME_END|FRAME_CRC|FRAME_LZ4|FRAME_ZSTD);
+}
+
+
+/*
+ * Reads the trailer of len bytes behind an end frame. Returns the
+ * number of bytes sent in bytes and the hash results of the sender in
+ * hashes, or -1 on errors.
+ */
+int recvTrailer(int fd, size_t len, unsigned long long *bytes, char **hashes)
+{
+	uint32_t b[2];
+	char *h;
+
+	if ((len < sizeof(b)) || (len > MAX_TRAILER)) {
+		errno = EPROTO;
+		return -1;
+	}
+	h = malloc(len - sizeof(b) + 1);
+	if (h == 0)
+		fatal("out of memory\n");
+	if ((sizeof(b) != readAll(fd,b,sizeof(b))) || ((ssize_t)(len - sizeof(b)) != readAll(fd,h,len - sizeof(b)))) {
+		free(h);
+		errno = ECONNRESET;
+		return -1;
+	}
+	h[len - sizeof(b)] = 0;
+	*bytes = (unsigned long long)ntohl(b[0]) << 32 | ntohl(b[1]);
+	*hashes = h;
+	return 0;
+}
+
+
+static int sendFrame(int fd, unsigned long long seq, const char *buf, size_t len, unsigned flags, uint32_t crc)
+{
+	struct iovec iov[2];
+	frame_t fr;
+
+	fr.seqhi = htonl(seq >> 32);
+	fr.seqlo = htonl(seq & 0xffffffff);
+	fr.len = htonl(len);
+	fr.flags = htonl(flags);
+	fr.crc = htonl(crc);
+	iov[0].iov_base = &fr;
+	iov[0].iov_len = sizeof(fr);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	return writeAll(fd,iov,len ? 2 : 1);
+}
+
+
+typedef struct {
+	const char *buf;
+	char *cbuf;		/* compressed block */
+	size_t size, clen;	/* bytes of the block, 0 if not compressed */
+	int codec, ready, done, err;
+} streamreq_t;
+
+/* compression stages of option --compress auto, from fast to small */
+static const struct { int codec, level; } Stages[] = {
+	{ CODEC_NONE, 0 },
+	{ CODEC_LZ4, 1 },
+	{ CODEC_ZSTD, 1 },
+	{ CODEC_ZSTD, 3 },
+	{ CODEC_ZSTD, 6 },
+	{ CODEC_ZSTD, 9 },
+	{ CODEC_ZSTD, 15 },
+};
+#define NUMSTAGES (sizeof(Stages) / sizeof(Stages[0]))
+
+struct stripe {
+	dest_t *dest;
+	int *fds;
+	unsigned n, nc, depth, features;
+	pthread_t *thr, *cthr;
+	pthread_mutex_t mtx;
+	pthread_cond_t posted, done;
+	streamreq_t *req;
+	unsigned long long
+		Posted,		/* blocks handed to the streams */
+		Claimed,	/* blocks picked up by the compression threads */
+		Collected,	/* blocks given back by stripeWait */
+		Bytes;		/* bytes handed to the streams */
+	int codec, level, stage;	/* current compression, stage -1 if fixed */
+	double ctime, stime;	/* seconds spent compressing and sending since window */
+	struct timespec window;
+	char *trailer;		/* sent with the end frame of the first stream */
+	size_t tlen;
+	int ending, abort;
+};
+
+typedef struct {
+	struct stripe *stripe;
+	unsigned idx;
+} streamarg_t;
+
+
+static double since(const struct timespec *t)
+{
+	struct timespec now;
+
+	(void) clock_gettime(ClockSrc,&now);
+	return (double)(now.tv_sec - t->tv_sec) + (double)(now.tv_nsec - t->tv_nsec) * 1E-9;
+}
+
+
+/*
+ * Compresses the posted blocks. After a series of blocks that did not
+ * get smaller, some blocks are sent without trying, so incompressible
+ * data costs little CPU time.
+ */
+static void *compressThread(void *arg)
+{
+	struct stripe *s = (struct stripe *)arg;
+	codec_t *c = codecOpen();
+	unsigned misses = 0, skip = 0;
+	int err;
+
+	err = pthread_mutex_lock(&s->mtx);
+	assert(err == 0);
+	for (;;) {
+		struct timespec start;
+		streamreq_t *r;
+		int codec, level;
+		size_t clen = 0;
+		double t = 0;
+
+		while ((s->Claimed == s->Posted) && !s->ending && !s->abort) {
+			err = pthread_cond_wait(&s->posted,&s->mtx);
+			assert(err == 0);
+		}
+		if (s->abort || (s->Claimed == s->Posted))
+			break;
+		r = s->req + s->Claimed++ % s->depth;
+		codec = s->codec;
+		level = s->level;
+		err = pthread_mutex_unlock(&s->mtx);
+		assert(err == 0);
+		if (skip) {
+			--skip;
+		} else if (codec != CODEC_NONE) {
+			(void) clock_gettime(ClockSrc,&start);
+			clen = codecCompress(c,codec,level,r->buf,r->size,r->cbuf);
+			t = since(&start);
+			if (clen)
+				misses = 0;
+			else if (++misses >= 8)
+				skip = 16;
+		}
+		err = pthread_mutex_lock(&s->mtx);
+		assert(err == 0);
+		r->clen = clen;
+		r->codec = clen ? codec : CODEC_NONE;
+		r->ready = 1;
+		s->ctime += t;
+		err = pthread_cond_broadcast(&s->posted);
+		assert(err == 0);
+	}
+	err = pthread_mutex_unlock(&s->mtx);
+	assert(err == 0);
+	codecClose(c);
+	return 0;
+}
+
+
+/*
+ * Adapts the compression of option --compress auto once per second:
+ * when the compression threads are busy while the streams wait, a
+ * faster stage is chosen; when the streams are busy while the
+ * compression threads wait, a stage that compresses better.
+ */
+static void adaptCompression(struct stripe *s)
+{
+	double span = since(&s->window), cbusy, sbusy;
+	int stage = s->stage;
+
+	if (span < 1)
+		return;
+	cbusy = s->ctime / (span * s->nc);
+	sbusy = s->stime / (span * s->n);
+	debugmsg("compression busy %.0f%%, streams busy %.0f%%\n",cbusy * 100,sbusy * 100);
+	if ((cbusy > 0.9) && (sbusy < 0.7)) {
+		while ((--stage >= 0) && (Stages[stage].codec != CODEC_NONE) && !(s->features & Stages[stage].codec));
+	} else if ((sbusy > 0.9) && (cbusy < 0.5)) {
+		while ((++stage < (int)NUMSTAGES) && !(s->features & Stages[stage].codec));
+	}
+	if ((stage >= 0) && (stage < (int)NUMSTAGES) && (stage != s->stage)) {
+		s->stage = stage;
+		s->codec = Stages[stage].codec;
+		s->level = Stages[stage].level;
+		if (s->codec == CODEC_NONE)
+			infomsg("compression slows down the transfer to %s - sending uncompressed\n",s->dest->arg);
+		else
+			infomsg("compressing for %s with %s level %d\n",s->dest->arg,codecName(s->codec),s->level);
+	}
+	s->ctime = 0;
+	s->stime = 0;
+	(void) clock_gettime(ClockSrc,&s->window);
+}
+
+
+static unsigned frameFlags(struct stripe *s, streamreq_t *r)
+{
+	unsigned flags = (s->features & FEATURE_CRC) ? FRAME_CRC : 0;
+
+	if (r->codec == CODEC_LZ4)
+		flags |= FRAME_LZ4;
+	else if (r->codec == CODEC_ZSTD)
+		flags |= FRAME_ZSTD;
+	return flags;
+}
+
+
+/* sends every n-th block, starting at its index */
+static void *streamThread(void *arg)
+{
+	struct stripe *s = ((streamarg_t *)arg)->stripe;
+	unsigned idx = ((streamarg_t *)arg)->idx;
+	unsigned long long seq = idx;
+	int fd = s->fds[idx], err;
+
+	free(arg);
+	for (;;) {
+		struct timespec start;
+		streamreq_t *r;
+		uint32_t crc = 0;
+		double t;
+		int e;
+
+		err = pthread_mutex_lock(&s->mtx);
+		assert(err == 0);
+		while (!s->abort && ((seq >= s->Posted) ? !s->ending : !s->req[seq % s->depth].ready)) {
+			err = pthread_cond_wait(&s->posted,&s->mtx);
+			assert(err == 0);
+		}
+		if (s->abort || (seq >= s->Posted)) {
+			unsigned long long end = s->Posted;
+			int abort = s->abort;
+			err = pthread_mutex_unlock(&s->mtx);
+			assert(err == 0);
+			if (abort)
+				return 0;
+			if ((idx == 0) ? sendFrame(fd,end,s->trailer,s->tlen,FRAME_END,0) : sendFrame(fd,end,0,0,FRAME_END,0))
+				warningmsg("unable to end stream %u to %s: %s\n",idx,s->dest->arg,strerror(errno));
+			return 0;
+		}
+		r = s->req + seq % s->depth;
+		err = pthread_mutex_unlock(&s->mtx);
+		assert(err == 0);
+		if (s->features & FEATURE_CRC)
+			crc = crc32c(0,r->buf,r->size);
+		(void) clock_gettime(ClockSrc,&start);
+		if (r->codec != CODEC_NONE)
+			e = sendFrame(fd,seq,r->cbuf,r->clen,frameFlags(s,r),crc) ? errno : 0;
+		else
+			e = sendFrame(fd,seq,r->buf,r->size,frameFlags(s,r),crc) ? errno : 0;
+		t = since(&start);
+		debugiomsg("stream %u to %s: block %llu with %zu bytes sent\n",idx,s->dest->arg,seq,r->codec ? r->clen : r->size);
+		err = pthread_mutex_lock(&s->mtx);
+		assert(err == 0);
+		r->err = e;
+		r->done = 1;
+		s->stime += t;
+		err = pthread_cond_broadcast(&s->done);
+		assert(err == 0);
+		err = pthread_mutex_unlock(&s->mtx);
+		assert(err == 0);
+		if (e)
+			return 0;
+		seq += s->n;
+	}
+}
+
+
+/* sets up the compression threads, if compression has been negotiated */
+static void startCompression(struct stripe *s)
+{
+	unsigned i;
+	int err;
+
+	s->codec = CODEC_NONE;
+	s->stage = -1;
+	if (!(s->features & FEATURE_CODECS))
+		return;
+	if (CompressLevel == -1) {
+		/* adaptive: start with the fastest codec */
+		for (i = 1; i < NUMSTAGES; ++i) {
+			if (s->features & Stages[i].codec)
+				break;
+		}
+		s->stage = i;
+		s->codec = Stages[i].codec;
+		s->level = Stages[i].level;
+		(void) clock_gettime(ClockSrc,&s->window);
+	} else {
+		s->codec = Compression;
+		s->level = CompressLevel;
+	}
+	s->cthr = calloc(s->nc,sizeof(pthread_t));
+	assert(s->cthr);
+	for (i = 0; i < s->nc; ++i) {
+		err = pthread_create(s->cthr + i,0,compressThread,s);
+		assert(err == 0);
+	}
+	infomsg("compressing for %s with %s%s using %u threads\n",s->dest->arg,codecName(s->codec),(s->stage == -1) ? "" : " (adaptive)",s->nc);
+}
+
+
+/* opens the framed transfer to the receiver of d; returns 0 upon failure */
+stripe_t *stripeOpen(dest_t *d)
+{
+	struct stripe *s = calloc(1,sizeof(struct stripe));
+	unsigned i;
+	int err;
+
+	assert(s);
+	s->dest = d;
+	s->n = connectStreams(d,&s->fds,&s->features);
+	if (s->n == 0) {
+		free(s);
+		return 0;
+	}
+	if (s->features & FEATURE_CODECS)
+		s->nc = codecThreads();
+	/* two blocks per stream or compression thread keep all of them busy */
+	s->depth = 2 * ((s->nc > s->n) ? s->nc : s->n);
+	if (s->depth > Numblocks / 2)
+		s->depth = Numblocks / 2;
+	if (s->depth < s->n)
+		s->depth = s->n;
+	s->req = calloc(s->depth,sizeof(streamreq_t));
+	s->thr = calloc(s->n,sizeof(pthread_t));
+	assert(s->req && s->thr);
+	if (s->features & FEATURE_CODECS) {
+		for (i = 0; i < s->depth; ++i) {
+			s->req[i].cbuf = malloc(Blocksize);
+			assert(s->req[i].cbuf);
+		}
+	}
+	err = pthread_mutex_init(&s->mtx,0);
+	assert(err == 0);
+	err = pthread_cond_init(&s->posted,0);
+	assert(err == 0);
+	err = pthread_cond_init(&s->done,0);
+	assert(err == 0);
+	startCompression(s);
+	for (i = 0; i < s->n; ++i) {
+		streamarg_t *a = malloc(sizeof(streamarg_t));
+		assert(a);
+		a->stripe = s;
+		a->idx = i;
+		err = pthread_create(s->thr + i,0,streamThread,a);
+		assert(err == 0);
+	}
+	return s;
+}
+
+
+/* number of blocks that may be posted before waiting */
+unsigned stripeDepth(stripe_t *s)
+{
+	return s->depth;
+}
+
+
+/* passes the next block to the stream it belongs to */
+void stripePost(stripe_t *s, const char *buf, size_t size)
+{
+	streamreq_t *r;
+	int err;
+
+	err = pthread_mutex_lock(&s->mtx);
+	assert(err == 0);
+	assert(s->Posted - s->Collected < s->depth);
+	if (s->stage != -1)
+		adaptCompression(s);
+	r = s->req + s->Posted % s->depth;
+	r->buf = buf;
+	r->size = size;
+	r->clen = 0;
+	r->codec = CODEC_NONE;
+	r->ready = (s->nc == 0);
+	r->done = 0;
+	r->err = 0;
+	++s->Posted;
+	s->Bytes += size;
+	err = pthread_cond_broadcast(&s->posted);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&s->mtx);
+	assert(err == 0);
+}
+
+
+/* waits until the oldest posted block has been sent; returns its errno */
+int stripeWait(stripe_t *s)
+{
+	streamreq_t *r;
+	int err, ret;
+
+	err = pthread_mutex_lock(&s->mtx);
+	assert(err == 0);
+	assert(s->Collected < s->Posted);
+	r = s->req + s->Collected % s->depth;
+	pthread_cleanup_push(releaseLock,&s->mtx);
+	while (!r->done) {
+		err = pthread_cond_wait(&s->done,&s->mtx);
+		assert(err == 0);
+	}
+	pthread_cleanup_pop(0);
+	ret = r->err;
+	++s->Collected;
+	err = pthread_mutex_unlock(&s->mtx);
+	assert(err == 0);
+	return ret;
+}
+
+
+/* prepares the trailer with the bytes sent and the hash results */
+static void stripeTrailer(struct stripe *s)
+{
+	char *hashes = hashResults();
+	size_t hl = hashes ? strlen(hashes) : 0;
+	uint32_t b[2];
+
+	if (hl > MAX_TRAILER - sizeof(b))
+		hl = MAX_TRAILER - sizeof(b);
+	s->tlen = sizeof(b) + hl;
+	s->trailer = malloc(s->tlen);
+	assert(s->trailer);
+	b[0] = htonl(s->Bytes >> 32);
+	b[1] = htonl(s->Bytes & 0xffffffff);
+	(void) memcpy(s->trailer,b,sizeof(b));
+	if (hl)
+		(void) memcpy(s->trailer + sizeof(b),hashes,hl);
+	free(hashes);
+}
+
+
+/*
+ * Ends the transfer: after all posted blocks have been sent, the end
+ * frames and the trailer are sent; upon abort, the connections are
+ * shut down. The first connection is left to the caller.
+ */
+void stripeClose(stripe_t *s, int abort)
+{
+	unsigned i;
+	int err;
+
+	if (!abort)
+		stripeTrailer(s);
+	err = pthread_mutex_lock(&s->mtx);
+	assert(err == 0);
+	if (abort)
+		s->abort = 1;
+	s->ending = 1;
+	err = pthread_cond_broadcast(&s->posted);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&s->mtx);
+	assert(err == 0);
+	if (abort) {
+		for (i = 0; i < s->n; ++i)
+			(void) shutdown(s->fds[i],SHUT_RDWR);
+	}
+	for (i = 0; i < s->nc; ++i) {
+		err = pthread_join(s->cthr[i],0);
+		assert(err == 0);
+	}
+	for (i = 0; i < s->n; ++i) {
+		err = pthread_join(s->thr[i],0);
+		assert(err == 0);
+	}
+	for (i = 1; i < s->n; ++i)
+		(void) close(s->fds[i]);
+	for (i = 0; i < s->depth; ++i)
+		free(s->req[i].cbuf);
+	(void) pthread_mutex_destroy(&s->mtx);
+	(void) pthread_cond_destroy(&s->posted);
+	(void) pthread_cond_destroy(&s->done);
+	free(s->fds);
+	free(s->req);
+	free(s->thr);
+	free(s->cthr);
+	free(s->trailer);
+	free(s);
+}
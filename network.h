@@ -20,7 +20,33 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 void initNetworkInput(const char *addr);
 struct destination *createNetworkOutput(const char *addr);
+void setTCPNoDelay(int fd, const char *name);
+void initStreams(void);
+
+/* framed transfers, see options --framed and --streams */
+#define FRAME_END 1	/* end of a stream */
+#define FRAME_CRC 2	/* frame carries the CRC32C of its block */
+#define FRAME_LZ4 4	/* block is compressed with lz4 */
+#define FRAME_ZSTD 8	/* block is compressed with zstd */
+#define FRAME_MAXBLOCK (1ULL << 30)	/* largest block size taken from a sender */
+
+typedef struct stripe stripe_t;
+
+int framedInput(unsigned long long *bs, long long *size);
+unsigned acceptStreams(int **fds, unsigned *features);
+ssize_t readAll(int fd, void *buf, size_t n);
+int recvFrame(int fd, unsigned long long *seq, size_t *len, uint32_t *crc);
+int recvTrailer(int fd, size_t len, unsigned long long *bytes, char **hashes);
+stripe_t *stripeOpen(struct destination *d);
+unsigned stripeDepth(stripe_t *s);
+void stripePost(stripe_t *s, const char *buf, size_t size);
+int stripeWait(stripe_t *s);
+void stripeClose(stripe_t *s, int abort);
 
 #endif
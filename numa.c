@@ -0,0 +1,327 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "numa.h"
+#include "log.h"
+
+#ifdef HAVE_NUMA
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/mempolicy.h>
+
+/*
+ * Placement of the buffer and the threads on NUMA nodes. The nodes of
+ * devices are looked up in sysfs, which avoids a dependency on libnuma.
+ */
+
+#define POLICY_NONE -1
+#define POLICY_AUTO -2
+#define POLICY_INTERLEAVE -3
+
+#define MAXNODES 1024
+#define BITS (8 * sizeof(unsigned long))
+
+static int Policy = POLICY_NONE;	/* node number or one of the above */
+static int BufferNode = -1;		/* node the buffer was placed on */
+static cpu_set_t Cpus[2];		/* CPUs set with --input-cpus/--output-cpus */
+static char *CpuList[2] = { 0, 0 };
+
+
+/* parse a list like 0-3,8,10-11 as used by sysfs and taskset */
+static int parseList(const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	for (;;) {
+		char *e;
+		long a = strtol(s,&e,10), b = a;
+
+		if ((e == s) || (a < 0) || (a >= CPU_SETSIZE))
+			return -1;
+		if (*e == '-') {
+			s = e + 1;
+			b = strtol(s,&e,10);
+			if ((e == s) || (b < a) || (b >= CPU_SETSIZE))
+				return -1;
+		}
+		while (a <= b)
+			CPU_SET(a++,set);
+		if (*e != ',')
+			return ((*e == 0) || (*e == '\n')) ? 0 : -1;
+		s = e + 1;
+	}
+}
+
+
+static int readList(const char *fn, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *f = fopen(fn,"r");
+	int ret = -1;
+
+	if (f == 0)
+		return -1;
+	if (fgets(buf,sizeof(buf),f))
+		ret = parseList(buf,set);
+	(void) fclose(f);
+	return ret;
+}
+
+
+static int nodeCpus(int node, cpu_set_t *set)
+{
+	char fn[64];
+
+	(void) snprintf(fn,sizeof(fn),"/sys/devices/system/node/node%d/cpulist",node);
+	return readList(fn,set);
+}
+
+
+/* walk up the device hierarchy to the first device with a known node */
+static int sysfsNode(const char *dev)
+{
+	char path[PATH_MAX], *slash;
+
+	if (0 == realpath(dev,path))
+		return -1;
+	do {
+		size_t l = strlen(path);
+		FILE *f;
+
+		if (l + sizeof("/numa_node") > sizeof(path))
+			return -1;
+		(void) strcpy(path + l,"/numa_node");
+		f = fopen(path,"r");
+		path[l] = 0;
+		if (f) {
+			int node;
+			int n = fscanf(f,"%d",&node);
+			(void) fclose(f);
+			if ((n == 1) && (node >= 0))
+				return node;
+		}
+		slash = strrchr(path,'/');
+		if (slash)
+			*slash = 0;
+	} while (slash && (slash != path));
+	return -1;
+}
+
+
+/* node of the network interface the socket is bound to */
+static int socketNode(int fd)
+{
+	struct sockaddr_storage sa;
+	socklen_t sl = sizeof(sa);
+	struct ifaddrs *ifa, *i;
+	int node = -1;
+
+	if (-1 == getsockname(fd,(struct sockaddr *)&sa,&sl))
+		return -1;
+	if ((sa.ss_family != AF_INET) && (sa.ss_family != AF_INET6))
+		return -1;
+	if (-1 == getifaddrs(&ifa))
+		return -1;
+	for (i = ifa; i && (node == -1); i = i->ifa_next) {
+		char dev[IF_NAMESIZE + 16];
+		if ((i->ifa_addr == 0) || (i->ifa_addr->sa_family != sa.ss_family))
+			continue;
+		if (sa.ss_family == AF_INET) {
+			if (memcmp(&((struct sockaddr_in *)i->ifa_addr)->sin_addr,&((struct sockaddr_in *)&sa)->sin_addr,sizeof(struct in_addr)))
+				continue;
+		} else {
+			if (memcmp(&((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr,&((struct sockaddr_in6 *)&sa)->sin6_addr,sizeof(struct in6_addr)))
+				continue;
+		}
+		(void) snprintf(dev,sizeof(dev),"/sys/class/net/%s",i->ifa_name);
+		node = sysfsNode(dev);
+	}
+	freeifaddrs(ifa);
+	return node;
+}
+
+
+/* node of the device behind fd, or -1 if unknown */
+static int fdNode(int fd)
+{
+	struct stat st;
+	char dev[64];
+
+	if ((fd < 0) || (-1 == fstat(fd,&st)))
+		return -1;
+	if (S_ISSOCK(st.st_mode))
+		return socketNode(fd);
+	if (S_ISBLK(st.st_mode))
+		(void) snprintf(dev,sizeof(dev),"/sys/dev/block/%u:%u",major(st.st_rdev),minor(st.st_rdev));
+	else if (S_ISCHR(st.st_mode))
+		(void) snprintf(dev,sizeof(dev),"/sys/dev/char/%u:%u",major(st.st_rdev),minor(st.st_rdev));
+	else if (S_ISREG(st.st_mode))
+		(void) snprintf(dev,sizeof(dev),"/sys/dev/block/%u:%u",major(st.st_dev),minor(st.st_dev));
+	else
+		return -1;
+	return sysfsNode(dev);
+}
+
+
+int numaSetPolicy(const char *arg)
+{
+	char *e;
+	long n;
+
+	if (0 == strcmp(arg,"auto")) {
+		Policy = POLICY_AUTO;
+		return 0;
+	}
+	if (0 == strcmp(arg,"interleave")) {
+		Policy = POLICY_INTERLEAVE;
+		return 0;
+	}
+	n = strtol(arg,&e,10);
+	if ((e == arg) || (*e != 0) || (n < 0) || (n >= MAXNODES))
+		return -1;
+	Policy = n;
+	return 0;
+}
+
+
+int numaSetCpus(int role, const char *list)
+{
+	if (-1 == parseList(list,&Cpus[role]))
+		return -1;
+	free(CpuList[role]);
+	CpuList[role] = strdup(list);
+	return 0;
+}
+
+
+/*
+ * Bind the buffer to a node or interleave it across all nodes with
+ * memory. Pages that have already been touched are migrated.
+ */
+void numaPlaceBuffer(void *buf, size_t size, int in, int out)
+{
+	unsigned long mask[MAXNODES / BITS];
+	int mode, node = Policy;
+
+	if (Policy == POLICY_NONE)
+		return;
+	(void) memset(mask,0,sizeof(mask));
+	if (Policy == POLICY_INTERLEAVE) {
+		cpu_set_t nodes;
+		if (-1 == readList("/sys/devices/system/node/has_memory",&nodes)) {
+			warningmsg("unable to determine NUMA nodes with memory\n");
+			return;
+		}
+		for (node = 0; node < MAXNODES; ++node) {
+			if (CPU_ISSET(node,&nodes))
+				mask[node / BITS] |= 1UL << (node % BITS);
+		}
+		mode = MPOL_INTERLEAVE;
+	} else {
+		mode = MPOL_BIND;
+		if (Policy == POLICY_AUTO) {
+			node = fdNode(in);
+			if (node == -1)
+				node = fdNode(out);
+			if ((node == -1) || (node >= MAXNODES)) {
+				infomsg("NUMA node of input and output unknown - leaving buffer placement to the system\n");
+				return;
+			}
+			/* prefer the local node, but do not fail if it runs out of memory */
+			mode = MPOL_PREFERRED;
+		}
+		mask[node / BITS] |= 1UL << (node % BITS);
+	}
+	if (-1 == syscall(SYS_mbind,buf,size,mode,mask,MAXNODES,MPOL_MF_MOVE)) {
+		warningmsg("unable to place buffer on NUMA nodes: %s\n",strerror(errno));
+	} else if (Policy == POLICY_INTERLEAVE) {
+		infomsg("interleaving buffer across NUMA nodes\n");
+	} else {
+		BufferNode = node;
+		infomsg("placed buffer on NUMA node %d\n",node);
+	}
+}
+
+
+/* pin the calling thread to the CPUs configured for its role */
+void numaPinThread(int role, int fd, const char *name)
+{
+	cpu_set_t set;
+	int err, node = Policy;
+
+	if (CpuList[role]) {
+		err = pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&Cpus[role]);
+		if (err)
+			warningmsg("%s: unable to run on CPUs %s: %s\n",name,CpuList[role],strerror(err));
+		else
+			infomsg("%s: running on CPUs %s\n",name,CpuList[role]);
+		return;
+	}
+	if (Policy == POLICY_AUTO) {
+		node = fdNode(fd);
+		if (node == -1)
+			node = BufferNode;
+	}
+	if ((node < 0) || (-1 == nodeCpus(node,&set)))
+		return;
+	err = pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&set);
+	if (err)
+		warningmsg("%s: unable to run on NUMA node %d: %s\n",name,node,strerror(err));
+	else
+		infomsg("%s: running on NUMA node %d\n",name,node);
+}
+
+#else
+
+int numaSetPolicy(const char *arg)
+{
+	warningmsg("NUMA placement is unsupported on this system\n");
+	return 0;
+}
+
+
+int numaSetCpus(int role, const char *list)
+{
+	warningmsg("pinning threads to CPUs is unsupported on this system\n");
+	return 0;
+}
+
+
+void numaPlaceBuffer(void *buf, size_t size, int in, int out)
+{
+}
+
+
+void numaPinThread(int role, int fd, const char *name)
+{
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+#define NUMA_INPUT 0	/* input thread */
+#define NUMA_OUTPUT 1	/* output, sender and hash threads */
+
+int numaSetPolicy(const char *arg);
+int numaSetCpus(int role, const char *list);
+void numaPlaceBuffer(void *buf, size_t size, int in, int out);
+void numaPinThread(int role, int fd, const char *name);
+
+#endif
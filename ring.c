@@ -0,0 +1,313 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "ring.h"
+#include "common.h"
+#include "elastic.h"
+#include "dest.h"
+#include "globals.h"
+#include "log.h"
+#include "settings.h"
+
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Hand over of buffer blocks from the input thread to the output
+ * thread. Each side only advances its own counters, so no locks are
+ * needed. A side only parks when the ring is full or empty. It
+ * announces how many blocks it needs before parking, so the other side
+ * only makes a system call when the parked side can actually continue.
+ * The counters wrap around; only their differences are used.
+ */
+
+typedef struct {
+	unsigned seq;		/* incremented on every wakeup */
+	unsigned long need;	/* blocks the parked thread waits for, 0 if running */
+#ifndef __linux
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+#endif
+} park_t;
+
+#ifdef __linux
+#define PARK_INITIALIZER { 0, 0 }
+#else
+#define PARK_INITIALIZER { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+#endif
+
+static unsigned long
+	Acquired = 0,	/* blocks the input has started to fill */
+	Filled = 0,	/* blocks passed to the output */
+	Taken = 0,	/* blocks the output has taken */
+	Freed = 0;	/* blocks given back to the input */
+
+static unsigned long
+	Capacity = 0,	/* blocks that may be in use, 0 for all */
+	Peak = 0;	/* most blocks in use since the last call of ringPeak */
+
+static park_t
+	Producer = PARK_INITIALIZER,
+	Consumer = PARK_INITIALIZER;
+
+
+static inline unsigned long load(unsigned long *v)
+{
+	return __atomic_load_n(v,__ATOMIC_ACQUIRE);
+}
+
+
+static void park(park_t *p, unsigned seq)
+{
+#ifdef __linux
+	(void) syscall(SYS_futex,&p->seq,FUTEX_WAIT_PRIVATE,seq,0,0,0);
+#else
+	int err;
+
+	err = pthread_mutex_lock(&p->mtx);
+	assert(err == 0);
+	pthread_cleanup_push(releaseLock,&p->mtx);
+	while (__atomic_load_n(&p->seq,__ATOMIC_ACQUIRE) == seq) {
+		err = pthread_cond_wait(&p->cond,&p->mtx);
+		assert(err == 0);
+	}
+	pthread_cleanup_pop(1);
+#endif
+	/* waiting in a futex is no cancellation point */
+	pthread_testcancel();
+}
+
+
+static void unpark(park_t *p)
+{
+#ifdef __linux
+	(void) __atomic_add_fetch(&p->seq,1,__ATOMIC_RELEASE);
+	(void) syscall(SYS_futex,&p->seq,FUTEX_WAKE_PRIVATE,INT_MAX,0,0,0);
+#else
+	int err;
+
+	err = pthread_mutex_lock(&p->mtx);
+	assert(err == 0);
+	(void) __atomic_add_fetch(&p->seq,1,__ATOMIC_RELEASE);
+	err = pthread_cond_broadcast(&p->cond);
+	assert(err == 0);
+	err = pthread_mutex_unlock(&p->mtx);
+	assert(err == 0);
+#endif
+}
+
+
+unsigned long ringCapacity(void)
+{
+	unsigned long c = __atomic_load_n(&Capacity,__ATOMIC_RELAXED);
+	return c ? c : Numblocks;
+}
+
+
+static inline unsigned long freeBlocks(void)
+{
+	unsigned long c = ringCapacity();
+	unsigned long used = __atomic_load_n(&Acquired,__ATOMIC_RELAXED) - load(&Freed);
+	/* the capacity may have been reduced below the blocks in use */
+	return (c > used) ? c - used : 0;
+}
+
+
+/*
+ * Acquire a free block for the input. When the buffer has run full,
+ * wait until it has drained below the low watermark (option -p).
+ * Returns 0 if no block is free and wait is 0, or upon termination.
+ */
+int ringAcquire(int wait)
+{
+	unsigned long need = 1;
+	int full = 0;
+
+	for (;;) {
+		unsigned seq;
+
+		if (freeBlocks() >= need) {
+			unsigned long used = Acquired + 1 - load(&Freed);
+			if (Elastic)
+				elasticAttach(Acquired % Numblocks);
+			__atomic_store_n(&Acquired,Acquired+1,__ATOMIC_RELAXED);
+			if (used > __atomic_load_n(&Peak,__ATOMIC_RELAXED))
+				__atomic_store_n(&Peak,used,__ATOMIC_RELAXED);
+			if (full)
+				debugmsg("inputThread: low watermark reached, continuing...\n");
+			return 1;
+		}
+		if (!wait || Terminate)
+			return 0;
+		if (!full && Elastic && elasticGrow())
+			continue;
+		if (!full && (StartRead < 1)) {
+			unsigned long cap = ringCapacity();
+			debugmsg("inputThread: buffer full, waiting for it to drain.\n");
+			need = (unsigned long) floor(cap - StartRead * cap) + 1;
+			if (need > cap)
+				need = cap;
+			++FullCount;
+			full = 1;
+		}
+		seq = __atomic_load_n(&Producer.seq,__ATOMIC_ACQUIRE);
+		__atomic_store_n(&Producer.need,need,__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* an output waiting for the high watermark must not wait for a full buffer */
+		if (__atomic_load_n(&Consumer.need,__ATOMIC_RELAXED))
+			unpark(&Consumer);
+		if ((freeBlocks() < need) && !Terminate)
+			park(&Producer,seq);
+		__atomic_store_n(&Producer.need,0,__ATOMIC_RELAXED);
+	}
+}
+
+
+/* pass the block filled last to the output */
+void ringPublish(void)
+{
+	unsigned long need;
+
+	__atomic_store_n(&Filled,Filled+1,__ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	need = __atomic_load_n(&Consumer.need,__ATOMIC_RELAXED);
+	if (need && ((Filled - load(&Taken) >= need) || (Finish != -1)))
+		unpark(&Consumer);
+}
+
+
+/* blocks held by lagging senders can keep the buffer from reaching need */
+static inline int available(unsigned long need)
+{
+	unsigned long fill = load(&Filled) - Taken;
+	return (fill >= need) || (fill && ((Finish != -1) || __atomic_load_n(&Producer.need,__ATOMIC_RELAXED)));
+}
+
+
+/*
+ * Take the next filled block for the output. When the buffer has run
+ * empty, wait until it has filled up to the high watermark (option -P).
+ * Returns 1 if a block was taken, 2 if a block was taken after waiting
+ * for the high watermark, and 0 if no block is available and wait is 0,
+ * or upon termination.
+ */
+int ringTake(int wait)
+{
+	unsigned long need = 1;
+	int empty = 0;
+
+	for (;;) {
+		unsigned seq;
+
+		if (available(need)) {
+			__atomic_store_n(&Taken,Taken+1,__ATOMIC_RELEASE);
+			if (empty)
+				debugmsg("outputThread: high watermark reached, continuing...\n");
+			return empty ? 2 : 1;
+		}
+		if (!wait || Terminate)
+			return 0;
+		if (!empty && (StartWrite > 0) && (Finish == -1)) {
+			unsigned long cap = ringCapacity();
+			debugmsg("outputThread: buffer empty, waiting for it to fill\n");
+			need = (unsigned long) ceil((StartWrite - DBL_EPSILON) * cap);
+			if (need > cap)
+				need = cap;
+			else if (need == 0)
+				need = 1;
+			if (Taken)
+				++EmptyCount;
+			empty = 1;
+		}
+		seq = __atomic_load_n(&Consumer.seq,__ATOMIC_ACQUIRE);
+		__atomic_store_n(&Consumer.need,need,__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!available(need) && !Terminate)
+			park(&Consumer,seq);
+		__atomic_store_n(&Consumer.need,0,__ATOMIC_RELAXED);
+	}
+}
+
+
+/* give n blocks back to the input */
+void ringRelease(unsigned long n)
+{
+	unsigned long need;
+
+	if (Elastic) {
+		unsigned long i;
+		for (i = 0; i < n; ++i)
+			elasticDetach((Freed + i) % Numblocks);
+	}
+	(void) __atomic_add_fetch(&Freed,n,__ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	need = __atomic_load_n(&Producer.need,__ATOMIC_RELAXED);
+	if (need && (freeBlocks() >= need))
+		unpark(&Producer);
+}
+
+
+/* number of filled blocks the output has not taken yet */
+unsigned long ringFill(void)
+{
+	return load(&Filled) - load(&Taken);
+}
+
+
+/* wake up both sides, e.g. to let them notice a termination request */
+void ringWakeup(void)
+{
+	unpark(&Producer);
+	unpark(&Consumer);
+}
+
+
+/* change the number of blocks that may be in use */
+void ringResize(unsigned long capacity)
+{
+	assert((capacity > 0) && (capacity <= Numblocks));
+	__atomic_store_n(&Capacity,capacity,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&Producer.need,__ATOMIC_RELAXED))
+		unpark(&Producer);
+}
+
+
+/* number of blocks acquired by the input and not yet released */
+unsigned long ringUsed(void)
+{
+	return load(&Acquired) - load(&Freed);
+}
+
+
+/* most blocks in use since the last call */
+unsigned long ringPeak(void)
+{
+	return __atomic_exchange_n(&Peak,ringUsed(),__ATOMIC_RELAXED);
+}
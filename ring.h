@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+/* input side */
+int ringAcquire(int wait);
+void ringPublish(void);
+
+/* output side */
+int ringTake(int wait);
+void ringRelease(unsigned long n);
+
+unsigned long ringFill(void);
+void ringWakeup(void);
+
+/* elastic buffer */
+unsigned long ringCapacity(void);
+void ringResize(unsigned long capacity);
+unsigned long ringUsed(void);
+unsigned long ringPeak(void);
+
+#endif
@@ -18,9 +18,11 @@
  */
 
 #include "mbconf.h"
+#include "compress.h"
 #include "dest.h"
 #include "hashing.h"
 #include "network.h"
+#include "numa.h"
 #include "settings.h"
 #include "globals.h"
 #include "log.h"
@@ -50,6 +52,13 @@ int	Autoloader = 0,
 	Status = 1,
 	Memlock = 0,
 	TapeAware = 0,
+	Records = 0,		/* keep the records of variable block tapes */
+	NoCache = 0,		/* keep regular files out of the page cache */
+	Framed = 0,		/* frame the blocks on network connections */
+	FrameCRC = 0,		/* checksum every frame */
+	Splice = 0,
+	Offload = 1,
+	HugePages = 0,
 	Memmap = 0,
 	Quiet = 0,
 	Options = 0,
@@ -59,13 +68,25 @@ int	Autoloader = 0,
 
 unsigned int
 	NumVolumes = 1,		/* number of input volumes, 0 for interactive prompting */
-	AutoloadTime = 0;
+	AutoloadTime = 0,
+	InQueue = 0,		/* number of io_uring reads in flight, 0 for read() */
+	Readers = 0,		/* number of threads reading seekable input, 0 for one */
+	Streams = 1,		/* number of TCP connections to a network peer */
+	CompressThreads = 0,	/* threads compressing network frames, 0 for all CPUs */
+	HashThreads = 0,	/* threads calculating a tree hash, 0 for all CPUs */
+	HashGroups = 1,		/* threads calculating the other hashes */
+	OutQueue = 0,		/* number of io_uring writes in flight, 0 for write() */
+	ElasticWindow = 10;	/* seconds the buffer must stay mostly empty to shrink */
 
 long
 	AvP = 0,		/* available pages */
 	NumP = 0;		/* total number of physical pages */
 
+long long
+	Prealloc = -1;		/* expected output size, -1 for the input size, 0 for none */
+
 unsigned long
+	FlushAfter = 0,		/* milliseconds before a partial block is passed on, 0 for never */
 	Timeout = 0,
 	Numblocks = 512,	/* number of buffer blocks */
 	Outsize = 10240;
@@ -76,6 +97,7 @@ unsigned long long
 	MaxWriteSpeed = 0,
 	Totalmem = 0,
 	OutVolsize = 0,
+	ElasticMin = 0,		/* minimum size of an elastic buffer, 0 for a fixed buffer */
 	Pause = 0;
 
 float	StatusInterval = 0.5;	/* status update interval time */
@@ -88,7 +110,8 @@ const char
 	*OutFile = 0,
 	*AutoloadCmd = 0;
 char
-	*Tmpfile = 0;
+	*Tmpfile = 0,
+	*SpillFile = 0;		/* overflow tier for a full buffer */
 
 extern void *watchdogThread(void *ignored);
 
@@ -173,6 +196,25 @@ static flag_t parseFlag(const char *valuestr)
 }
 
 
+/* parses a time like 50ms or 1.5s (the default unit), returns milliseconds or -1 */
+static long parseTime(const char *valuestr)
+{
+	char *e;
+	double t = strtod(valuestr,&e);
+
+	if ((e == valuestr) || (t < 0))
+		return -1;
+	if (0 == strcmp(e,"ms"))
+		t /= 1000;
+	else if ((*e != 0) && strcmp(e,"s"))
+		return -1;
+	if (t > 86400)
+		return -1;
+	t *= 1000;
+	return ((t > 0) && (t < 1)) ? 1 : (long) t;
+}
+
+
 void readConfigFile(const char *cfname)
 {
 	int df,lineno = 0;
@@ -227,7 +269,7 @@ void readConfigFile(const char *cfname)
 			line = nl;
 			continue;
 		}
-		a = sscanf(line,"%63[A-Za-z]%*[ \t=:]%63[0-9a-zA-Z.]",key,valuestr);
+		a = sscanf(line,"%63[A-Za-z]%*[ \t=:]%63[0-9a-zA-Z.,/_-]",key,valuestr);
 		if (a != 2) {
 			warningmsg("config file %s, line %d: error parsing '%s'\n",cfname,lineno,line);
 			line = nl;
@@ -293,6 +335,100 @@ void readConfigFile(const char *cfname)
 				Timeout = t;
 				debugmsg("Timeout = %lu sec.\n",Timeout);
 			}
+		} else if (strcasecmp(key,"inqueue") == 0) {
+			errno = 0;
+			long q = strtol(valuestr,0,0);
+			if ((q < 0) || (q > UINT16_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				InQueue = q;
+				debugmsg("InQueue = %u\n",InQueue);
+			}
+		} else if (strcasecmp(key,"readers") == 0) {
+			errno = 0;
+			long r = strtol(valuestr,0,0);
+			if ((r < 0) || (r > UINT8_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				Readers = r;
+				debugmsg("Readers = %u\n",Readers);
+			}
+		} else if (strcasecmp(key,"streams") == 0) {
+			errno = 0;
+			long r = strtol(valuestr,0,0);
+			if ((r < 1) || (r > UINT8_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				Streams = r;
+				debugmsg("Streams = %u\n",Streams);
+			}
+		} else if (strcasecmp(key,"compress") == 0) {
+			if (-1 == compressSet(valuestr))
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			else
+				debugmsg("compress = %s\n",valuestr);
+		} else if (strcasecmp(key,"compressthreads") == 0) {
+			errno = 0;
+			long r = strtol(valuestr,0,0);
+			if ((r < 0) || (r > UINT8_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				CompressThreads = r;
+				debugmsg("CompressThreads = %u\n",CompressThreads);
+			}
+		} else if (strcasecmp(key,"hashthreads") == 0) {
+			errno = 0;
+			long r = strtol(valuestr,0,0);
+			if ((r < 0) || (r > UINT8_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				HashThreads = r;
+				debugmsg("HashThreads = %u\n",HashThreads);
+			}
+		} else if (strcasecmp(key,"hashgroups") == 0) {
+			errno = 0;
+			long r = strtol(valuestr,0,0);
+			if ((r < 1) || (r > UINT8_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				HashGroups = r;
+				debugmsg("HashGroups = %u\n",HashGroups);
+			}
+		} else if (strcasecmp(key,"outqueue") == 0) {
+			errno = 0;
+			long q = strtol(valuestr,0,0);
+			if ((q < 0) || (q > UINT16_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				OutQueue = q;
+				debugmsg("OutQueue = %u\n",OutQueue);
+			}
+		} else if (strcasecmp(key,"splice") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				Splice = 1;
+				debugmsg("splice = on\n");
+				break;
+			case off:
+				Splice = 0;
+				debugmsg("splice = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
+		} else if (strcasecmp(key,"offload") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				Offload = 1;
+				debugmsg("offload = on\n");
+				break;
+			case off:
+				Offload = 0;
+				debugmsg("offload = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
 		} else if (strcasecmp(key,"showstatus") == 0) {
 			switch (parseFlag(valuestr)) {
 			case on:
@@ -319,6 +455,58 @@ void readConfigFile(const char *cfname)
 			default:
 				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
 			}
+		} else if (strcasecmp(key,"records") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				Records = 1;
+				debugmsg("records = on\n");
+				break;
+			case off:
+				Records = 0;
+				debugmsg("records = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
+		} else if (strcasecmp(key,"framed") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				Framed = 1;
+				debugmsg("framed = on\n");
+				break;
+			case off:
+				Framed = 0;
+				debugmsg("framed = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
+		} else if (strcasecmp(key,"framecrc") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				FrameCRC = 1;
+				debugmsg("framecrc = on\n");
+				break;
+			case off:
+				FrameCRC = 0;
+				debugmsg("framecrc = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
+		} else if (strcasecmp(key,"nocache") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				NoCache = 1;
+				debugmsg("nocache = on\n");
+				break;
+			case off:
+				NoCache = 0;
+				debugmsg("nocache = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
 		} else if (strcasecmp(key,"logstatus") == 0) {
 			switch (parseFlag(valuestr)) {
 			case on:
@@ -345,6 +533,34 @@ void readConfigFile(const char *cfname)
 			default:
 				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
 			}
+		} else if (strcasecmp(key,"hugepages") == 0) {
+			switch (parseFlag(valuestr)) {
+			case on:
+				HugePages = 1;
+				debugmsg("hugepages = on\n");
+				break;
+			case off:
+				HugePages = 0;
+				debugmsg("hugepages = off\n");
+				break;
+			default:
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			}
+		} else if (strcasecmp(key,"numa") == 0) {
+			if (-1 == numaSetPolicy(valuestr))
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			else
+				debugmsg("numa = %s\n",valuestr);
+		} else if (strcasecmp(key,"inputcpus") == 0) {
+			if (-1 == numaSetCpus(NUMA_INPUT,valuestr))
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			else
+				debugmsg("inputcpus = %s\n",valuestr);
+		} else if (strcasecmp(key,"outputcpus") == 0) {
+			if (-1 == numaSetCpus(NUMA_OUTPUT,valuestr))
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			else
+				debugmsg("outputcpus = %s\n",valuestr);
 		} else if (strcasecmp(key,"printpid") == 0) {
 			switch (parseFlag(valuestr)) {
 			case on:
@@ -356,6 +572,29 @@ void readConfigFile(const char *cfname)
 			default:
 				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
 			}
+		} else if (strcasecmp(key,"elasticwindow") == 0) {
+			errno = 0;
+			long w = strtol(valuestr,0,0);
+			if ((w <= 0) || (w > UINT16_MAX) || (errno != 0)) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				ElasticWindow = w;
+				debugmsg("ElasticWindow = %u\n",ElasticWindow);
+			}
+		} else if (strcasecmp(key,"flushafter") == 0) {
+			long t = parseTime(valuestr);
+			if (t < 0) {
+				warningmsg("invalid argument for %s: \"%s\"\n",key,valuestr);
+			} else {
+				FlushAfter = t;
+				debugmsg("FlushAfter = %lums\n",FlushAfter);
+			}
+		} else if (strcasecmp(key,"spill") == 0) {
+			free(SpillFile);
+			SpillFile = strdup(valuestr);
+			if (!SpillFile)
+				fatal("out of memory\n");
+			debugmsg("SpillFile = %s\n",SpillFile);
 		} else if (strcasecmp(key,"StatusInterval") == 0) {
 			float itv;
 			if ((1 == sscanf(valuestr,"%f",&itv)) && (itv > 0)) {
@@ -366,6 +605,9 @@ void readConfigFile(const char *cfname)
 			}
 		} else if (strcasecmp(key,"verbose") == 0) {
 			setVerbose(valuestr);
+		} else if ((strcasecmp(key,"prealloc") == 0) && (parseFlag(valuestr) == off)) {
+			Prealloc = 0;
+			debugmsg("prealloc = off\n");
 		} else {
 			unsigned long long value = 0;
 			const char *argerror = calcval(valuestr,&value);
@@ -390,6 +632,12 @@ void readConfigFile(const char *cfname)
 				} else {
 					warningmsg("Unable to determine page size or amount of available memory - please specify an absolute amount of memory.\n");
 				}
+			} else if (strcasecmp(key,"prealloc") == 0) {
+				Prealloc = value;
+				debugmsg("Prealloc = %lldk\n",Prealloc>>10);
+			} else if (strcasecmp(key,"elastic") == 0) {
+				ElasticMin = value;
+				debugmsg("ElasticMin = %lluk\n",ElasticMin>>10);
 			} else if (strcasecmp(key,"tcpbuffer") == 0) {
 				TCPBufSize = value;
 				debugmsg("TCPBufSize = %lu\n",TCPBufSize);
@@ -402,27 +650,65 @@ void readConfigFile(const char *cfname)
 }
 
 
-long maxSemValue()
+/* size of the default huge pages in bytes, 0 if unknown */
+static size_t hugePageSize(void)
 {
-	long mxnrsem = sysconf(_SC_SEM_VALUE_MAX);
-	if (-1 == mxnrsem) {
-#ifdef SEM_MAX_VALUE
-		mxnrsem = SEM_MAX_VALUE;
-#else
-		mxnrsem = UINT8_MAX;
-		warningmsg("unable to determine maximum value of semaphores\n");
+	char line[128];
+	size_t kb = 0;
+	FILE *f = fopen("/proc/meminfo","r");
+
+	if (f == 0)
+		return 0;
+	while (fgets(line,sizeof(line),f)) {
+		if (1 == sscanf(line,"Hugepagesize: %zu kB",&kb))
+			break;
+	}
+	(void) fclose(f);
+	return kb << 10;
+}
+
+
+/*
+ * Try to back the buffer with huge pages to save TLB misses. Reserved
+ * hugetlb pages are preferred over transparent huge pages. Returns 0 if
+ * neither is available.
+ */
+static char *allocHugePages(size_t size)
+{
+	size_t hps = hugePageSize();
+	void *b = 0;
+
+#ifdef MAP_HUGETLB
+	if (hps) {
+		b = mmap(0,(size + hps - 1) / hps * hps,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+		if (b != MAP_FAILED) {
+			HugePgSz = hps;
+			infomsg("buffer is backed by hugetlb pages of %zu kB\n",hps >> 10);
+			return b;
+		}
+		debugmsg("unable to map hugetlb pages: %s\n",strerror(errno));
+	}
 #endif
+#ifdef MADV_HUGEPAGE
+	if (hps == 0)
+		hps = 2 << 20;
+	if (0 == posix_memalign(&b,hps,size)) {
+		if (0 == madvise(b,size,MADV_HUGEPAGE)) {
+			infomsg("requested transparent huge pages for the buffer\n");
+			return b;
+		}
+		debugmsg("unable to request transparent huge pages: %s\n",strerror(errno));
+		free(b);
 	}
-	return mxnrsem;
+#endif
+	infomsg("huge pages are unavailable - buffer is backed by regular pages\n");
+	return 0;
 }
 
 
 void initBuffer()
 {
 	int c;
-	/* check that we stay within system limits */
-	if (Numblocks > maxSemValue())
-		fatal("cannot allocate more than %d blocks.\nThis is a system dependent limit, depending on the maximum semaphore value.\nPlease choose a bigger block size.\n",maxSemValue());
 	if (Numblocks > 10000)
 		warningmsg("high value of number of blocks(%lu): increase block size for better performance\n",Numblocks);
 	if ((AvP != 0) && (((AvP * PgSz) / 2) < (Numblocks * Blocksize)))
@@ -455,6 +741,8 @@ void initBuffer()
 		}
 		if (-1 == Tmp)
 			fatal("could not create temporary file (%s): %s\n",Tmpfile,strerror(errno));
+		if (HugePages)
+			warningmsg("huge pages are not supported for file based buffers\n");
 		if (strncmp(Tmpfile,"/dev/",5))
 			(void) unlink(Tmpfile);
 		/* resize the file. Needed - at least under linux, who knows why? */
@@ -473,7 +761,11 @@ void initBuffer()
 			,Blocksize & 0x3ff ? Blocksize : (Blocksize >> 10)
 			,Blocksize & 0x3ff ? "bytes" : "kB"
 			,(unsigned long long)((Numblocks*Blocksize) >> 10));
-		Buffer[0] = (char *) valloc(Blocksize * Numblocks);
+		Buffer[0] = 0;
+		if (HugePages)
+			Buffer[0] = allocHugePages(Blocksize * Numblocks);
+		if (Buffer[0] == 0)
+			Buffer[0] = (char *) valloc(Blocksize * Numblocks);
 		if (Buffer[0] == 0)
 			fatal("Could not allocate enough memory (%lld requested): %s\n",(unsigned long long)Blocksize * Numblocks,strerror(errno));
 #ifdef MADV_DONTFORK
@@ -481,9 +773,18 @@ void initBuffer()
 			warningmsg("unable to advise memory handling of buffer: %s\n",strerror(errno));
 #endif
 	}
+	if (FlushAfter || Records || Framed) {
+		Lengths = malloc(Numblocks * sizeof(size_t));
+		if (!Lengths)
+			fatal("out of memory\n");
+		for (c = 0; c < Numblocks; c++)
+			Lengths[c] = Blocksize;
+	}
 	for (c = 1; c < Numblocks; c++) {
 		Buffer[c] = Buffer[0] + Blocksize * c;
-		*Buffer[c] = 0;	/* touch every block before locking */
+		/* touch every block before locking, but leave the growth of elastic buffers untouched */
+		if ((ElasticMin == 0) || (c < 5) || (Blocksize * c < ElasticMin))
+			*Buffer[c] = 0;
 	}
 
 #ifdef _POSIX_MEMLOCK_RANGE
@@ -559,6 +860,14 @@ static void usage(void)
 #endif
 #ifdef _POSIX_MEMLOCK_RANGE
 		"-L         : lock buffer in memory (unusable with file based buffers)\n"
+		"--hugepages: back the buffer with huge pages if available\n"
+		"--elastic <size>: let the buffer shrink down to <size> when it stays mostly\n"
+		"             empty, and grow up to the size of options -m/-b when it runs full\n"
+		"--elastic-window <sec>: shrink after the buffer stayed mostly empty for <sec>\n"
+		"--numa <n> : place the buffer on NUMA node <n>, the node local to the\n"
+		"             input and output devices (auto), or on all nodes (interleave)\n"
+		"--input-cpus <list>: run the input thread on CPUs <list> (e.g. 0-3,8)\n"
+		"--output-cpus <list>: run the output, sender, and hash threads on CPUs <list>\n"
 #endif
 		"-d         : use blocksize of device for output\n"
 		"-D <size>  : assumed output device size (default: infinite/auto-detect)\n"
@@ -574,6 +883,8 @@ static void usage(void)
 		"-n <num>   : <num> volumes for input, '0' to prompt interactively\n"
 		"-t         : use memory mapped temporary file (for huge buffer)\n"
 		"-T <file>  : as -t but uses <file> as buffer\n"
+		"--spill <file>: when the buffer is full, store further blocks in <file>\n"
+		"--flush-after <time>: pass on partial blocks after <time> (e.g. 50ms)\n"
 		"-l <file>  : use <file> for logging messages\n"
 		"-u <num>   : pause <num> milliseconds after each write\n"
 		"-r <rate>  : limit read rate to <rate> B/s, where <rate> can be given in b,k,M,G\n"
@@ -589,8 +900,12 @@ static void usage(void)
 #if defined HAVE_LIBCRYPTO || defined HAVE_LIBMD5 || defined HAVE_LIBMHASH
 		"-H\n"
 		"--md5      : generate md5 hash of transfered data\n"
-		"--hash <a> : use algorithm <a>, if <a> is 'list' possible algorithms are listed\n"
 #endif
+		"--hash <a> : use algorithm <a>, if <a> is 'list' possible algorithms are listed\n"
+		"--hash-threads <num>: calculate tree hashes like blake3 with <num> threads\n"
+		"--hash-groups <num>: calculate the other hashes with <num> threads\n"
+		"--manifest <file>: write the xxh3 hash of every block to <file>\n"
+		"--verify-manifest <file>: report the blocks that differ from the manifest <file>\n"
 		"--pid      : print PID of this instance\n"
 		"-W <time>  : set watchdog timeout to <time> seconds\n"
 		"-4         : force use of IPv4\n"
@@ -599,6 +914,20 @@ static void usage(void)
 		"--tcpbuffer: size for TCP buffer\n"
 		"--tapeaware: write to end of tape instead of stopping when the drive signals\n"
 		"             the media end is approaching (write until 2x ENOSPC errors)\n"
+		"--records  : keep the records of variable block tapes (-s sets the maximum)\n"
+		"--nocache  : keep regular input and output files out of the page cache\n"
+		"--prealloc <size>: preallocate output files for <size> bytes (0 for none)\n"
+		"--inqueue <num>: keep <num> reads in flight using io_uring (seekable input)\n"
+		"--readers <num>: read seekable input with <num> threads in parallel\n"
+		"--streams <num>: use up to <num> TCP connections for -I and -O\n"
+		"--framed   : frame the data of -I and -O, so the end can be verified\n"
+		"--frame-crc: check every frame of -I and -O with CRC32C\n"
+		"--compress <codec>: compress frames of -O with lz4, zstd[:<level>], or auto\n"
+		"--compress-threads <num>: compress and decompress frames with <num> threads\n"
+		"--outqueue <num>: keep <num> writes in flight using io_uring (seekable output)\n"
+		"--splice   : pass pages to pipes and sockets with vmsplice instead of copying\n"
+		"--no-offload: always pass the data through the buffer, even if the kernel\n"
+		"             could copy it directly from the input file to the output\n"
 		"-V\n"
 		"--version  : print version information\n"
 		"Unsupported buffer options: -t -Z -B\n"
@@ -727,9 +1056,89 @@ int parseOption(int c, int argc, const char **argv)
 	} else if (!strcmp("--tcpbuffer",argv[c])) {
 		TCPBufSize = calcint(argv,++c,TCPBufSize);
 		debugmsg("TCPBufSize = %lu\n",TCPBufSize);
+	} else if (!strcmp("--readers",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --readers\n");
+		long r = strtol(argv[c],0,0);
+		if ((r < 0) || (r > UINT8_MAX))
+			fatal("invalid argument to option --readers: \"%s\"\n",argv[c]);
+		Readers = r;
+		debugmsg("Readers = %u\n",Readers);
+	} else if (!strcmp("--streams",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --streams\n");
+		long r = strtol(argv[c],0,0);
+		if ((r < 1) || (r > UINT8_MAX))
+			fatal("invalid argument to option --streams: \"%s\"\n",argv[c]);
+		Streams = r;
+		debugmsg("Streams = %u\n",Streams);
+	} else if (!strcmp("--compress",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --compress\n");
+		if (-1 == compressSet(argv[c]))
+			fatal("invalid argument to option --compress: \"%s\"\n",argv[c]);
+		debugmsg("compress = %s\n",argv[c]);
+	} else if (!strcmp("--compress-threads",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --compress-threads\n");
+		long r = strtol(argv[c],0,0);
+		if ((r < 0) || (r > UINT8_MAX))
+			fatal("invalid argument to option --compress-threads: \"%s\"\n",argv[c]);
+		CompressThreads = r;
+		debugmsg("CompressThreads = %u\n",CompressThreads);
+	} else if (!strcmp("--inqueue",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --inqueue\n");
+		long q = strtol(argv[c],0,0);
+		if ((q < 0) || (q > UINT16_MAX))
+			fatal("invalid argument to option --inqueue: \"%s\"\n",argv[c]);
+		InQueue = q;
+#ifndef HAVE_IO_URING
+		if (InQueue)
+			warningmsg("io_uring is unsupported on this system - using read() for input\n");
+#endif
+		debugmsg("InQueue = %u\n",InQueue);
+	} else if (!strcmp("--outqueue",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --outqueue\n");
+		long q = strtol(argv[c],0,0);
+		if ((q < 0) || (q > UINT16_MAX))
+			fatal("invalid argument to option --outqueue: \"%s\"\n",argv[c]);
+		OutQueue = q;
+#ifndef HAVE_IO_URING
+		if (OutQueue)
+			warningmsg("io_uring is unsupported on this system - using write() for output\n");
+#endif
+		debugmsg("OutQueue = %u\n",OutQueue);
+	} else if (!strcmp("--splice",argv[c])) {
+		Splice = 1;
+#ifndef HAVE_VMSPLICE
+		warningmsg("vmsplice is unsupported on this system - using write() for output\n");
+#endif
+		debugmsg("moving pages to pipes and sockets with vmsplice\n");
+	} else if (!strcmp("--no-offload",argv[c])) {
+		Offload = 0;
+		debugmsg("passing all data through the buffer\n");
 	} else if (!strcmp("--tapeaware",argv[c])) {
 		TapeAware = 1;
 		debugmsg("sensing early end-of-tape warning\n");
+	} else if (!strcmp("--records",argv[c])) {
+		Records = 1;
+		debugmsg("keeping input records\n");
+	} else if (!strcmp("--prealloc",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --prealloc\n");
+		Prealloc = strcmp(argv[c],"0") ? calcint(argv,c,0) : 0;
+		debugmsg("Prealloc = %lldk\n",Prealloc>>10);
+	} else if (!strcmp("--framed",argv[c])) {
+		Framed = 1;
+		debugmsg("framing network transfers\n");
+	} else if (!strcmp("--frame-crc",argv[c])) {
+		FrameCRC = 1;
+		debugmsg("checksumming network frames\n");
+	} else if (!strcmp("--nocache",argv[c])) {
+		NoCache = 1;
+		debugmsg("keeping files out of the page cache\n");
 	} else if (!strcmp("-d",argv[c])) {
 #ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
 		SetOutsize = 1;
@@ -777,6 +1186,7 @@ int parseOption(int c, int argc, const char **argv)
 		}
 	} else if (!argcheck("-o",argv,&c,argc)) {
 		dest_t *dest = malloc(sizeof(dest_t));
+		bzero(dest,sizeof(dest_t));
 		if (strcmp(argv[c],"-")) {
 			debugmsg("output file: %s\n",argv[c]);
 			dest->arg = argv[c];
@@ -830,6 +1240,22 @@ int parseOption(int c, int argc, const char **argv)
 			fatal("out of memory\n");
 		Memmap = 1;
 		debugmsg("Tmpfile = %s\n",Tmpfile);
+	} else if (!strcmp("--flush-after",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --flush-after\n");
+		long t = parseTime(argv[c]);
+		if (t < 0)
+			fatal("invalid argument to option --flush-after: \"%s\"\n",argv[c]);
+		FlushAfter = t;
+		debugmsg("FlushAfter = %lums\n",FlushAfter);
+	} else if (!strcmp("--spill",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --spill\n");
+		free(SpillFile);
+		SpillFile = strdup(argv[c]);
+		if (!SpillFile)
+			fatal("out of memory\n");
+		debugmsg("SpillFile = %s\n",SpillFile);
 	} else if (!strcmp("-t",argv[c])) {
 		Memmap = 1;
 		debugmsg("Memmap = 1\n");
@@ -886,6 +1312,40 @@ int parseOption(int c, int argc, const char **argv)
 		if ((StartRead >= 1) || (StartRead < 0))
 			fatal("error in argument -p: must be bigger or equal to 0 and less than 100\n");
 		debugmsg("StartRead = %1.2lf\n",StartRead);
+	} else if (!strcmp("--elastic",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --elastic\n");
+		ElasticMin = calcint(argv,c,0);
+		debugmsg("ElasticMin = %lluk\n",ElasticMin>>10);
+	} else if (!strcmp("--elastic-window",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --elastic-window\n");
+		long w = strtol(argv[c],0,0);
+		if ((w <= 0) || (w > UINT16_MAX))
+			fatal("invalid argument to option --elastic-window: \"%s\"\n",argv[c]);
+		ElasticWindow = w;
+		debugmsg("ElasticWindow = %u\n",ElasticWindow);
+	} else if (!strcmp("--numa",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --numa\n");
+		if (-1 == numaSetPolicy(argv[c]))
+			fatal("invalid argument to option --numa: \"%s\"\n",argv[c]);
+		debugmsg("numa = %s\n",argv[c]);
+	} else if (!strcmp("--input-cpus",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --input-cpus\n");
+		if (-1 == numaSetCpus(NUMA_INPUT,argv[c]))
+			fatal("invalid argument to option --input-cpus: \"%s\"\n",argv[c]);
+		debugmsg("input CPUs = %s\n",argv[c]);
+	} else if (!strcmp("--output-cpus",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --output-cpus\n");
+		if (-1 == numaSetCpus(NUMA_OUTPUT,argv[c]))
+			fatal("invalid argument to option --output-cpus: \"%s\"\n",argv[c]);
+		debugmsg("output CPUs = %s\n",argv[c]);
+	} else if (!strcmp("--hugepages",argv[c])) {
+		HugePages = 1;
+		debugmsg("trying to use huge pages for the buffer\n");
 	} else if (!strcmp("-L",argv[c])) {
 #ifdef _POSIX_MEMLOCK_RANGE
 		Memlock = 1;
@@ -926,6 +1386,30 @@ int parseOption(int c, int argc, const char **argv)
 			++Hashers;
 			++NumSenders;
 		}
+	} else if (!strcmp("--manifest",argv[c]) || !strcmp("--verify-manifest",argv[c])) {
+		int verify = (argv[c][2] == 'v');
+		if (++c == argc)
+			fatal("missing argument to option %s\n",argv[c-1]);
+		if (addManifest(argv[c],verify)) {
+			++Hashers;
+			++NumSenders;
+		}
+	} else if (!strcmp("--hash-threads",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --hash-threads\n");
+		long r = strtol(argv[c],0,0);
+		if ((r < 0) || (r > UINT8_MAX))
+			fatal("invalid argument to option --hash-threads: \"%s\"\n",argv[c]);
+		HashThreads = r;
+		debugmsg("HashThreads = %u\n",HashThreads);
+	} else if (!strcmp("--hash-groups",argv[c])) {
+		if (++c == argc)
+			fatal("missing argument to option --hash-groups\n");
+		long r = strtol(argv[c],0,0);
+		if ((r < 1) || (r > UINT8_MAX))
+			fatal("invalid argument to option --hash-groups: \"%s\"\n",argv[c]);
+		HashGroups = r;
+		debugmsg("HashGroups = %u\n",HashGroups);
 	} else if (!strcmp("--pid",argv[c])) {
 		int pid = getpid();
 		printmsg("PID is %d\n",pid);
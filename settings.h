@@ -34,6 +34,13 @@ extern int
 	Direct,
 	Memlock,	/* protoect buffer in memory against swapping */
 	TapeAware,
+	Records,	/* keep the records of variable block tapes */
+	NoCache,	/* keep regular files out of the page cache */
+	Framed,		/* frame the blocks on network connections */
+	FrameCRC,	/* checksum every frame */
+	Splice,		/* pass pages to pipes and sockets with vmsplice */
+	Offload,	/* let the kernel copy input files without the buffer */
+	HugePages,	/* back the buffer with huge pages */
 	Memmap,
 	Options,
 	OptSync,
@@ -44,13 +51,25 @@ extern int
 
 extern unsigned int
 	NumVolumes,	/* number of volumes to expect while reading */
-	AutoloadTime;	/* time to wait after an autoload command */
+	AutoloadTime,	/* time to wait after an autoload command */
+	InQueue,	/* number of io_uring reads in flight */
+	Readers,	/* number of threads reading seekable input */
+	Streams,	/* number of TCP connections to a network peer */
+	CompressThreads,	/* threads compressing network frames */
+	HashThreads,	/* threads calculating a tree hash */
+	HashGroups,	/* threads calculating the other hashes */
+	OutQueue,	/* number of io_uring writes in flight */
+	ElasticWindow;	/* seconds the buffer must stay mostly empty to shrink */
 
 extern long
 	AvP,
 	NumP;
 
+extern long long
+	Prealloc;	/* expected output size, -1 for the input size, 0 for none */
+
 extern unsigned long
+	FlushAfter,		/* milliseconds before a partial block is passed on */
 	Numblocks,		/* number of buffer blocks */
 	Timeout,
 	Outsize;
@@ -61,6 +80,7 @@ extern unsigned long long
 	MaxWriteSpeed,
 	Totalmem,
 	Pause,
+	ElasticMin,	/* minimum size of an elastic buffer */
 	OutVolsize;
 
 extern const char
@@ -69,7 +89,8 @@ extern const char
 	*AutoloadCmd;
 
 extern char
-	*Tmpfile;
+	*Tmpfile,
+	*SpillFile;
 
 extern float
 	StatusInterval;		/* status update interval time */
@@ -82,6 +103,5 @@ void readConfigFile(const char *cfname);
 void initBuffer();
 void searchOptionV(int argc, const char **argv);
 int parseOption(int c, int argc, const char **argv);
-long maxSemValue();
 
 #endif
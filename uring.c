@@ -0,0 +1,225 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbconf.h"
+#include "uring.h"
+#include "log.h"
+
+#ifdef HAVE_IO_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring binding on top of the raw system calls. This avoids
+ * a build dependency on liburing. Every ring is used by exactly one
+ * thread, so only the accesses to the indices shared with the kernel
+ * need ordering.
+ */
+
+/* largest transfer Linux performs in a single read or write */
+#define MAXIOSIZE 0x7ffff000
+
+struct uring {
+	int fd;
+	unsigned entries, queued, inflight;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqe_size;
+};
+
+
+static int probeOps(int fd)
+{
+	size_t s = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *p = calloc(1,s);
+	int ok = 0;
+
+	assert(p);
+	if (0 == syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,p,256)) {
+		ok = (p->last_op >= IORING_OP_WRITE)
+			&& (p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+			&& (p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(p);
+	return ok;
+}
+
+
+uring_t *uringOpen(unsigned entries)
+{
+	struct io_uring_params p;
+	uring_t *r;
+	int fd;
+
+	bzero(&p,sizeof(p));
+	fd = syscall(__NR_io_uring_setup,entries,&p);
+	if (fd == -1) {
+		infomsg("io_uring unavailable: %s\n",strerror(errno));
+		return 0;
+	}
+	if (!probeOps(fd)) {
+		infomsg("io_uring of this kernel does not support read and write operations\n");
+		(void) close(fd);
+		return 0;
+	}
+	r = calloc(1,sizeof(uring_t));
+	assert(r);
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(0,r->sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(0,r->cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	r->sqes = mmap(0,r->sqe_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if ((r->sq_ring == MAP_FAILED) || (r->cq_ring == MAP_FAILED) || (r->sqes == MAP_FAILED)) {
+		warningmsg("unable to map io_uring: %s\n",strerror(errno));
+		if (r->sq_ring != MAP_FAILED)
+			(void) munmap(r->sq_ring,r->sq_size);
+		if (r->cq_ring != MAP_FAILED)
+			(void) munmap(r->cq_ring,r->cq_size);
+		if (r->sqes != MAP_FAILED)
+			(void) munmap(r->sqes,r->sqe_size);
+		(void) close(fd);
+		free(r);
+		return 0;
+	}
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	infomsg("io_uring set up with %u entries\n",r->entries);
+	return r;
+}
+
+
+void uringClose(uring_t *r)
+{
+	(void) munmap(r->sqes,r->sqe_size);
+	(void) munmap(r->cq_ring,r->cq_size);
+	(void) munmap(r->sq_ring,r->sq_size);
+	(void) close(r->fd);
+	free(r);
+}
+
+
+int uringPrepare(uring_t *r, int op, int fd, void *buf, size_t len, off_t off, unsigned long long tag)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *r->sq_tail, idx;
+
+	if (tail - __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE) >= r->entries) {
+		if (-1 == uringSubmit(r,0))
+			return -1;
+		tail = *r->sq_tail;
+	}
+	idx = tail & *r->sq_mask;
+	sqe = r->sqes + idx;
+	bzero(sqe,sizeof(*sqe));
+	sqe->opcode = (op == URING_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len > MAXIOSIZE ? MAXIOSIZE : len;
+	sqe->off = off;
+	sqe->user_data = tag;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+	++r->queued;
+	return 0;
+}
+
+
+/* submit all prepared requests and wait for at least wait completions */
+int uringSubmit(uring_t *r, unsigned wait)
+{
+	int ret;
+
+	if (wait > r->queued + r->inflight)
+		wait = r->queued + r->inflight;
+	if ((wait == 0) && (r->queued == 0))
+		return 0;
+	do {
+		ret = syscall(__NR_io_uring_enter,r->fd,r->queued,wait,wait ? IORING_ENTER_GETEVENTS : 0,0,0);
+		if (ret > 0) {
+			r->queued -= ret;
+			r->inflight += ret;
+		}
+	} while (((ret == -1) && (errno == EINTR)) || ((ret > 0) && r->queued));
+	if (ret == -1) {
+		errormsg("io_uring_enter failed: %s\n",strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/* fetch one completion, returns 0 if none is available */
+int uringComplete(uring_t *r, unsigned long long *tag, int *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE))
+		return 0;
+	cqe = r->cqes + (head & *r->cq_mask);
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head,head+1,__ATOMIC_RELEASE);
+	assert(r->inflight > 0);
+	--r->inflight;
+	return 1;
+}
+
+
+unsigned uringPending(uring_t *r)
+{
+	return r->queued + r->inflight;
+}
+
+
+/* wait for all outstanding requests and discard their results */
+void uringDrain(uring_t *r)
+{
+	while (uringPending(r)) {
+		unsigned long long tag;
+		int res;
+		if (-1 == uringSubmit(r,1))
+			return;
+		while (uringComplete(r,&tag,&res))
+			debugiomsg("uringDrain(): discarding %llu = %d\n",tag,res);
+	}
+}
+
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2000-2019, Thomas Maier-Komor
+ *
+ *  This is the source code of mbuffer.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+#define URING_READ 0
+#define URING_WRITE 1
+
+typedef struct uring uring_t;
+
+uring_t *uringOpen(unsigned entries);
+void uringClose(uring_t *r);
+int uringPrepare(uring_t *r, int op, int fd, void *buf, size_t len, off_t off, unsigned long long tag);
+int uringSubmit(uring_t *r, unsigned wait);
+int uringComplete(uring_t *r, unsigned long long *tag, int *res);
+unsigned uringPending(uring_t *r);
+void uringDrain(uring_t *r);
+
+#endif